@@ -8,6 +8,9 @@ const src = [_][]const u8{
     "src/guest.c",
     "src/util/util.c",
     "src/util/printf.c",
+    "src/util/block_cache.c",
+    "src/util/buddy.c",
+    "src/util/bpf.c",
     "src/virtio/mmio.c",
     "src/virtio/block.c",
     "src/virtio/console.c",
@@ -15,6 +18,11 @@ const src = [_][]const u8{
     "src/virtio/sound.c",
 };
 
+// Built on its own as it depends on the aes_ce option
+const src_aes = [_][]const u8{
+    "src/util/aes_xts.c",
+};
+
 const src_aarch64_vgic_v2 = [_][]const u8{
     "src/arch/aarch64/vgic/vgic_v2.c",
 };
@@ -45,6 +53,9 @@ pub fn build(b: *std.Build) void {
     // Default to vGIC version 2
     const arm_vgic_version = b.option(usize, "arm_vgic_version", "ARM vGIC version to emulate") orelse null;
 
+    // Only for CPUs that implement the Cryptography Extension
+    const aes_ce = b.option(bool, "aes_ce", "Encrypt disks with the ARMv8 AES instructions") orelse false;
+
     const libvmm = b.addStaticLibrary(.{
         .name = "vmm",
         .target = target,
@@ -74,15 +85,25 @@ pub fn build(b: *std.Build) void {
             std.posix.exit(1);
         }
     };
+    const flags = [_][]const u8{
+        "-Wall",
+        "-Werror",
+        "-Wno-unused-function",
+        "-mstrict-align",
+        "-fno-sanitize=undefined", // @ivanv: ideally we wouldn't have to turn off UBSAN
+    };
     libvmm.addCSourceFiles(.{
         .files = &(src ++ src_arch),
-        .flags = &.{
-            "-Wall",
-            "-Werror",
-            "-Wno-unused-function",
-            "-mstrict-align",
-            "-fno-sanitize=undefined", // @ivanv: ideally we wouldn't have to turn off UBSAN
-        }
+        .flags = &flags,
+    });
+    if (aes_ce and !std.Target.aarch64.featureSetHas(target.result.cpu.features, .aes)) {
+        std.log.err("aes_ce needs a target CPU with the AES extension", .{});
+        std.posix.exit(1);
+    }
+    const aes_flags: []const []const u8 = if (aes_ce) &(flags ++ [_][]const u8{ "-DLIBVMM_AES_CE" }) else &flags;
+    libvmm.addCSourceFiles(.{
+        .files = &src_aes,
+        .flags = aes_flags,
     });
 
     libvmm.addIncludePath(b.path("include"));
@@ -72,6 +72,9 @@ uintptr_t blk_data;
 blk_storage_info_t *blk_storage_info;
 
 static struct virtio_blk_device virtio_blk;
+/* Both clients have the same queue capacity */
+static uint8_t virtio_blk_bookkeeping[VIRTIO_BLK_BOOKKEEPING_SIZE(BLK_QUEUE_CAPACITY_CLI0, BLK_DATA_SIZE, 1)]
+__attribute__((aligned(sizeof(uintptr_t))));
 
 void init(void)
 {
@@ -134,7 +137,9 @@ void init(void)
                                    BLK_DATA_SIZE,
                                    blk_storage_info,
                                    &blk_queue_h,
-                                   BLK_CH);
+                                   BLK_CH,
+                                   virtio_blk_bookkeeping,
+                                   sizeof(virtio_blk_bookkeeping));
     assert(success);
 
     /* Finally start the guest */
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Access to the ARM generic timer's virtual counter. Reading it from the VMM
+ * requires seL4 to give user-level access to the virtual counter, which it does
+ * by default when running as a hypervisor.
+ */
+
+static inline uint64_t arch_counter_read(void)
+{
+    uint64_t val;
+    /* The ISB stops the read from being done early */
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(val) :: "memory");
+    return val;
+}
+
+/* Frequency of the counter in Hz */
+static inline uint64_t arch_counter_freq(void)
+{
+    uint64_t val;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(val));
+    return val;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * AES-XTS (IEEE 1619) for encrypting disk data with 128 or 256-bit AES. Data
+ * is processed in data units of AES_XTS_UNIT_SIZE bytes, the tweak of each
+ * unit being its index on the disk, which makes it compatible with dm-crypt's
+ * aes-xts-plain64 with 512-byte sectors.
+ *
+ * When built with LIBVMM_AES_CE defined, for AArch64 with the AES extension
+ * enabled (e.g. with -march=armv8-a+crypto), the AES instructions are used.
+ * Otherwise a portable, but much slower, C implementation is used.
+ */
+
+#define AES_XTS_UNIT_SIZE 512
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_ROUNDS 14
+
+typedef struct aes_xts_ctx {
+    /* Round keys for encrypting data, for decrypting it, and for encrypting
+     * the tweak. The decryption keys are for the equivalent inverse cipher. */
+    uint8_t enc_keys[AES_MAX_ROUNDS + 1][AES_BLOCK_SIZE];
+    uint8_t dec_keys[AES_MAX_ROUNDS + 1][AES_BLOCK_SIZE];
+    uint8_t tweak_keys[AES_MAX_ROUNDS + 1][AES_BLOCK_SIZE];
+    int rounds;
+} aes_xts_ctx_t;
+
+/*
+ * Expand a key of 32 bytes (AES-128-XTS) or 64 bytes (AES-256-XTS). The
+ * first half of the key is for the data and the second for the tweak.
+ */
+bool aes_xts_init(aes_xts_ctx_t *ctx, const uint8_t *key, size_t key_len);
+
+/*
+ * Encrypt or decrypt len bytes, a multiple of AES_XTS_UNIT_SIZE, from src to
+ * dst. The first data unit is number unit, the following ones are numbered
+ * consecutively. src and dst may be the same but must not otherwise overlap.
+ */
+void aes_xts_encrypt(const aes_xts_ctx_t *ctx, uint64_t unit, void *dst, const void *src, size_t len);
+void aes_xts_decrypt(const aes_xts_ctx_t *ctx, uint64_t unit, void *dst, const void *src, size_t len);
+
+/*
+ * Check the implementation against IEEE 1619 vectors 1, 2 and 10, and that
+ * several data units encrypted and decrypted in place with aes_xts_encrypt
+ * and aes_xts_decrypt are numbered consecutively and round-trip. Returns true
+ * if all of them pass. Depends only on the C library headers, it is run on
+ * the development host by tests/Makefile.
+ */
+bool aes_xts_self_test(void);
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * A bounded cache of fixed size blocks, keyed by block number, using the 2Q
+ * replacement policy. Blocks seen for the first time go into a small FIFO
+ * (A1in), when they are evicted from it only their block number is remembered
+ * (A1out). Blocks that are read again while remembered in A1out are put into
+ * the main LRU list (Am). This keeps blocks that are only read once, such as
+ * those of a large sequential scan, from pushing out the frequently used ones.
+ *
+ * All memory is provided by the caller, the metadata needs to be at least
+ * BLK_CACHE_META_SIZE(capacity) bytes and the data capacity * block_size bytes.
+ */
+
+#define BLK_CACHE_NONE UINT32_MAX
+
+/* Number of blocks that are remembered after being evicted from A1in */
+#define BLK_CACHE_KOUT(capacity) ((capacity) / 2 > 0 ? (capacity) / 2 : 1)
+#define BLK_CACHE_NUM_ENTRIES(capacity) ((capacity) + BLK_CACHE_KOUT(capacity))
+#define BLK_CACHE_META_SIZE(capacity) \
+    (BLK_CACHE_NUM_ENTRIES(capacity) * (sizeof(blk_cache_entry_t) + sizeof(uint32_t)) \
+     + (capacity) * sizeof(uint32_t))
+
+typedef enum blk_cache_list_id {
+    BLK_CACHE_LIST_FREE,
+    BLK_CACHE_LIST_A1IN,
+    BLK_CACHE_LIST_A1OUT,
+    BLK_CACHE_LIST_AM,
+    BLK_CACHE_NUM_LISTS,
+} blk_cache_list_id_t;
+
+typedef struct blk_cache_entry {
+    uint32_t block;
+    /* Index of the block's data, BLK_CACHE_NONE if only the block number is
+     * remembered (A1out) */
+    uint32_t slot;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t hash_next;
+    uint8_t list;
+} blk_cache_entry_t;
+
+/* Doubly linked list of entries, the head is the most recently inserted */
+typedef struct blk_cache_list {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t len;
+} blk_cache_list_t;
+
+typedef struct blk_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    uint64_t invalidations;
+} blk_cache_stats_t;
+
+typedef struct blk_cache {
+    uintptr_t data;
+    uint32_t block_size;
+    uint32_t capacity;
+    /* Target size of A1in and maximum size of A1out */
+    uint32_t kin;
+    uint32_t kout;
+
+    blk_cache_entry_t *entries;
+    uint32_t num_entries;
+    uint32_t *buckets;
+    uint32_t *free_slots;
+    uint32_t num_free_slots;
+    blk_cache_list_t lists[BLK_CACHE_NUM_LISTS];
+
+    blk_cache_stats_t stats;
+} blk_cache_t;
+
+bool blk_cache_init(blk_cache_t *cache, uint32_t capacity, uint32_t block_size,
+                    void *meta, size_t meta_size, void *data);
+
+/* Return the cached data of a block, or NULL if it is not cached */
+void *blk_cache_lookup(blk_cache_t *cache, uint32_t block);
+
+/* Same as blk_cache_lookup but without counting a hit or miss or updating recency */
+bool blk_cache_contains(blk_cache_t *cache, uint32_t block);
+
+/* Add a block to the cache, or update its contents if it is already cached */
+void blk_cache_insert(blk_cache_t *cache, uint32_t block, const void *data);
+
+/* Drop count blocks starting from block from the cache */
+void blk_cache_invalidate(blk_cache_t *cache, uint32_t block, uint32_t count);
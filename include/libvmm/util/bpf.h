@@ -0,0 +1,100 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * An interpreter for classic BPF packet filters, as produced by tcpdump -dd
+ * and used by SO_ATTACH_FILTER. The instructions are the same as Linux's
+ * struct sock_filter. Ancillary loads and extensions are not supported.
+ *
+ * Programs must be checked with bpf_verify before they are run. A verified
+ * program always ends, and never reads scratch memory that has not been
+ * written. Loads beyond the end of the packet and division by zero make
+ * the program return 0.
+ */
+
+typedef struct bpf_insn {
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+} bpf_insn_t;
+
+#define BPF_MAXINSNS 4096
+#define BPF_MEMWORDS 16
+
+/* Instruction classes */
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD          0x00
+#define BPF_LDX         0x01
+#define BPF_ST          0x02
+#define BPF_STX         0x03
+#define BPF_ALU         0x04
+#define BPF_JMP         0x05
+#define BPF_RET         0x06
+#define BPF_MISC        0x07
+
+/* Load sizes and addressing modes */
+#define BPF_W           0x00
+#define BPF_H           0x08
+#define BPF_B           0x10
+#define BPF_IMM         0x00
+#define BPF_ABS         0x20
+#define BPF_IND         0x40
+#define BPF_MEM         0x60
+#define BPF_LEN         0x80
+#define BPF_MSH         0xa0
+
+/* ALU and jump operations */
+#define BPF_OP(code)    ((code) & 0xf0)
+#define BPF_ADD         0x00
+#define BPF_SUB         0x10
+#define BPF_MUL         0x20
+#define BPF_DIV         0x30
+#define BPF_OR          0x40
+#define BPF_AND         0x50
+#define BPF_LSH         0x60
+#define BPF_RSH         0x70
+#define BPF_NEG         0x80
+#define BPF_MOD         0x90
+#define BPF_XOR         0xa0
+#define BPF_JA          0x00
+#define BPF_JEQ         0x10
+#define BPF_JGT         0x20
+#define BPF_JGE         0x30
+#define BPF_JSET        0x40
+
+/* Operand of ALU and jump instructions, and what is returned */
+#define BPF_K           0x00
+#define BPF_X           0x08
+#define BPF_A           0x10
+
+#define BPF_TAX         0x00
+#define BPF_TXA         0x80
+
+#define BPF_STMT(code, k) { (uint16_t)(code), 0, 0, k }
+#define BPF_JUMP(code, k, jt, jf) { (uint16_t)(code), jt, jf, k }
+
+/*
+ * Check that a program of len instructions only uses supported instructions,
+ * only jumps forward to instructions in the program, ends with a return and
+ * only loads scratch memory it has stored to on every path there.
+ */
+bool bpf_verify(const bpf_insn_t *prog, uint32_t len);
+
+/* Run a verified program on a packet of len bytes, returning its result */
+uint32_t bpf_run(const bpf_insn_t *prog, const uint8_t *pkt, uint32_t len);
+
+/*
+ * Check the verifier and interpreter against programs with known results,
+ * including one from tcpdump. Returns true if all of them pass. It is run on
+ * the development host by tests/Makefile.
+ */
+bool bpf_self_test(void);
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Binary buddy allocator for contiguous runs of fixed size cells in a memory
+ * region. Free blocks are kept in one list per power-of-two order and a bitmap
+ * records which lists are non-empty. Allocating and freeing take O(log n)
+ * steps, bounded by the number of orders, no matter how full or fragmented
+ * the region is.
+ *
+ * Allocations do not need to be a power of two, the unused tail of the block
+ * is given back straight away, the same count must then be passed when
+ * freeing. The metadata, provided by the caller, needs to be at least
+ * BUDDY_META_SIZE(num_cells) bytes.
+ */
+
+#define BUDDY_NUM_ORDERS 32
+#define BUDDY_NONE UINT32_MAX
+
+typedef struct buddy_cell {
+    /* Only valid for the first cell of a free block */
+    uint32_t prev;
+    uint32_t next;
+    uint8_t order;
+    bool free;
+} buddy_cell_t;
+
+#define BUDDY_META_SIZE(num_cells) ((num_cells) * sizeof(buddy_cell_t))
+
+typedef struct buddy_stats {
+    /* Number of cells that are free */
+    uint64_t free_cells;
+    /* Number of free blocks of each order */
+    uint32_t free_blocks[BUDDY_NUM_ORDERS];
+    /* Allocations that failed, and those of them that failed even though
+     * there were enough free cells, i.e. due to fragmentation */
+    uint64_t failed_allocs;
+    uint64_t fragmented_allocs;
+} buddy_stats_t;
+
+typedef struct buddy {
+    uintptr_t base;
+    uint64_t cell_size;
+    uint32_t num_cells;
+    buddy_cell_t *cells;
+    uint32_t free_heads[BUDDY_NUM_ORDERS];
+    /* Bit n is set if there is a free block of order n */
+    uint32_t nonempty;
+    buddy_stats_t stats;
+} buddy_t;
+
+bool buddy_init(buddy_t *buddy, uintptr_t base, uint64_t cell_size, uint32_t num_cells,
+                void *meta, size_t meta_size);
+
+/* Whether an allocation of count cells would fail */
+bool buddy_full(buddy_t *buddy, uint32_t count);
+
+/* As buddy_full, but an allocation that would fail is counted in the stats as
+ * a failed one, for callers that check before allocating */
+bool buddy_full_counted(buddy_t *buddy, uint32_t count);
+
+/* Allocate count contiguous cells, returns 0 on success */
+int buddy_alloc(buddy_t *buddy, uintptr_t *addr, uint32_t count);
+
+/* Free count cells starting at addr, these must have been allocated together */
+void buddy_free(buddy_t *buddy, uintptr_t addr, uint32_t count);
+
+/* Order of the largest free block, -1 if there is none */
+int buddy_largest_free_order(buddy_t *buddy);
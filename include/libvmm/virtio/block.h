@@ -34,6 +34,9 @@
 
 #include <stdint.h>
 #include <libvmm/virtio/mmio.h>
+#include <libvmm/util/block_cache.h>
+#include <libvmm/util/buddy.h>
+#include <libvmm/util/aes_xts.h>
 #include <sddf/util/fsmalloc.h>
 #include <sddf/util/ialloc.h>
 #include <sddf/blk/queue.h>
@@ -91,6 +94,24 @@ struct virtio_blk_config {
     } topology;
     /* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
     uint8_t writeback;
+    uint8_t unused0;
+    /* number of request virtqueues (if VIRTIO_BLK_F_MQ) */
+    uint16_t num_queues;
+    /* the next 3 entries are guarded by VIRTIO_BLK_F_DISCARD */
+    /* maximum discard sectors for one segment */
+    uint32_t max_discard_sectors;
+    /* maximum number of discard segments in a discard command */
+    uint32_t max_discard_seg;
+    /* discard commands must be aligned to this number of sectors */
+    uint32_t discard_sector_alignment;
+    /* the next 3 entries are guarded by VIRTIO_BLK_F_WRITE_ZEROES */
+    /* maximum write zeroes sectors in one segment */
+    uint32_t max_write_zeroes_sectors;
+    /* maximum number of segments in a write zeroes command */
+    uint32_t max_write_zeroes_seg;
+    /* device will set to 1 if write zeroes may result in deallocation of sectors */
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 } __attribute__((packed));
 
 /*
@@ -114,6 +135,12 @@ struct virtio_blk_config {
 /* Get device ID command */
 #define VIRTIO_BLK_T_GET_ID         8
 
+/* Discard command */
+#define VIRTIO_BLK_T_DISCARD        11
+
+/* Write zeroes command */
+#define VIRTIO_BLK_T_WRITE_ZEROES   13
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER    0x80000000
 
@@ -127,6 +154,19 @@ struct virtio_blk_outhdr {
     uint64_t sector;
 } __attribute__((packed));
 
+/* Unmap this range (only valid for write zeroes command) */
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP  0x00000001
+
+/* Discard/write zeroes range for each request. */
+struct virtio_blk_discard_write_zeroes {
+    /* discard/write zeroes start sector */
+    uint64_t sector;
+    /* number of discard/write zeroes sectors */
+    uint32_t num_sectors;
+    /* flags for this range */
+    uint32_t flags;
+} __attribute__((packed));
+
 /* And this is the final byte of the write scatter-gather list. */
 #define VIRTIO_BLK_S_OK             0
 #define VIRTIO_BLK_S_IOERR          1
@@ -135,47 +175,342 @@ struct virtio_blk_outhdr {
 #define VIRTIO_BLK_SECTOR_SIZE 512
 
 /* Backend implementation */
-#define SDDF_BLK_NUM_HANDLES 1
+/* Maximum number of sDDF block queues that a single device can be bound to */
+#define SDDF_BLK_MAX_HANDLES 4
 #define SDDF_BLK_DEFAULT_HANDLE 0
-/* Maximum number of buffers in sddf data region */
-#define SDDF_MAX_DATA_BUFFERS 8192
+/* Number of buffers in each sDDF data region that are reserved and kept
+ * zeroed, write zeroes requests are turned into sDDF writes from them */
+#define SDDF_ZERO_DATA_BUFFERS 8
+
+/* Default limits for discard and write zeroes advertised in the device config,
+ * these can be changed with virtio_blk_set_discard_limits */
+#define VIRTIO_BLK_DEFAULT_MAX_DISCARD_SECTORS      0x400000
+#define VIRTIO_BLK_DEFAULT_MAX_WRITE_ZEROES_SECTORS 0x100000
 
-#define VIRTIO_BLK_NUM_VIRTQ 1
+/* Maximum number of request virtqueues, more than one is only used by the
+ * driver if VIRTIO_BLK_F_MQ is negotiated */
+#define VIRTIO_BLK_MAX_VIRTQ 4
 #define VIRTIO_BLK_DEFAULT_VIRTQ 0
 
-/* Bookkeeping request data between virtIO and sDDF */
+/* Default maximum size of a transfer made by merging contiguous requests, in
+ * sDDF blocks. This can be changed with virtio_blk_set_max_merge. */
+#define VIRTIO_BLK_DEFAULT_MAX_MERGE_BLOCKS 32
+
+/* The I/O priority class is in the top bits of virtio_blk_outhdr.ioprio, as
+ * with Linux's IOPRIO_PRIO_CLASS */
+#define VIRTIO_BLK_IOPRIO_CLASS_SHIFT 13
+#define VIRTIO_BLK_IOPRIO_CLASS_RT 1
+#define VIRTIO_BLK_IOPRIO_CLASS_IDLE 3
+
+/* Classes of held requests in the order they are dispatched in */
+enum virtio_blk_prio_class {
+    VIRTIO_BLK_PRIO_RT,
+    VIRTIO_BLK_PRIO_BE,
+    VIRTIO_BLK_PRIO_IDLE,
+    VIRTIO_BLK_PRIO_NUM_CLASSES,
+};
+
+/* Read-ahead starts once this many reads in a row were sequential, with a
+ * window that starts at VIRTIO_BLK_READAHEAD_MIN_WINDOW blocks */
+#define VIRTIO_BLK_READAHEAD_SEQ_THRESHOLD 2
+#define VIRTIO_BLK_READAHEAD_MIN_WINDOW 4
+/* One buffer is read by the driver while the next one is being filled */
+#define VIRTIO_BLK_READAHEAD_BUFFERS 2
+
+/* A window of blocks read ahead into the data region of an sDDF queue */
+struct virtio_blk_readahead_buf {
+    uintptr_t data;
+    uint32_t block;
+    uint16_t count;
+    /* Number of blocks from the start that the driver has read */
+    uint16_t consumed;
+    size_t handle;
+    bool valid;
+    bool inflight;
+    /* Written to while in-flight, dropped once sDDF responds */
+    bool stale;
+};
+
+struct virtio_blk_readahead {
+    /* Largest window in sDDF blocks, read-ahead is disabled if this is 0 */
+    uint16_t max_window;
+    uint16_t window;
+    /* Block a read continuing the current stream would start at */
+    uint32_t next_block;
+    uint32_t seq_reads;
+    struct virtio_blk_readahead_buf bufs[VIRTIO_BLK_READAHEAD_BUFFERS];
+    /* Reads served from read-ahead buffers, blocks read ahead and blocks
+     * dropped without being read */
+    uint64_t hits;
+    uint64_t prefetched;
+    uint64_t wasted;
+};
+
+/* Limits on the rate at which requests are taken from the virtqueues, a rate
+ * of 0 means no limit. A burst is how much can be sent at once after being
+ * idle, 0 allows one second worth of the rate. Bursts are capped so that they
+ * fit in VIRTIO_BLK_RATE_MAX_TOKENS counter ticks' worth of tokens. */
+struct virtio_blk_rate_limit {
+    uint64_t iops;
+    uint64_t iops_burst;
+    uint64_t bps;
+    uint64_t bps_burst;
+};
+
+/* Tokens are counted in units of 1/counter frequency so that refilling the
+ * bucket does not need a division. The rate and bucket size are capped at
+ * VIRTIO_BLK_RATE_MAX_TOKENS so that the count, which can go into debt by up
+ * to the bucket size, cannot overflow. */
+#define VIRTIO_BLK_RATE_MAX_TOKENS (INT64_MAX / 2)
+
+struct virtio_blk_token_bucket {
+    uint64_t rate;
+    int64_t tokens;
+    int64_t max_tokens;
+};
+
+/* Every request that can be in the virtqueues may be held */
+#define VIRTIO_BLK_MAX_HELD (VIRTIO_BLK_MAX_VIRTQ * QUEUE_SIZE)
+#define VIRTIO_BLK_HELD_NONE UINT16_MAX
+
+/* A request taken off an available ring while its sDDF queue was saturated */
+struct virtio_blk_held {
+    uint64_t avail_time;
+    /* Value of the handle's dispatched count when the request was held */
+    uint32_t seq;
+    uint16_t desc_head;
+    uint16_t vq_idx;
+    uint16_t next;
+};
+
+/* Bookkeeping request data between virtIO and sDDF. One of these is needed
+ * for every in-flight request, fields are ordered to keep it compact. */
 typedef struct reqbk {
-    uint16_t virtio_desc_head;
     uintptr_t sddf_data;
-    uint16_t sddf_count;
-    uint32_t sddf_block_number;
     uintptr_t virtio_data;
-    uint16_t virtio_data_size;
+    uint32_t sddf_block_number;
+    uint32_t virtio_data_size;
+    /* The following are only used for virtIO requests that are split into
+     * multiple sDDF requests, such as write zeroes. The parent is not sent to
+     * sDDF, it tracks the progress of the whole request while each child
+     * refers back to it through parent_id. */
+    uint32_t parent_id;
+    /* Number of blocks that are yet to be sent to sDDF */
+    uint32_t remaining;
+    /* Set on the first request of a merged sDDF transfer (see merged below),
+     * the requests that are part of it are chained through merge_next, ending
+     * with REQBK_NONE. */
+    uint32_t merge_next;
+    /* Value of the device's cache_epoch when a read was sent to sDDF, the data
+     * is only added to the cache if no write has happened since */
+    uint32_t cache_epoch;
+    /* sDDF writes that have been acknowledged in writeback mode are kept in a
+     * list through these until sDDF completes them, see wb_inflight */
+    uint32_t wb_prev;
+    uint32_t wb_next;
+    uint16_t virtio_desc_head;
+    uint16_t sddf_count;
+    /* Virtqueue that the request came from */
+    uint16_t vq_idx;
+    /* Number of children that are in-flight */
+    uint16_t pending;
     /* Only used for unaligned write from virtIO, if not true, this request is the
     * "read" part of the read-modify-write */
-    bool aligned; 
+    bool aligned;
+    bool failed;
+    /* The sDDF request refers directly to the guest's buffer, no data buffer
+     * was allocated and there is nothing to copy */
+    bool zero_copy;
+    /* Set on the first request of a merged sDDF transfer, its sddf_data and
+     * sddf_count describe the whole transfer */
+    bool merged;
+    /* The write has already been completed to the driver (writeback mode), the
+     * virtIO descriptors may have been reused and must not be touched */
+    bool acked;
+    /* The read was made by read-ahead, parent_id is its read-ahead buffer */
+    bool readahead;
+    /* The device was reset while this flush or acknowledged write was in
+     * sDDF, there is nothing to complete or track once sDDF responds */
+    bool dropped;
 } reqbk_t;
 
-struct virtio_blk_device {
-    struct virtio_device virtio_device;
+#define REQBK_NONE UINT32_MAX
 
-    struct virtio_blk_config config;
-    struct virtio_queue_handler vqs[VIRTIO_BLK_NUM_VIRTQ];
+/*
+ * Size in bytes of the bookkeeping region that must be given to the block
+ * device at initialisation. queue_capacity and data_region_size are the totals
+ * over all the sDDF queues the device is given. The region must be aligned to
+ * the size of a pointer.
+ */
+#define VIRTIO_BLK_BOOKKEEPING_SIZE(queue_capacity, data_region_size, num_sddf_handles) \
+    ((queue_capacity) * (sizeof(reqbk_t) + sizeof(uint32_t)) \
+     + (roundup_bits2words64((data_region_size) / BLK_TRANSFER_SIZE) + (num_sddf_handles)) * sizeof(word_t))
+
+/* Number of log2 buckets in the latency and queue depth histograms, bucket i
+ * counts values in [2^i, 2^(i+1)), bucket 0 also counts 0 and the last bucket
+ * everything that is larger */
+#define VIRTIO_BLK_STATS_BUCKETS 32
+
+enum virtio_blk_stats_op {
+    VIRTIO_BLK_STATS_READ,
+    VIRTIO_BLK_STATS_WRITE,
+    VIRTIO_BLK_STATS_FLUSH,
+    VIRTIO_BLK_STATS_NUM_OPS,
+};
+
+/* Each request's latency is split into phases, all measured in counter ticks */
+enum virtio_blk_stats_phase {
+    /* From being taken off the available ring to being sent to sDDF */
+    VIRTIO_BLK_STATS_QUEUED,
+    /* From being sent to sDDF to sDDF responding */
+    VIRTIO_BLK_STATS_BACKEND,
+    /* From being taken off the available ring to being put in the used ring */
+    VIRTIO_BLK_STATS_TOTAL,
+    VIRTIO_BLK_STATS_NUM_PHASES,
+};
+
+struct virtio_blk_stats {
+    /* Frequency of the counter that latencies are measured with, in Hz */
+    uint64_t counter_freq;
+    uint64_t completed[VIRTIO_BLK_STATS_NUM_OPS];
+    uint32_t latency[VIRTIO_BLK_STATS_NUM_OPS][VIRTIO_BLK_STATS_NUM_PHASES][VIRTIO_BLK_STATS_BUCKETS];
+    /* Number of requests in-flight in the sDDF queue, sampled whenever a
+     * request is sent to sDDF */
+    uint32_t queue_depth[VIRTIO_BLK_STATS_BUCKETS];
+    uint32_t max_queue_depth;
+};
 
-    reqbk_t reqbk[SDDF_MAX_DATA_BUFFERS];
+/* Trace points of a request, indexed by request ID */
+struct virtio_blk_req_times {
+    uint64_t avail;
+    uint64_t enqueue;
+};
+
+/* Information about a sDDF block queue given to the device at initialisation */
+struct virtio_blk_sddf_info {
+    blk_queue_handle_t queue_h;
+    uintptr_t data_region;
+    size_t data_region_size;
+    int server_ch;
+};
+
+/* Runtime state of a sDDF block queue and the data region its requests refer to */
+struct virtio_blk_sddf_handle {
+    blk_queue_handle_t queue_h;
+    uintptr_t data_region;
+    /* Number of BLK_TRANSFER_SIZE buffers in the data region available for requests */
+    size_t num_buffers;
+    /* Most buffers a single request can be given, this is less than
+     * num_buffers with the buddy allocator */
+    size_t max_buffers;
+    int server_ch;
     /* Data struct that handles allocation and freeing of fixed size data cells
      * in sDDF memory region */
     fsmalloc_t fsmalloc;
     bitarray_t fsmalloc_avail_bitarr;
-    word_t fsmalloc_avail_bitarr_words[roundup_bits2words64(SDDF_MAX_DATA_BUFFERS)];
-    /* Index allocator */
+    /* Optional buddy allocator that replaces fsmalloc, see
+     * virtio_blk_set_buddy_alloc. Its stats report fragmentation. */
+    bool use_buddy;
+    buddy_t buddy;
+    /* Zeroed buffers in the data region, a zero_count of 0 means that write
+     * zeroes is not supported by this handle */
+    uintptr_t zero_data;
+    uint16_t zero_count;
+    /* Guest RAM that is also mapped into the sDDF virtualiser, at zero_copy_offset
+     * relative to the data region. A zero_copy_size of 0 disables zero-copy. */
+    uintptr_t zero_copy_base;
+    size_t zero_copy_size;
+    uintptr_t zero_copy_offset;
+    /* Number of requests in-flight in the sDDF queue */
+    uint32_t inflight;
+    /* Requests held for this queue by the priority dispatcher, a FIFO list
+     * for each class, and the number of them that have been dispatched */
+    uint16_t held_head[VIRTIO_BLK_PRIO_NUM_CLASSES];
+    uint16_t held_tail[VIRTIO_BLK_PRIO_NUM_CLASSES];
+    uint32_t num_held;
+    uint32_t held_dispatched;
+};
+
+struct virtio_blk_device {
+    struct virtio_device virtio_device;
+
+    struct virtio_blk_config config;
+    struct virtio_queue_handler vqs[VIRTIO_BLK_MAX_VIRTQ];
+    /* A virtqueue is stalled when we stopped consuming its available ring
+     * because we ran out of sDDF resources, it is resumed once sDDF responds */
+    bool stalled[VIRTIO_BLK_MAX_VIRTQ];
+    /* Contiguous requests are merged into sDDF transfers of up to this many
+     * blocks, merging is disabled if this is 0 or 1 */
+    uint16_t max_merge_blocks;
+
+    /* Optional cache of blocks read from sDDF, NULL if disabled */
+    blk_cache_t *cache;
+    /* Incremented on every write so that reads that were in-flight at the
+     * time of a write do not put stale data into the cache */
+    uint32_t cache_epoch;
+
+    /* Key to encrypt data with before it is given to sDDF, NULL if the data
+     * is not encrypted */
+    const aes_xts_ctx_t *xts;
+
+    /* Sequential read-ahead, see virtio_blk_set_readahead */
+    struct virtio_blk_readahead readahead;
+
+    /* Writes that have been acknowledged to the driver in writeback mode but
+     * not yet completed by sDDF, and whether any of them have failed since the
+     * last flush was sent */
+    uint32_t wb_pending;
+    bool wb_error;
+    /* Head of the list of acknowledged sDDF writes, requests that overlap any
+     * of them are held back until they have completed */
+    uint32_t wb_inflight;
+    /* Flushes that are waiting for pending writes to complete, and the one
+     * that has been sent to sDDF. Each is a chain of request IDs linked
+     * through merge_next, all completed by a single sDDF flush. */
+    uint32_t flush_waiting_head;
+    uint32_t flush_waiting_tail;
+    uint32_t flush_inflight;
+
+    /* Priority dispatch, see virtio_blk_set_prio_dispatch. When enabled,
+     * requests are held rather than stalling their virtqueue. */
+    bool prio_enabled;
+    uint32_t prio_max_wait;
+    uint16_t held_free;
+    struct virtio_blk_held held[VIRTIO_BLK_MAX_HELD];
+
+    /* Rate limiting, see virtio_blk_set_rate_limit. Virtqueues that are over
+     * the limit are stalled until the timeout set on rate_timer_ch. */
+    bool rate_enabled;
+    struct virtio_blk_token_bucket iops_bucket;
+    struct virtio_blk_token_bucket bps_bucket;
+    uint64_t rate_last_refill;
+    unsigned int rate_timer_ch;
+    bool rate_timer_armed;
+    /* Number of times a virtqueue was stalled by the rate limit */
+    uint64_t rate_throttled;
+
+    /* Latency statistics, only collected once enabled with virtio_blk_stats_enable */
+    bool stats_enabled;
+    struct virtio_blk_stats stats;
+    struct virtio_blk_req_times *req_times;
+    /* When the request currently being handled was taken off the available ring */
+    uint64_t req_avail_time;
+    /* Print the statistics every stats_dump_interval completed requests */
+    uint32_t stats_dump_interval;
+    uint32_t stats_since_dump;
+
+    /* Request bookkeeping, indexed by request ID, and the index allocator for
+     * the IDs which is shared between all sDDF handles. Both live in the
+     * bookkeeping region given at initialisation. */
+    reqbk_t *reqbk;
+    uint32_t num_reqs;
     ialloc_t ialloc;
-    uint32_t ialloc_idxlist[SDDF_MAX_DATA_BUFFERS];
+    uint32_t *ialloc_idxlist;
 
     blk_storage_info_t *storage_info;
-    blk_queue_handle_t queue_h;
-    uintptr_t data_region;
-    int server_ch;
+    /* Virtqueue i is served by sDDF handle (i % num_sddf_handles) */
+    struct virtio_blk_sddf_handle sddf_handles[SDDF_BLK_MAX_HANDLES];
+    size_t num_sddf_handles;
 };
 
 bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
@@ -186,6 +521,156 @@ bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
                      size_t data_region_size,
                      blk_storage_info_t *storage_info,
                      blk_queue_handle_t *queue_h,
-                     int server_ch);
+                     int server_ch,
+                     void *bookkeeping,
+                     size_t bookkeeping_size);
 
+/*
+ * Initialise a virtIO block device with multiple request virtqueues
+ * (VIRTIO_BLK_F_MQ). Each virtqueue is bound to one of the given sDDF queues,
+ * in a round-robin fashion, so that the number of sDDF queues can be anywhere
+ * from one (all virtqueues share the same sDDF queue) to num_virtqs (each
+ * virtqueue has its own).
+ */
+bool virtio_mmio_blk_mq_init(struct virtio_blk_device *blk_dev,
+                             uintptr_t region_base,
+                             uintptr_t region_size,
+                             size_t virq,
+                             size_t num_virtqs,
+                             struct virtio_blk_sddf_info *sddf_info,
+                             size_t num_sddf_handles,
+                             blk_storage_info_t *storage_info,
+                             void *bookkeeping,
+                             size_t bookkeeping_size);
+
+/*
+ * Change the limits for VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES
+ * advertised to the driver. This must be done before the guest starts. The
+ * discard alignment and write zeroes limit are rounded to the sDDF transfer
+ * size since the backend cannot address anything smaller.
+ */
+void virtio_blk_set_discard_limits(struct virtio_blk_device *blk_dev,
+                                   uint32_t max_discard_sectors,
+                                   uint32_t discard_sector_alignment,
+                                   uint32_t max_write_zeroes_sectors);
+
+/*
+ * Enable the zero-copy data path for the given sDDF queue. Guest RAM starting
+ * at guest_ram_vaddr (in the VMM's address space) must also be mapped into the
+ * sDDF block virtualiser such that it appears at sddf_offset in this client's
+ * data region. Reads and writes of whole, aligned blocks that lie within guest
+ * RAM are then given to sDDF as-is, anything else falls back to copying
+ * through the data region.
+ */
+bool virtio_blk_set_zero_copy(struct virtio_blk_device *blk_dev,
+                              size_t handle,
+                              uintptr_t guest_ram_vaddr,
+                              size_t guest_ram_size,
+                              uintptr_t sddf_offset);
+
+/*
+ * Set the maximum size, in sDDF blocks, of a transfer made by merging
+ * contiguous reads or writes from the same virtqueue. A value of 0 or 1
+ * disables merging.
+ */
+void virtio_blk_set_max_merge(struct virtio_blk_device *blk_dev, uint16_t max_merge_blocks);
+
+/*
+ * Allocate data buffers for the given sDDF queue with a buddy allocator rather
+ * than fsmalloc. Allocation and free take O(log n) steps, bounded by the
+ * number of orders, and fragmentation statistics are kept in
+ * sddf_handles[handle].buddy.stats, where a request waiting for buffers counts
+ * as a failed allocation each time it is retried. The metadata must
+ * be at least BUDDY_META_SIZE(data_region_size / BLK_TRANSFER_SIZE) bytes.
+ * Requests that need more buffers than the largest block the allocator can
+ * hand out are failed. This must be done before the guest starts.
+ */
+bool virtio_blk_set_buddy_alloc(struct virtio_blk_device *blk_dev, size_t handle, void *meta, size_t meta_size);
+
+/*
+ * Set the initial cache mode. In writeback mode writes are completed to the
+ * driver as soon as they are sent to sDDF, and flushes wait for those writes
+ * to complete before being sent. The driver can change the mode at runtime
+ * through the writeback field of the device config (VIRTIO_BLK_F_CONFIG_WCE).
+ */
+void virtio_blk_set_writeback(struct virtio_blk_device *blk_dev, bool writeback);
+
+/*
+ * Encrypt all data written to the disk, and decrypt all data read from it,
+ * with AES-XTS. Data units are virtIO sectors, numbered by their sector on
+ * the disk. The data in the sDDF data region and in the read cache is always
+ * encrypted, so the key is only known to the VMM. Zero-copy cannot be used
+ * and write zeroes is not offered as both would expose plaintext to sDDF,
+ * so this must be called before the driver negotiates features.
+ */
+bool virtio_blk_set_encryption(struct virtio_blk_device *blk_dev, const aes_xts_ctx_t *ctx);
+
+/*
+ * Read ahead of sequential reads, in windows of up to max_window sDDF blocks.
+ * Once VIRTIO_BLK_READAHEAD_SEQ_THRESHOLD reads in a row continue where the
+ * previous one ended, the following blocks are read into the data region and
+ * later reads are served from there. The window doubles every time a buffer
+ * is read in full and halves when one is dropped before being read. The
+ * window is capped at half of the data region of the smallest sDDF queue, a
+ * max_window of 0 disables read-ahead.
+ */
+void virtio_blk_set_readahead(struct virtio_blk_device *blk_dev, uint16_t max_window);
+
+/*
+ * Limit the number of requests and bytes per second taken from the
+ * virtqueues, with a token bucket for each. Requests over the limit are left
+ * in the available ring until enough tokens are available, a timeout is set
+ * with the sDDF timer on timer_ch for when they will be and
+ * virtio_blk_handle_timeout must be called when it is notified. The sDDF
+ * timer keeps one timeout per client, so timer_ch must be a timer client of
+ * its own, not shared with a network device or anything else that sets
+ * timeouts. Only the data of reads and writes count towards the bytes.
+ * Passing NULL removes the limit.
+ */
+void virtio_blk_set_rate_limit(struct virtio_blk_device *blk_dev, const struct virtio_blk_rate_limit *limit,
+                               unsigned int timer_ch);
+
+/*
+ * Resume virtqueues stalled by the rate limit. This should be called whenever
+ * the timer channel given to virtio_blk_set_rate_limit is notified.
+ */
+bool virtio_blk_handle_timeout(struct virtio_blk_device *blk_dev);
+
+/*
+ * Dispatch requests by the priority class in their ioprio field when sDDF is
+ * saturated. Requests that cannot be sent to sDDF are taken off the available
+ * ring and held, then sent as sDDF resources are freed: real-time first, then
+ * best-effort, then idle. A held request that has been passed over for
+ * max_wait dispatches from its sDDF queue is sent next regardless of its
+ * class, a max_wait of 0 disables this. Held requests are not merged.
+ */
+void virtio_blk_set_prio_dispatch(struct virtio_blk_device *blk_dev, bool enable, uint32_t max_wait);
+
+/*
+ * Start collecting latency histograms and queue depth samples. req_times is
+ * used to trace each request and must have an entry for every request ID, one
+ * per entry in the sDDF queues given at initialisation. If dump_interval is
+ * non-zero the statistics are printed every dump_interval completed requests.
+ */
+bool virtio_blk_stats_enable(struct virtio_blk_device *blk_dev,
+                             struct virtio_blk_req_times *req_times,
+                             size_t num_req_times,
+                             uint32_t dump_interval);
+const struct virtio_blk_stats *virtio_blk_get_stats(struct virtio_blk_device *blk_dev);
+void virtio_blk_stats_reset(struct virtio_blk_device *blk_dev);
+void virtio_blk_stats_dump(struct virtio_blk_device *blk_dev);
+
+/*
+ * Serve reads from the given block cache, which must have been initialised
+ * with blk_cache_init with a block size of BLK_TRANSFER_SIZE. Reads are only
+ * served from the cache if all the blocks they cover are cached, blocks are
+ * added once sDDF completes a read and dropped when they are written to.
+ * Hit and miss counts can be found in the cache's stats.
+ */
+bool virtio_blk_set_cache(struct virtio_blk_device *blk_dev, blk_cache_t *cache);
+
+/*
+ * Process responses from all sDDF queues of the device. This should be called
+ * whenever any of the server channels given at initialisation is notified.
+ */
 bool virtio_blk_handle_resp(struct virtio_blk_device *blk_dev);
@@ -32,10 +32,12 @@
 #include <stdint.h>
 #include <sddf/network/queue.h>
 #include <libvmm/virtio/mmio.h>
+#include <libvmm/util/bpf.h>
 
 /* The feature bitmap for virtio net */
 #define VIRTIO_NET_F_CSUM               0   /* Host handles pkts w/ partial csum */
 #define VIRTIO_NET_F_GUEST_CSUM         1   /* Guest handles pkts w/ partial csum */
+#define VIRTIO_NET_F_MTU                3   /* Initial MTU advice */
 #define VIRTIO_NET_F_MAC                5   /* Host has given MAC address. */
 #define VIRTIO_NET_F_GSO                6   /* Host handles pkts w/ any GSO type */
 #define VIRTIO_NET_F_GUEST_TSO4         7   /* Guest can handle TSOv4 in. */
@@ -55,6 +57,10 @@
 #define VIRTIO_NET_F_GUEST_ANNOUNCE     21  /* Guest can announce device on the network */
 #define VIRTIO_NET_F_MQ                 22  /* Device supports Receive Flow Steering */
 #define VIRTIO_NET_F_CTRL_MAC_ADDR      23  /* Set MAC address */
+#define VIRTIO_NET_F_NOTF_COAL          53  /* Device supports notifications coalescing */
+#define VIRTIO_NET_F_HOST_USO           56  /* Host can handle USO in. */
+#define VIRTIO_NET_F_HASH_REPORT        57  /* Supports hash report */
+#define VIRTIO_NET_F_RSS                60  /* Supports RSS RX steering */
 
 #define VIRTIO_NET_S_LINK_UP            1   /* Link is up */
 #define VIRTIO_NET_S_ANNOUNCE           2   /* Announcement is needed */
@@ -65,14 +71,43 @@ struct virtio_net_config {
     /* The config defining mac address (if VIRTIO_NET_F_MAC) */
     uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ];
     /* See VIRTIO_NET_F_STATUS and VIRTIO_NET_S_* above */
-    // uint16_t status;
+    uint16_t status;
     /* Maximum number of each of transmit and receive queues;
      * see VIRTIO_NET_F_MQ and VIRTIO_NET_CTRL_MQ.
      * Legal values are between 1 and 0x8000
      */
-    // uint16_t max_virtqueue_pairs;
+    uint16_t max_virtqueue_pairs;
+    /* Default maximum transmit unit advice */
+    uint16_t mtu;
+    /* speed, in units of 1Mb. All values 0 to INT_MAX are legal. */
+    uint32_t speed;
+    /* 0x00 - half duplex, 0x01 - full duplex */
+    uint8_t duplex;
+    /* maximum size of RSS key */
+    uint8_t rss_max_key_size;
+    /* maximum number of indirection table entries */
+    uint16_t rss_max_indirection_table_length;
+    /* bitmask of supported VIRTIO_NET_RSS_HASH_ types */
+    uint32_t supported_hash_types;
 } __attribute__((packed));
 
+/* Hash types for supported_hash_types and RSS, and the type of hash reported
+ * in struct virtio_net_hdr_v1_hash */
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4          (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4         (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4         (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6          (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6         (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6         (1 << 5)
+
+#define VIRTIO_NET_HASH_REPORT_NONE            0
+#define VIRTIO_NET_HASH_REPORT_IPv4            1
+#define VIRTIO_NET_HASH_REPORT_TCPv4           2
+#define VIRTIO_NET_HASH_REPORT_UDPv4           3
+#define VIRTIO_NET_HASH_REPORT_IPv6            4
+#define VIRTIO_NET_HASH_REPORT_TCPv6           5
+#define VIRTIO_NET_HASH_REPORT_UDPv6           6
+
 /* This header comes first in the scatter-gather list.
  * If VIRTIO_F_ANY_LAYOUT is not negotiated, it must
  * be the first element of the scatter-gather list.  If you don't
@@ -85,6 +120,7 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_HDR_GSO_TCPV4        1   // GSO frame, IPv4 TCP (TSO)
 #define VIRTIO_NET_HDR_GSO_UDP          3   // GSO frame, IPv4 UDP (UFO)
 #define VIRTIO_NET_HDR_GSO_TCPV6        4   // GSO frame, IPv6 TCP
+#define VIRTIO_NET_HDR_GSO_UDP_L4       5   // GSO frame, IPv4 & IPv6 UDP (USO)
 #define VIRTIO_NET_HDR_GSO_ECN          0x80    // TCP has ECN set
     uint8_t gso_type;
     uint16_t hdr_len;       /* Ethernet + IP + tcp/udp hdrs */
@@ -103,6 +139,13 @@ struct virtio_net_hdr_mrg_rxbuf {
     uint16_t num_buffers;   /* Number of merged rx buffers */
 };
 
+struct virtio_net_hdr_v1_hash {
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    uint32_t hash_value;
+    uint16_t hash_report;
+    uint16_t padding;
+};
+
 /*
  * Control virtqueue data structures
  *
@@ -187,6 +230,38 @@ struct virtio_net_ctrl_mac {
 #define VIRTIO_NET_CTRL_ANNOUNCE       3
 #define VIRTIO_NET_CTRL_ANNOUNCE_ACK         0
 
+/*
+ * Control notification coalescing.
+ *
+ * Request the device to change the notification coalescing parameters.
+ *
+ * Available with the VIRTIO_NET_F_NOTF_COAL feature bit.
+ */
+#define VIRTIO_NET_CTRL_NOTF_COAL       6
+/*
+ * Set the tx-usecs/tx-max-packets parameters.
+ */
+struct virtio_net_ctrl_coal_tx {
+    /* Maximum number of packets to send before a TX notification */
+    uint32_t tx_max_packets;
+    /* Maximum number of usecs to delay a TX notification */
+    uint32_t tx_usecs;
+};
+
+#define VIRTIO_NET_CTRL_NOTF_COAL_TX_SET        0
+
+/*
+ * Set the rx-usecs/rx-max-packets parameters.
+ */
+struct virtio_net_ctrl_coal_rx {
+    /* Maximum number of packets to receive before a RX notification */
+    uint32_t rx_max_packets;
+    /* Maximum number of usecs to delay a RX notification */
+    uint32_t rx_usecs;
+};
+
+#define VIRTIO_NET_CTRL_NOTF_COAL_RX_SET        1
+
 /*
  * Control Receive Flow Steering
  *
@@ -207,22 +282,289 @@ struct virtio_net_ctrl_mq {
 #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN        1
 #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX        0x8000
 
+/*
+ * The command VIRTIO_NET_CTRL_MQ_RSS_CONFIG has the same effect as
+ * VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET does and additionally configures
+ * the receive steering to use a hash calculated for incoming packet
+ * to decide on receive virtqueue to place the packet. The command
+ * also provides parameters to calculate a hash and receive virtqueue.
+ * The structure is followed by the key of hash_key_length bytes.
+ */
+struct virtio_net_rss_config {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    uint16_t indirection_table[1/* + indirection_table_mask */];
+    uint16_t max_tx_vq;
+    uint8_t hash_key_length;
+    uint8_t hash_key_data[/* hash_key_length */];
+} __attribute__((packed));
+
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG          1
+
+/*
+ * The command VIRTIO_NET_CTRL_MQ_HASH_CONFIG requests the device
+ * to include in the virtio header of the packet the value of the
+ * calculated hash and the report type of hash. It is the same as
+ * struct virtio_net_rss_config without the steering fields.
+ */
+#define VIRTIO_NET_CTRL_MQ_HASH_CONFIG         2
+
+/*
+ * Queue pairs are virtqueues 2n (receive) and 2n + 1 (transmit). The control
+ * virtqueue follows the last queue pair, or the first one if neither
+ * VIRTIO_NET_F_MQ nor VIRTIO_NET_F_RSS is negotiated.
+ */
+#ifndef VIRTIO_NET_MAX_QUEUE_PAIRS
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 4
+#endif
+
 #define VIRTIO_NET_RX_VIRTQ     0
 #define VIRTIO_NET_TX_VIRTQ     1
-#define VIRTIO_NET_NUM_VIRTQ    2
+#define VIRTIO_NET_NUM_VIRTQ    (VIRTIO_NET_MAX_QUEUE_PAIRS * 2 + 1)
 
-struct virtio_net_device {
-    struct virtio_device virtio_device;
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE 40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN 128
+/* Longest command on the control virtqueue that is accepted */
+#define VIRTIO_NET_CTRL_MAX_LEN 512
+/* Most packets held for each RX virtqueue while the driver has no buffers */
+#ifndef VIRTIO_NET_RX_BACKLOG
+#define VIRTIO_NET_RX_BACKLOG 64
+#endif
+/* Number of unicast and of multicast addresses in the MAC filter. If the
+ * driver gives more, all packets of that kind are accepted. */
+#define VIRTIO_NET_MAX_MAC_FILTER 32
+#define VIRTIO_NET_MAX_VLAN 4096
 
-    struct virtio_net_config config;
-    struct virtio_queue_handler vqs[VIRTIO_NET_NUM_VIRTQ];
+/* Most zero-copy frames each queue pair can have in flight with sDDF */
+#ifndef VIRTIO_NET_MAX_TX_INFLIGHT
+#define VIRTIO_NET_MAX_TX_INFLIGHT 256
+#endif
+/* Number of buffers in the sDDF TX data region the VMM can hold on to, while
+ * it looks for zero-copy frames being returned or for adjacent buffers to put
+ * a jumbo frame in. Must be a multiple of 64, TX data regions with more
+ * buffers than this are rejected. */
+#ifndef VIRTIO_NET_MAX_TX_SPARE
+#define VIRTIO_NET_MAX_TX_SPARE 512
+#endif
+/* Most jumbo frames each queue pair can have in flight with sDDF */
+#define VIRTIO_NET_MAX_TX_JUMBO 32
+
+/* The MTU does not count the Ethernet header, which may have a VLAN tag */
+#define VIRTIO_NET_ETH_HLEN 18
+#define VIRTIO_NET_MIN_MTU 68
+#define VIRTIO_NET_DEFAULT_MTU 1500
 
+/* Largest headers of a GSO frame the VMM will segment: Ethernet with a VLAN
+ * tag, IPv4 with options and TCP with options */
+#define VIRTIO_NET_MAX_GSO_HDR_LEN (18 + 60 + 60)
+
+/* Most TCP segments merged into one frame by receive coalescing, each of
+ * which holds on to an sDDF RX buffer until the frame is given to the guest */
+#ifndef VIRTIO_NET_GRO_MAX_SEGS
+#define VIRTIO_NET_GRO_MAX_SEGS 16
+#endif
+
+/* A frame given to sDDF straight from guest memory */
+struct virtio_net_tx_inflight {
+    uint64_t io_or_offset;
+    uint32_t len;
+    uint16_t desc_head;
+    /* Returned by sDDF out of order, waiting for those before it */
+    bool done;
+};
+
+/* A frame copied into several adjacent buffers of the data region, which
+ * sDDF sees as one buffer */
+struct virtio_net_tx_jumbo {
+    uint64_t io_or_offset;
+    uint16_t buffers;
+};
+
+/* The sDDF queues that back a pair of receive and transmit virtqueues */
+struct virtio_net_queue_pair {
     net_queue_handle_t rx;
     net_queue_handle_t tx;
     void *rx_data;
     void *tx_data;
     microkit_channel tx_ch;
     microkit_channel rx_ch;
+
+    /* Guest RAM that is also mapped into the sDDF TX virtualiser, at
+     * zero_copy_offset relative to the TX data region. A zero_copy_size of 0
+     * disables zero-copy. */
+    uintptr_t zero_copy_base;
+    size_t zero_copy_size;
+    uintptr_t zero_copy_offset;
+    /* Zero-copy frames not yet returned by sDDF, oldest first */
+    struct virtio_net_tx_inflight inflight[VIRTIO_NET_MAX_TX_INFLIGHT];
+    uint16_t inflight_head;
+    uint16_t inflight_count;
+    /* Bitmap of the free buffers from the data region taken off the free
+     * queue, indexed by their offset divided by NET_BUFFER_SIZE */
+    uint64_t spare[VIRTIO_NET_MAX_TX_SPARE / 64];
+    uint16_t num_spare;
+    /* Number of buffers in the TX data region */
+    uint16_t tx_buffers;
+    /* Jumbo frames not yet returned by sDDF */
+    struct virtio_net_tx_jumbo jumbo[VIRTIO_NET_MAX_TX_JUMBO];
+    uint16_t num_jumbo;
+
+    /* Queues left with packets when their budget ran out */
+    bool rx_pending;
+    bool tx_pending;
+};
+
+/* Receive-side scaling and hash reporting state, as set by the driver */
+struct virtio_net_rss {
+    /* Whether received packets are steered by their hash */
+    bool enabled;
+    uint32_t hash_types;
+    uint16_t table_mask;
+    uint16_t unclassified_queue;
+    uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key_len;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+};
+
+/* Receive filtering, as set by the driver through VIRTIO_NET_F_CTRL_RX and
+ * VIRTIO_NET_F_CTRL_VLAN */
+struct virtio_net_filter {
+    bool promisc;
+    bool allmulti;
+    uint32_t num_uni;
+    uint32_t num_multi;
+    uint8_t uni[VIRTIO_NET_MAX_MAC_FILTER][VIRTIO_NET_CONFIG_MAC_SZ];
+    uint8_t multi[VIRTIO_NET_MAX_MAC_FILTER][VIRTIO_NET_CONFIG_MAC_SZ];
+    /* Bitmap of the VLAN IDs to receive */
+    uint32_t vlans[VIRTIO_NET_MAX_VLAN / 32];
+    /* Packets dropped without being copied to the guest */
+    uint64_t dropped;
+};
+
+/* A packet waiting for the driver to make RX buffers available, still in the
+ * sDDF buffer it arrived in */
+struct virtio_net_rx_backlog_entry {
+    net_buff_desc_t buffer;
+    /* The queue pair whose sDDF RX queue the buffer is from */
+    uint16_t pair;
+    struct virtio_net_hdr_v1_hash hdr;
+};
+
+struct virtio_net_rx_backlog {
+    struct virtio_net_rx_backlog_entry entries[VIRTIO_NET_RX_BACKLOG];
+    uint16_t head;
+    uint16_t count;
+    struct {
+        /* Packets dropped because the driver could not take them */
+        uint64_t dropped;
+        /* Of those, the ones dropped because the backlog was full */
+        uint64_t overflows;
+        /* Packets that had to wait in the backlog */
+        uint64_t backlogged;
+        /* Most packets in the backlog at once */
+        uint16_t max_occupancy;
+    } stats;
+};
+
+/* A TCP frame being built from segments of one flow received in order, see
+ * virtio_net_set_gro */
+struct virtio_net_gro {
+    /* The segments, still in the sDDF buffers they arrived in */
+    net_buff_desc_t segs[VIRTIO_NET_GRO_MAX_SEGS];
+    uint16_t num_segs;
+    /* The queue pair whose sDDF RX queue the segments are from */
+    uint16_t pair;
+    struct virtio_net_hdr_v1_hash hdr;
+    /* Headers of the first segment, kept up to date with the later ones */
+    uint8_t headers[VIRTIO_NET_MAX_GSO_HDR_LEN];
+    uint16_t l3;
+    uint16_t l4;
+    uint16_t hdr_len;
+    bool ipv6;
+    /* Payload of the first segment, which the others cannot be larger than,
+     * and of all of them */
+    uint16_t mss;
+    uint32_t payload_len;
+    uint32_t next_seq;
+    /* When the frame must be given to the guest, even if incomplete */
+    uint64_t deadline;
+    struct {
+        /* Frames made from more than one segment, and the segments in them */
+        uint64_t frames;
+        uint64_t segments;
+        /* Frames given to the guest because time was up, the budget ran out,
+         * or a packet arrived that could not be added */
+        uint64_t timeout_flushes;
+        uint64_t budget_flushes;
+        uint64_t flow_flushes;
+        /* Frames given to the guest as separate segments after all, as the
+         * driver had no room for them */
+        uint64_t unmerged;
+    } stats;
+};
+
+/* A receive filter result of VIRTIO_NET_BPF_STEER | n sends the packet to RX
+ * virtqueue n */
+#define VIRTIO_NET_BPF_STEER 0x7fff0000
+#define VIRTIO_NET_BPF_STEER_MASK 0xffff0000
+
+/* A packet filter run on every frame in one direction, see
+ * virtio_net_set_rx_filter */
+struct virtio_net_bpf {
+    const bpf_insn_t *prog;
+    uint32_t len;
+    struct {
+        uint64_t passed;
+        uint64_t dropped;
+        uint64_t steered;
+    } stats;
+};
+
+/* Notification coalescing for one direction, see VIRTIO_NET_F_NOTF_COAL */
+struct virtio_net_coal {
+    uint32_t max_packets;
+    uint32_t usecs;
+    /* Packets the guest has not been interrupted for yet, and when it must be */
+    uint32_t pending;
+    uint64_t deadline;
+};
+
+struct virtio_net_device {
+    struct virtio_device virtio_device;
+
+    /* Features negotiated with the driver */
+    uint64_t driver_features;
+    struct virtio_net_config config;
+    struct virtio_queue_handler vqs[VIRTIO_NET_NUM_VIRTQ];
+
+    struct virtio_net_queue_pair pairs[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    /* Number of queue pairs given by the VMM, and how many the driver uses */
+    uint16_t num_pairs;
+    uint16_t active_pairs;
+    struct virtio_net_rss rss;
+    struct virtio_net_filter filter;
+    /* Received packets for each RX virtqueue, the current occupancy is count */
+    struct virtio_net_rx_backlog rx_backlog[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    /* Receive coalescing for each RX virtqueue, see virtio_net_set_gro */
+    bool gro;
+    uint32_t gro_usecs;
+    struct virtio_net_gro rx_gro[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    struct virtio_net_bpf rx_bpf;
+    struct virtio_net_bpf tx_bpf;
+
+    /* Most packets processed from a queue at a time, see virtio_net_set_budget.
+     * Queues with packets left over are polled again after a timeout on
+     * timer_ch. A budget of 0 means no limit. */
+    uint32_t budget;
+    /* Notification coalescing, only offered once a timer is given with
+     * virtio_net_set_notf_coal */
+    bool notf_coal;
+    struct virtio_net_coal rx_coal;
+    struct virtio_net_coal tx_coal;
+    unsigned int timer_ch;
+    bool timer_armed;
+    uint64_t timer_deadline;
 };
 
 bool virtio_mmio_net_init(struct virtio_net_device *dev,
@@ -234,7 +576,110 @@ bool virtio_mmio_net_init(struct virtio_net_device *dev,
                           net_queue_handle_t *tx,
                           uintptr_t rx_data,
                           uintptr_t tx_data,
+                          size_t tx_data_size,
                           microkit_channel rx_ch,
                           microkit_channel tx_ch);
 
+/*
+ * Add another pair of receive and transmit queues, each with its own sDDF
+ * queues and channels, for VIRTIO_NET_F_MQ and VIRTIO_NET_F_RSS. The first
+ * pair is the one given to virtio_mmio_net_init. Must be called before the
+ * guest starts. Returns false if there are already VIRTIO_NET_MAX_QUEUE_PAIRS,
+ * or if the TX data region has more than VIRTIO_NET_MAX_TX_SPARE buffers.
+ */
+bool virtio_net_add_queue_pair(struct virtio_net_device *dev,
+                               net_queue_handle_t *rx,
+                               net_queue_handle_t *tx,
+                               uintptr_t rx_data,
+                               uintptr_t tx_data,
+                               size_t tx_data_size,
+                               microkit_channel rx_ch,
+                               microkit_channel tx_ch);
+
+/*
+ * Enable zero-copy transmit for the given queue pair. Guest RAM starting at
+ * guest_ram_vaddr (in the VMM's address space) must also be mapped into the
+ * sDDF TX virtualiser such that it appears at sddf_offset in this pair's TX
+ * data region. Frames that lie in one descriptor within guest RAM and need
+ * no checksum or segmentation are then given to sDDF as-is, anything else is
+ * copied into the data region. While there is a TX filter every frame is
+ * copied. The descriptor of a zero-copy frame is only returned to the guest
+ * once sDDF puts the frame back on the free queue, so
+ * virtio_net_handle_tx_free must be called when the TX channel is notified.
+ */
+bool virtio_net_set_zero_copy(struct virtio_net_device *dev,
+                              uint16_t pair,
+                              uintptr_t guest_ram_vaddr,
+                              size_t guest_ram_size,
+                              uintptr_t sddf_offset);
+
+/* Process packets received on the sDDF RX queues of all queue pairs */
 bool virtio_net_handle_rx(struct virtio_net_device *dev);
+
+/* Return zero-copy frames that sDDF has finished transmitting to the guest */
+bool virtio_net_handle_tx_free(struct virtio_net_device *dev);
+
+/*
+ * Limit the packets taken from each RX and TX queue every time it is
+ * processed, so a busy queue cannot hold up the rest of the VMM. Queues with
+ * packets left over are not re-armed for notifications. Instead, a timeout is
+ * set with the sDDF timer on timer_ch and virtio_net_handle_timeout must be
+ * called when it is notified. The sDDF timer keeps one timeout per client, so
+ * timer_ch must be a timer client of its own, not shared with a block device
+ * or anything else that sets timeouts. A budget of 0 removes the limit.
+ */
+void virtio_net_set_budget(struct virtio_net_device *dev, uint32_t budget, unsigned int timer_ch);
+
+/*
+ * Offer VIRTIO_NET_F_NOTF_COAL, so the driver can have interrupts held back
+ * until a number of packets have been sent or received or some time has
+ * passed. A timeout is set with the sDDF timer on timer_ch, which must be the
+ * same channel as given to virtio_net_set_budget if both are used and, like
+ * it, not shared with another device, and
+ * virtio_net_handle_timeout must be called when it is notified. Must be
+ * called before the guest starts.
+ */
+void virtio_net_set_notf_coal(struct virtio_net_device *dev, unsigned int timer_ch);
+
+/*
+ * Change the MTU advertised to the driver with VIRTIO_NET_F_MTU. By default it
+ * is 1500, or less if that does not fit in an sDDF buffer. A larger MTU is
+ * only for backends that accept a frame in several adjacent buffers of the TX
+ * data region, given to them as one buffer of more than NET_BUFFER_SIZE
+ * bytes, and that may receive frames the same way. Must be called before the
+ * guest starts.
+ */
+bool virtio_net_set_mtu(struct virtio_net_device *dev, uint16_t mtu);
+
+/*
+ * Merge TCP segments of a flow that arrive in order from sDDF into one large
+ * frame for the guest, if the driver negotiated VIRTIO_NET_F_GUEST_TSO4 or
+ * VIRTIO_NET_F_GUEST_TSO6. A frame is given to the guest once a segment ends
+ * it, once a packet arrives that cannot be added, once the budget runs out,
+ * or at most usecs after its first segment arrived. With a usecs of 0, it is
+ * given to the guest when the sDDF RX queues are empty. Otherwise a timeout
+ * is set with the sDDF timer on timer_ch, which must be the same channel as
+ * for the budget and notification coalescing, and not shared with another
+ * device, and virtio_net_handle_timeout must be called when it is notified.
+ */
+void virtio_net_set_gro(struct virtio_net_device *dev, uint32_t usecs, unsigned int timer_ch);
+
+/*
+ * Run a classic BPF program of len instructions on every packet from sDDF
+ * before it is copied into guest memory. The packet is dropped if the program
+ * returns 0, sent to RX virtqueue n if it returns VIRTIO_NET_BPF_STEER | n,
+ * and otherwise received as usual. The program is not copied, and a NULL
+ * program removes the filter. Returns false if the program is rejected by
+ * bpf_verify.
+ */
+bool virtio_net_set_rx_filter(struct virtio_net_device *dev, const bpf_insn_t *prog, uint32_t len);
+
+/* As virtio_net_set_rx_filter, for every frame the guest sends, which is
+ * dropped if the program returns 0. Frames are filtered once they have been
+ * copied out of guest memory, GSO frames segment by segment, so while there
+ * is a TX filter no frames are sent zero-copy. */
+bool virtio_net_set_tx_filter(struct virtio_net_device *dev, const bpf_insn_t *prog, uint32_t len);
+
+/* Continue processing queues that ran out of budget and send interrupts held
+ * back by coalescing */
+bool virtio_net_handle_timeout(struct virtio_net_device *dev);
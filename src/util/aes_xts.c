@@ -0,0 +1,458 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/aes_xts.h>
+
+/* Not every ARMv8 CPU has the AES instructions, so they are only used when
+ * asked for with LIBVMM_AES_CE */
+#if defined(LIBVMM_AES_CE)
+#if !defined(__aarch64__) || !defined(__ARM_FEATURE_AES)
+#error "LIBVMM_AES_CE needs an AArch64 target with the AES extension, e.g. -march=armv8-a+crypto"
+#endif
+#define AES_XTS_USE_CE
+#include <arm_neon.h>
+#endif
+
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t inv_sbox[256] = {
+    0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+    0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+    0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+    0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+    0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+    0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+    0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+    0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+    0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+    0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+    0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+    0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+    0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+    0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+    0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+    0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+
+static inline uint8_t xtime(uint8_t a)
+{
+    return (a << 1) ^ ((a >> 7) * 0x1b);
+}
+
+static void mix_column(uint8_t *c)
+{
+    uint8_t a0 = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+    uint8_t t = a0 ^ a1 ^ a2 ^ a3;
+    c[0] = a0 ^ t ^ xtime(a0 ^ a1);
+    c[1] = a1 ^ t ^ xtime(a1 ^ a2);
+    c[2] = a2 ^ t ^ xtime(a2 ^ a3);
+    c[3] = a3 ^ t ^ xtime(a3 ^ a0);
+}
+
+static void inv_mix_column(uint8_t *c)
+{
+    /* InvMixColumns is MixColumns after multiplying by {04}x^2 + {05} */
+    uint8_t u = xtime(xtime(c[0] ^ c[2]));
+    uint8_t v = xtime(xtime(c[1] ^ c[3]));
+    c[0] ^= u;
+    c[1] ^= v;
+    c[2] ^= u;
+    c[3] ^= v;
+    mix_column(c);
+}
+
+/* Key expansion from FIPS-197, nk is the key length in 32-bit words */
+static int expand_key(uint8_t rk[][AES_BLOCK_SIZE], const uint8_t *key, int nk)
+{
+    int rounds = nk + 6;
+    uint8_t *w = &rk[0][0];
+
+    for (int i = 0; i < nk * 4; i++) {
+        w[i] = key[i];
+    }
+
+    uint8_t rcon = 1;
+    for (int i = nk; i < 4 * (rounds + 1); i++) {
+        uint8_t t[4] = { w[4 * (i - 1)], w[4 * (i - 1) + 1], w[4 * (i - 1) + 2], w[4 * (i - 1) + 3] };
+        if (i % nk == 0) {
+            uint8_t t0 = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[t0];
+            rcon = xtime(rcon);
+        } else if (nk > 6 && i % nk == 4) {
+            for (int j = 0; j < 4; j++) {
+                t[j] = sbox[t[j]];
+            }
+        }
+        for (int j = 0; j < 4; j++) {
+            w[4 * i + j] = w[4 * (i - nk) + j] ^ t[j];
+        }
+    }
+
+    return rounds;
+}
+
+bool aes_xts_init(aes_xts_ctx_t *ctx, const uint8_t *key, size_t key_len)
+{
+    if (key_len != 32 && key_len != 64) {
+        return false;
+    }
+
+    int nk = key_len / 8;
+    ctx->rounds = expand_key(ctx->enc_keys, key, nk);
+    expand_key(ctx->tweak_keys, key + key_len / 2, nk);
+
+    /* Round keys for the equivalent inverse cipher are the encryption ones in
+     * reverse, with InvMixColumns applied to all but the first and last */
+    for (int r = 0; r <= ctx->rounds; r++) {
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            ctx->dec_keys[r][i] = ctx->enc_keys[ctx->rounds - r][i];
+        }
+        if (r != 0 && r != ctx->rounds) {
+            for (int c = 0; c < 4; c++) {
+                inv_mix_column(&ctx->dec_keys[r][c * 4]);
+            }
+        }
+    }
+
+    return true;
+}
+
+#if defined(AES_XTS_USE_CE)
+
+static inline uint8x16_t ce_encrypt(const uint8x16_t *k, int rounds, uint8x16_t b)
+{
+    for (int r = 0; r < rounds - 1; r++) {
+        b = vaesmcq_u8(vaeseq_u8(b, k[r]));
+    }
+    b = vaeseq_u8(b, k[rounds - 1]);
+    return veorq_u8(b, k[rounds]);
+}
+
+static inline uint8x16_t ce_decrypt(const uint8x16_t *k, int rounds, uint8x16_t b)
+{
+    for (int r = 0; r < rounds - 1; r++) {
+        b = vaesimcq_u8(vaesdq_u8(b, k[r]));
+    }
+    b = vaesdq_u8(b, k[rounds - 1]);
+    return veorq_u8(b, k[rounds]);
+}
+
+static void xts_unit(const aes_xts_ctx_t *ctx, uint64_t unit, uint8_t *dst, const uint8_t *src, size_t len,
+                     bool encrypt)
+{
+    uint8x16_t keys[AES_MAX_ROUNDS + 1];
+    for (int r = 0; r <= ctx->rounds; r++) {
+        keys[r] = vld1q_u8(ctx->tweak_keys[r]);
+    }
+    uint8x16_t tweak = ce_encrypt(keys, ctx->rounds, vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(unit),
+                                                                                        vcreate_u64(0))));
+
+    for (int r = 0; r <= ctx->rounds; r++) {
+        keys[r] = vld1q_u8(encrypt ? ctx->enc_keys[r] : ctx->dec_keys[r]);
+    }
+
+    uint64_t lo = vgetq_lane_u64(vreinterpretq_u64_u8(tweak), 0);
+    uint64_t hi = vgetq_lane_u64(vreinterpretq_u64_u8(tweak), 1);
+    for (size_t off = 0; off < len; off += AES_BLOCK_SIZE) {
+        uint8x16_t b = veorq_u8(vld1q_u8(src + off), tweak);
+        b = encrypt ? ce_encrypt(keys, ctx->rounds, b) : ce_decrypt(keys, ctx->rounds, b);
+        vst1q_u8(dst + off, veorq_u8(b, tweak));
+
+        /* Multiply the tweak by x in GF(2^128) */
+        uint64_t carry = hi >> 63;
+        hi = (hi << 1) | (lo >> 63);
+        lo = (lo << 1) ^ (carry * 0x87);
+        tweak = vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(lo), vcreate_u64(hi)));
+    }
+}
+
+#else
+
+static inline void add_round_key(uint8_t *s, const uint8_t *k)
+{
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        s[i] ^= k[i];
+    }
+}
+
+/* The state is stored column by column, so row r of column c is s[r + 4 * c] */
+static void sub_shift_rows(uint8_t *s)
+{
+    uint8_t t[AES_BLOCK_SIZE];
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            t[r + 4 * c] = sbox[s[r + 4 * ((c + r) % 4)]];
+        }
+    }
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        s[i] = t[i];
+    }
+}
+
+static void inv_sub_shift_rows(uint8_t *s)
+{
+    uint8_t t[AES_BLOCK_SIZE];
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            t[r + 4 * c] = inv_sbox[s[r + 4 * ((c - r + 4) % 4)]];
+        }
+    }
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        s[i] = t[i];
+    }
+}
+
+static void c_encrypt(const uint8_t k[][AES_BLOCK_SIZE], int rounds, uint8_t *s)
+{
+    add_round_key(s, k[0]);
+    for (int r = 1; r <= rounds; r++) {
+        sub_shift_rows(s);
+        if (r != rounds) {
+            for (int c = 0; c < 4; c++) {
+                mix_column(&s[c * 4]);
+            }
+        }
+        add_round_key(s, k[r]);
+    }
+}
+
+/* The equivalent inverse cipher, which has the same structure as the cipher */
+static void c_decrypt(const uint8_t k[][AES_BLOCK_SIZE], int rounds, uint8_t *s)
+{
+    add_round_key(s, k[0]);
+    for (int r = 1; r <= rounds; r++) {
+        inv_sub_shift_rows(s);
+        if (r != rounds) {
+            for (int c = 0; c < 4; c++) {
+                inv_mix_column(&s[c * 4]);
+            }
+        }
+        add_round_key(s, k[r]);
+    }
+}
+
+static void xts_unit(const aes_xts_ctx_t *ctx, uint64_t unit, uint8_t *dst, const uint8_t *src, size_t len,
+                     bool encrypt)
+{
+    uint8_t tweak[AES_BLOCK_SIZE];
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        tweak[i] = i < 8 ? (unit >> (8 * i)) & 0xff : 0;
+    }
+    c_encrypt(ctx->tweak_keys, ctx->rounds, tweak);
+
+    for (size_t off = 0; off < len; off += AES_BLOCK_SIZE) {
+        uint8_t b[AES_BLOCK_SIZE];
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            b[i] = src[off + i] ^ tweak[i];
+        }
+        if (encrypt) {
+            c_encrypt(ctx->enc_keys, ctx->rounds, b);
+        } else {
+            c_decrypt(ctx->dec_keys, ctx->rounds, b);
+        }
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            dst[off + i] = b[i] ^ tweak[i];
+        }
+
+        /* Multiply the tweak by x in GF(2^128), it is little-endian */
+        uint8_t carry = tweak[AES_BLOCK_SIZE - 1] >> 7;
+        for (int i = AES_BLOCK_SIZE - 1; i > 0; i--) {
+            tweak[i] = (tweak[i] << 1) | (tweak[i - 1] >> 7);
+        }
+        tweak[0] = (tweak[0] << 1) ^ (carry * 0x87);
+    }
+}
+
+#endif
+
+void aes_xts_encrypt(const aes_xts_ctx_t *ctx, uint64_t unit, void *dst, const void *src, size_t len)
+{
+    for (size_t off = 0; off < len; off += AES_XTS_UNIT_SIZE) {
+        xts_unit(ctx, unit++, (uint8_t *)dst + off, (const uint8_t *)src + off, AES_XTS_UNIT_SIZE, true);
+    }
+}
+
+void aes_xts_decrypt(const aes_xts_ctx_t *ctx, uint64_t unit, void *dst, const void *src, size_t len)
+{
+    for (size_t off = 0; off < len; off += AES_XTS_UNIT_SIZE) {
+        xts_unit(ctx, unit++, (uint8_t *)dst + off, (const uint8_t *)src + off, AES_XTS_UNIT_SIZE, false);
+    }
+}
+
+/* IEEE 1619 vector 1 */
+static const uint8_t kat1_ct[] = {
+    0x91, 0x7c, 0xf6, 0x9e, 0xbd, 0x68, 0xb2, 0xec, 0x9b, 0x9f, 0xe9, 0xa3, 0xea, 0xdd, 0xa6, 0x92,
+    0xcd, 0x43, 0xd2, 0xf5, 0x95, 0x98, 0xed, 0x85, 0x8c, 0x02, 0xc2, 0x65, 0x2f, 0xbf, 0x92, 0x2e,
+};
+
+/* IEEE 1619 vector 2 */
+static const uint8_t kat2_ct[] = {
+    0xc4, 0x54, 0x18, 0x5e, 0x6a, 0x16, 0x93, 0x6e, 0x39, 0x33, 0x40, 0x38, 0xac, 0xef, 0x83, 0x8b,
+    0xfb, 0x18, 0x6f, 0xff, 0x74, 0x80, 0xad, 0xc4, 0x28, 0x93, 0x82, 0xec, 0xd6, 0xd3, 0x94, 0xf0,
+};
+
+/* IEEE 1619 vector 10, a whole data unit with AES-256 */
+static const uint8_t kat10_key[] = {
+    0x27, 0x18, 0x28, 0x18, 0x28, 0x45, 0x90, 0x45, 0x23, 0x53, 0x60, 0x28, 0x74, 0x71, 0x35, 0x26,
+    0x62, 0x49, 0x77, 0x57, 0x24, 0x70, 0x93, 0x69, 0x99, 0x59, 0x57, 0x49, 0x66, 0x96, 0x76, 0x27,
+    0x31, 0x41, 0x59, 0x26, 0x53, 0x58, 0x97, 0x93, 0x23, 0x84, 0x62, 0x64, 0x33, 0x83, 0x27, 0x95,
+    0x02, 0x88, 0x41, 0x97, 0x16, 0x93, 0x99, 0x37, 0x51, 0x05, 0x82, 0x09, 0x74, 0x94, 0x45, 0x92,
+};
+
+static const uint8_t kat10_ct[] = {
+    0x1c, 0x3b, 0x3a, 0x10, 0x2f, 0x77, 0x03, 0x86, 0xe4, 0x83, 0x6c, 0x99, 0xe3, 0x70, 0xcf, 0x9b,
+    0xea, 0x00, 0x80, 0x3f, 0x5e, 0x48, 0x23, 0x57, 0xa4, 0xae, 0x12, 0xd4, 0x14, 0xa3, 0xe6, 0x3b,
+    0x5d, 0x31, 0xe2, 0x76, 0xf8, 0xfe, 0x4a, 0x8d, 0x66, 0xb3, 0x17, 0xf9, 0xac, 0x68, 0x3f, 0x44,
+    0x68, 0x0a, 0x86, 0xac, 0x35, 0xad, 0xfc, 0x33, 0x45, 0xbe, 0xfe, 0xcb, 0x4b, 0xb1, 0x88, 0xfd,
+    0x57, 0x76, 0x92, 0x6c, 0x49, 0xa3, 0x09, 0x5e, 0xb1, 0x08, 0xfd, 0x10, 0x98, 0xba, 0xec, 0x70,
+    0xaa, 0xa6, 0x69, 0x99, 0xa7, 0x2a, 0x82, 0xf2, 0x7d, 0x84, 0x8b, 0x21, 0xd4, 0xa7, 0x41, 0xb0,
+    0xc5, 0xcd, 0x4d, 0x5f, 0xff, 0x9d, 0xac, 0x89, 0xae, 0xba, 0x12, 0x29, 0x61, 0xd0, 0x3a, 0x75,
+    0x71, 0x23, 0xe9, 0x87, 0x0f, 0x8a, 0xcf, 0x10, 0x00, 0x02, 0x08, 0x87, 0x89, 0x14, 0x29, 0xca,
+    0x2a, 0x3e, 0x7a, 0x7d, 0x7d, 0xf7, 0xb1, 0x03, 0x55, 0x16, 0x5c, 0x8b, 0x9a, 0x6d, 0x0a, 0x7d,
+    0xe8, 0xb0, 0x62, 0xc4, 0x50, 0x0d, 0xc4, 0xcd, 0x12, 0x0c, 0x0f, 0x74, 0x18, 0xda, 0xe3, 0xd0,
+    0xb5, 0x78, 0x1c, 0x34, 0x80, 0x3f, 0xa7, 0x54, 0x21, 0xc7, 0x90, 0xdf, 0xe1, 0xde, 0x18, 0x34,
+    0xf2, 0x80, 0xd7, 0x66, 0x7b, 0x32, 0x7f, 0x6c, 0x8c, 0xd7, 0x55, 0x7e, 0x12, 0xac, 0x3a, 0x0f,
+    0x93, 0xec, 0x05, 0xc5, 0x2e, 0x04, 0x93, 0xef, 0x31, 0xa1, 0x2d, 0x3d, 0x92, 0x60, 0xf7, 0x9a,
+    0x28, 0x9d, 0x6a, 0x37, 0x9b, 0xc7, 0x0c, 0x50, 0x84, 0x14, 0x73, 0xd1, 0xa8, 0xcc, 0x81, 0xec,
+    0x58, 0x3e, 0x96, 0x45, 0xe0, 0x7b, 0x8d, 0x96, 0x70, 0x65, 0x5b, 0xa5, 0xbb, 0xcf, 0xec, 0xc6,
+    0xdc, 0x39, 0x66, 0x38, 0x0a, 0xd8, 0xfe, 0xcb, 0x17, 0xb6, 0xba, 0x02, 0x46, 0x9a, 0x02, 0x0a,
+    0x84, 0xe1, 0x8e, 0x8f, 0x84, 0x25, 0x20, 0x70, 0xc1, 0x3e, 0x9f, 0x1f, 0x28, 0x9b, 0xe5, 0x4f,
+    0xbc, 0x48, 0x14, 0x57, 0x77, 0x8f, 0x61, 0x60, 0x15, 0xe1, 0x32, 0x7a, 0x02, 0xb1, 0x40, 0xf1,
+    0x50, 0x5e, 0xb3, 0x09, 0x32, 0x6d, 0x68, 0x37, 0x8f, 0x83, 0x74, 0x59, 0x5c, 0x84, 0x9d, 0x84,
+    0xf4, 0xc3, 0x33, 0xec, 0x44, 0x23, 0x88, 0x51, 0x43, 0xcb, 0x47, 0xbd, 0x71, 0xc5, 0xed, 0xae,
+    0x9b, 0xe6, 0x9a, 0x2f, 0xfe, 0xce, 0xb1, 0xbe, 0xc9, 0xde, 0x24, 0x4f, 0xbe, 0x15, 0x99, 0x2b,
+    0x11, 0xb7, 0x7c, 0x04, 0x0f, 0x12, 0xbd, 0x8f, 0x6a, 0x97, 0x5a, 0x44, 0xa0, 0xf9, 0x0c, 0x29,
+    0xa9, 0xab, 0xc3, 0xd4, 0xd8, 0x93, 0x92, 0x72, 0x84, 0xc5, 0x87, 0x54, 0xcc, 0xe2, 0x94, 0x52,
+    0x9f, 0x86, 0x14, 0xdc, 0xd2, 0xab, 0xa9, 0x91, 0x92, 0x5f, 0xed, 0xc4, 0xae, 0x74, 0xff, 0xac,
+    0x6e, 0x33, 0x3b, 0x93, 0xeb, 0x4a, 0xff, 0x04, 0x79, 0xda, 0x9a, 0x41, 0x0e, 0x44, 0x50, 0xe0,
+    0xdd, 0x7a, 0xe4, 0xc6, 0xe2, 0x91, 0x09, 0x00, 0x57, 0x5d, 0xa4, 0x01, 0xfc, 0x07, 0x05, 0x9f,
+    0x64, 0x5e, 0x8b, 0x7e, 0x9b, 0xfd, 0xef, 0x33, 0x94, 0x30, 0x54, 0xff, 0x84, 0x01, 0x14, 0x93,
+    0xc2, 0x7b, 0x34, 0x29, 0xea, 0xed, 0xb4, 0xed, 0x53, 0x76, 0x44, 0x1a, 0x77, 0xed, 0x43, 0x85,
+    0x1a, 0xd7, 0x7f, 0x16, 0xf5, 0x41, 0xdf, 0xd2, 0x69, 0xd5, 0x0d, 0x6a, 0x5f, 0x14, 0xfb, 0x0a,
+    0xab, 0x1c, 0xbb, 0x4c, 0x15, 0x50, 0xbe, 0x97, 0xf7, 0xab, 0x40, 0x66, 0x19, 0x3c, 0x4c, 0xaa,
+    0x77, 0x3d, 0xad, 0x38, 0x01, 0x4b, 0xd2, 0x09, 0x2f, 0xa7, 0x55, 0xc8, 0x24, 0xbb, 0x5e, 0x54,
+    0xc4, 0xf3, 0x6f, 0xfd, 0xa9, 0xfc, 0xea, 0x70, 0xb9, 0xc6, 0xe6, 0x93, 0xe1, 0x48, 0xc1, 0x51,
+};
+
+static bool kat(const uint8_t *key, size_t key_len, uint64_t unit, const uint8_t *pt, const uint8_t *ct,
+                size_t len)
+{
+    aes_xts_ctx_t ctx;
+    uint8_t buf[AES_XTS_UNIT_SIZE];
+
+    if (!aes_xts_init(&ctx, key, key_len)) {
+        return false;
+    }
+
+    xts_unit(&ctx, unit, buf, pt, len, true);
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != ct[i]) {
+            return false;
+        }
+    }
+
+    xts_unit(&ctx, unit, buf, ct, len, false);
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != pt[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Encrypt and decrypt several data units in place with the public functions,
+ * as the block device does. Starting from unit 0xfe with the plaintext of
+ * vector 10 in every unit, the second unit must match vector 10 and the others
+ * must differ from it, and everything must decrypt back.
+ */
+#define MULTI_UNITS 4
+static uint8_t multi_buf[MULTI_UNITS * AES_XTS_UNIT_SIZE];
+
+static bool multi_unit(const uint8_t *pt)
+{
+    aes_xts_ctx_t ctx;
+    if (!aes_xts_init(&ctx, kat10_key, sizeof(kat10_key))) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(multi_buf); i++) {
+        multi_buf[i] = pt[i % AES_XTS_UNIT_SIZE];
+    }
+    aes_xts_encrypt(&ctx, 0xfe, multi_buf, multi_buf, sizeof(multi_buf));
+
+    for (int unit = 0; unit < MULTI_UNITS; unit++) {
+        const uint8_t *ct = &multi_buf[unit * AES_XTS_UNIT_SIZE];
+        bool same = true;
+        for (int i = 0; i < AES_XTS_UNIT_SIZE; i++) {
+            same = same && ct[i] == kat10_ct[i];
+        }
+        if (same != (unit == 1)) {
+            return false;
+        }
+    }
+
+    aes_xts_decrypt(&ctx, 0xfe, multi_buf, multi_buf, sizeof(multi_buf));
+    for (size_t i = 0; i < sizeof(multi_buf); i++) {
+        if (multi_buf[i] != pt[i % AES_XTS_UNIT_SIZE]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool aes_xts_self_test(void)
+{
+    uint8_t key[32];
+    uint8_t pt[AES_XTS_UNIT_SIZE];
+
+    for (int i = 0; i < 32; i++) {
+        key[i] = 0;
+        pt[i] = 0;
+    }
+    if (!kat(key, sizeof(key), 0, pt, kat1_ct, sizeof(kat1_ct))) {
+        return false;
+    }
+
+    for (int i = 0; i < 32; i++) {
+        key[i] = i < 16 ? 0x11 : 0x22;
+        pt[i] = 0x44;
+    }
+    if (!kat(key, sizeof(key), 0x3333333333, pt, kat2_ct, sizeof(kat2_ct))) {
+        return false;
+    }
+
+    for (int i = 0; i < AES_XTS_UNIT_SIZE; i++) {
+        pt[i] = i & 0xff;
+    }
+    if (!kat(kat10_key, sizeof(kat10_key), 0xff, pt, kat10_ct, sizeof(kat10_ct))) {
+        return false;
+    }
+
+    return multi_unit(pt);
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/util.h>
+#include <libvmm/util/block_cache.h>
+
+static inline uint32_t bucket(blk_cache_t *cache, uint32_t block)
+{
+    return (block * 2654435761u) % cache->num_entries;
+}
+
+static inline void *slot_data(blk_cache_t *cache, uint32_t slot)
+{
+    return (void *)(cache->data + (uintptr_t)slot * cache->block_size);
+}
+
+static void list_remove(blk_cache_t *cache, uint32_t idx)
+{
+    blk_cache_entry_t *e = &cache->entries[idx];
+    blk_cache_list_t *list = &cache->lists[e->list];
+
+    if (e->prev != BLK_CACHE_NONE) {
+        cache->entries[e->prev].next = e->next;
+    } else {
+        list->head = e->next;
+    }
+    if (e->next != BLK_CACHE_NONE) {
+        cache->entries[e->next].prev = e->prev;
+    } else {
+        list->tail = e->prev;
+    }
+    list->len--;
+}
+
+static void list_push(blk_cache_t *cache, blk_cache_list_id_t id, uint32_t idx)
+{
+    blk_cache_entry_t *e = &cache->entries[idx];
+    blk_cache_list_t *list = &cache->lists[id];
+
+    e->list = id;
+    e->prev = BLK_CACHE_NONE;
+    e->next = list->head;
+    if (list->head != BLK_CACHE_NONE) {
+        cache->entries[list->head].prev = idx;
+    } else {
+        list->tail = idx;
+    }
+    list->head = idx;
+    list->len++;
+}
+
+static uint32_t find(blk_cache_t *cache, uint32_t block)
+{
+    uint32_t idx = cache->buckets[bucket(cache, block)];
+    while (idx != BLK_CACHE_NONE && cache->entries[idx].block != block) {
+        idx = cache->entries[idx].hash_next;
+    }
+    return idx;
+}
+
+static void hash_insert(blk_cache_t *cache, uint32_t idx)
+{
+    uint32_t b = bucket(cache, cache->entries[idx].block);
+    cache->entries[idx].hash_next = cache->buckets[b];
+    cache->buckets[b] = idx;
+}
+
+static void hash_remove(blk_cache_t *cache, uint32_t idx)
+{
+    uint32_t *link = &cache->buckets[bucket(cache, cache->entries[idx].block)];
+    while (*link != idx) {
+        link = &cache->entries[*link].hash_next;
+    }
+    *link = cache->entries[idx].hash_next;
+}
+
+/* Forget about an entry entirely, freeing its data if it has any */
+static void entry_free(blk_cache_t *cache, uint32_t idx)
+{
+    blk_cache_entry_t *e = &cache->entries[idx];
+
+    list_remove(cache, idx);
+    hash_remove(cache, idx);
+    if (e->slot != BLK_CACHE_NONE) {
+        cache->free_slots[cache->num_free_slots++] = e->slot;
+        e->slot = BLK_CACHE_NONE;
+    }
+    list_push(cache, BLK_CACHE_LIST_FREE, idx);
+}
+
+/* Make sure there is a free data slot, evicting a block if needed */
+static uint32_t reclaim(blk_cache_t *cache)
+{
+    if (cache->num_free_slots == 0) {
+        blk_cache_list_t *a1in = &cache->lists[BLK_CACHE_LIST_A1IN];
+        blk_cache_list_t *am = &cache->lists[BLK_CACHE_LIST_AM];
+
+        if (a1in->len > cache->kin || am->len == 0) {
+            /* Evict the oldest block of A1in, but remember it in A1out */
+            uint32_t victim = a1in->tail;
+            blk_cache_entry_t *e = &cache->entries[victim];
+
+            list_remove(cache, victim);
+            cache->free_slots[cache->num_free_slots++] = e->slot;
+            e->slot = BLK_CACHE_NONE;
+
+            if (cache->lists[BLK_CACHE_LIST_A1OUT].len >= cache->kout) {
+                entry_free(cache, cache->lists[BLK_CACHE_LIST_A1OUT].tail);
+            }
+            list_push(cache, BLK_CACHE_LIST_A1OUT, victim);
+        } else {
+            entry_free(cache, am->tail);
+        }
+        cache->stats.evictions++;
+    }
+
+    return cache->free_slots[--cache->num_free_slots];
+}
+
+bool blk_cache_init(blk_cache_t *cache, uint32_t capacity, uint32_t block_size,
+                    void *meta, size_t meta_size, void *data)
+{
+    if (capacity == 0 || meta_size < BLK_CACHE_META_SIZE(capacity)) {
+        return false;
+    }
+
+    cache->data = (uintptr_t)data;
+    cache->block_size = block_size;
+    cache->capacity = capacity;
+    cache->kin = capacity / 4 > 0 ? capacity / 4 : 1;
+    cache->kout = BLK_CACHE_KOUT(capacity);
+
+    cache->num_entries = BLK_CACHE_NUM_ENTRIES(capacity);
+    cache->entries = meta;
+    cache->buckets = (uint32_t *)(cache->entries + cache->num_entries);
+    cache->free_slots = cache->buckets + cache->num_entries;
+
+    for (int i = 0; i < BLK_CACHE_NUM_LISTS; i++) {
+        cache->lists[i] = (blk_cache_list_t) { BLK_CACHE_NONE, BLK_CACHE_NONE, 0 };
+    }
+    for (uint32_t i = 0; i < cache->num_entries; i++) {
+        cache->buckets[i] = BLK_CACHE_NONE;
+        cache->entries[i].slot = BLK_CACHE_NONE;
+        list_push(cache, BLK_CACHE_LIST_FREE, i);
+    }
+    for (uint32_t i = 0; i < capacity; i++) {
+        cache->free_slots[i] = i;
+    }
+    cache->num_free_slots = capacity;
+
+    memset(&cache->stats, 0, sizeof(cache->stats));
+
+    return true;
+}
+
+void *blk_cache_lookup(blk_cache_t *cache, uint32_t block)
+{
+    uint32_t idx = find(cache, block);
+    if (idx == BLK_CACHE_NONE || cache->entries[idx].slot == BLK_CACHE_NONE) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    /* Blocks in A1in are not moved on a hit, a burst of accesses right after
+     * a block is first read should not make it look popular */
+    if (cache->entries[idx].list == BLK_CACHE_LIST_AM) {
+        list_remove(cache, idx);
+        list_push(cache, BLK_CACHE_LIST_AM, idx);
+    }
+
+    cache->stats.hits++;
+    return slot_data(cache, cache->entries[idx].slot);
+}
+
+bool blk_cache_contains(blk_cache_t *cache, uint32_t block)
+{
+    uint32_t idx = find(cache, block);
+    return idx != BLK_CACHE_NONE && cache->entries[idx].slot != BLK_CACHE_NONE;
+}
+
+void blk_cache_insert(blk_cache_t *cache, uint32_t block, const void *data)
+{
+    uint32_t idx = find(cache, block);
+
+    if (idx != BLK_CACHE_NONE && cache->entries[idx].slot != BLK_CACHE_NONE) {
+        memcpy(slot_data(cache, cache->entries[idx].slot), data, cache->block_size);
+        return;
+    }
+
+    blk_cache_list_id_t list = BLK_CACHE_LIST_A1IN;
+    if (idx != BLK_CACHE_NONE) {
+        /* The block was remembered in A1out, so it has been read again soon
+         * after being evicted and goes into the main list. It is taken off
+         * A1out first so that reclaiming cannot drop it. */
+        list_remove(cache, idx);
+        list = BLK_CACHE_LIST_AM;
+    }
+
+    uint32_t slot = reclaim(cache);
+
+    if (idx == BLK_CACHE_NONE) {
+        idx = cache->lists[BLK_CACHE_LIST_FREE].tail;
+        assert(idx != BLK_CACHE_NONE);
+        list_remove(cache, idx);
+        cache->entries[idx].block = block;
+        hash_insert(cache, idx);
+    }
+
+    cache->entries[idx].slot = slot;
+    list_push(cache, list, idx);
+    memcpy(slot_data(cache, slot), data, cache->block_size);
+
+    cache->stats.insertions++;
+}
+
+void blk_cache_invalidate(blk_cache_t *cache, uint32_t block, uint32_t count)
+{
+    if (count > cache->num_entries) {
+        /* Cheaper to go through everything that is cached */
+        for (uint32_t i = 0; i < cache->num_entries; i++) {
+            blk_cache_entry_t *e = &cache->entries[i];
+            if (e->list != BLK_CACHE_LIST_FREE && e->block - block < count) {
+                cache->stats.invalidations += (e->slot != BLK_CACHE_NONE);
+                entry_free(cache, i);
+            }
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t idx = find(cache, block + i);
+        if (idx != BLK_CACHE_NONE) {
+            cache->stats.invalidations += (cache->entries[idx].slot != BLK_CACHE_NONE);
+            entry_free(cache, idx);
+        }
+    }
+}
@@ -0,0 +1,456 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/bpf.h>
+
+static bool bpf_supported(const bpf_insn_t *insn)
+{
+    switch (insn->code) {
+    case BPF_LD | BPF_W | BPF_ABS:
+    case BPF_LD | BPF_H | BPF_ABS:
+    case BPF_LD | BPF_B | BPF_ABS:
+        /* Offsets this large are for ancillary data */
+        return insn->k < 0x80000000;
+    case BPF_LD | BPF_W | BPF_IND:
+    case BPF_LD | BPF_H | BPF_IND:
+    case BPF_LD | BPF_B | BPF_IND:
+    case BPF_LD | BPF_W | BPF_LEN:
+    case BPF_LD | BPF_IMM:
+    case BPF_LDX | BPF_W | BPF_IMM:
+    case BPF_LDX | BPF_W | BPF_LEN:
+    case BPF_LDX | BPF_B | BPF_MSH:
+    case BPF_ALU | BPF_ADD | BPF_K:
+    case BPF_ALU | BPF_ADD | BPF_X:
+    case BPF_ALU | BPF_SUB | BPF_K:
+    case BPF_ALU | BPF_SUB | BPF_X:
+    case BPF_ALU | BPF_MUL | BPF_K:
+    case BPF_ALU | BPF_MUL | BPF_X:
+    case BPF_ALU | BPF_DIV | BPF_X:
+    case BPF_ALU | BPF_MOD | BPF_X:
+    case BPF_ALU | BPF_OR | BPF_K:
+    case BPF_ALU | BPF_OR | BPF_X:
+    case BPF_ALU | BPF_AND | BPF_K:
+    case BPF_ALU | BPF_AND | BPF_X:
+    case BPF_ALU | BPF_XOR | BPF_K:
+    case BPF_ALU | BPF_XOR | BPF_X:
+    case BPF_ALU | BPF_LSH | BPF_X:
+    case BPF_ALU | BPF_RSH | BPF_X:
+    case BPF_ALU | BPF_NEG:
+    case BPF_JMP | BPF_JA:
+    case BPF_JMP | BPF_JEQ | BPF_K:
+    case BPF_JMP | BPF_JEQ | BPF_X:
+    case BPF_JMP | BPF_JGT | BPF_K:
+    case BPF_JMP | BPF_JGT | BPF_X:
+    case BPF_JMP | BPF_JGE | BPF_K:
+    case BPF_JMP | BPF_JGE | BPF_X:
+    case BPF_JMP | BPF_JSET | BPF_K:
+    case BPF_JMP | BPF_JSET | BPF_X:
+    case BPF_RET | BPF_K:
+    case BPF_RET | BPF_A:
+    case BPF_MISC | BPF_TAX:
+    case BPF_MISC | BPF_TXA:
+        return true;
+    case BPF_ALU | BPF_DIV | BPF_K:
+    case BPF_ALU | BPF_MOD | BPF_K:
+        return insn->k != 0;
+    case BPF_ALU | BPF_LSH | BPF_K:
+    case BPF_ALU | BPF_RSH | BPF_K:
+        return insn->k < 32;
+    case BPF_LD | BPF_MEM:
+    case BPF_LDX | BPF_MEM:
+    case BPF_ST:
+    case BPF_STX:
+        return insn->k < BPF_MEMWORDS;
+    default:
+        return false;
+    }
+}
+
+/* The scratch memory words stored to on every path to each instruction. As
+ * the VMM is single-threaded, this does not need to be on the stack. */
+static uint16_t mem_valid[BPF_MAXINSNS];
+
+bool bpf_verify(const bpf_insn_t *prog, uint32_t len)
+{
+    if (len == 0 || len > BPF_MAXINSNS) {
+        return false;
+    }
+
+    for (uint32_t pc = 0; pc < len; pc++) {
+        const bpf_insn_t *insn = &prog[pc];
+        if (!bpf_supported(insn)) {
+            return false;
+        }
+        if (BPF_CLASS(insn->code) == BPF_JMP) {
+            uint32_t left = len - pc - 1;
+            if (insn->code == (BPF_JMP | BPF_JA) ? insn->k >= left : (insn->jt >= left || insn->jf >= left)) {
+                return false;
+            }
+        }
+    }
+    if (BPF_CLASS(prog[len - 1].code) != BPF_RET) {
+        return false;
+    }
+
+    /* Jumps only go forward, so one pass sees every path to an instruction
+     * before the instruction itself */
+    mem_valid[0] = 0;
+    for (uint32_t pc = 1; pc < len; pc++) {
+        mem_valid[pc] = 0xffff;
+    }
+    for (uint32_t pc = 0; pc < len; pc++) {
+        const bpf_insn_t *insn = &prog[pc];
+        uint16_t valid = mem_valid[pc];
+
+        switch (insn->code) {
+        case BPF_LD | BPF_MEM:
+        case BPF_LDX | BPF_MEM:
+            if (!(valid & (1 << insn->k))) {
+                return false;
+            }
+            break;
+        case BPF_ST:
+        case BPF_STX:
+            valid |= 1 << insn->k;
+            break;
+        }
+
+        switch (BPF_CLASS(insn->code)) {
+        case BPF_RET:
+            break;
+        case BPF_JMP:
+            if (insn->code == (BPF_JMP | BPF_JA)) {
+                mem_valid[pc + 1 + insn->k] &= valid;
+            } else {
+                mem_valid[pc + 1 + insn->jt] &= valid;
+                mem_valid[pc + 1 + insn->jf] &= valid;
+            }
+            break;
+        default:
+            mem_valid[pc + 1] &= valid;
+            break;
+        }
+    }
+
+    return true;
+}
+
+/* Load size bytes at offset off in network byte order, if they are in the packet */
+static inline bool bpf_load(const uint8_t *pkt, uint32_t len, uint64_t off, uint32_t size, uint32_t *val)
+{
+    if (off + size > len) {
+        return false;
+    }
+
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        v = (v << 8) | pkt[off + i];
+    }
+    *val = v;
+
+    return true;
+}
+
+static inline uint32_t bpf_load_size(uint16_t code)
+{
+    switch (code & 0x18) {
+    case BPF_W:
+        return 4;
+    case BPF_H:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+uint32_t bpf_run(const bpf_insn_t *prog, const uint8_t *pkt, uint32_t len)
+{
+    uint32_t a = 0;
+    uint32_t x = 0;
+    uint32_t mem[BPF_MEMWORDS];
+
+    for (uint32_t pc = 0;; pc++) {
+        const bpf_insn_t *insn = &prog[pc];
+        uint32_t k = insn->k;
+
+        switch (insn->code) {
+        case BPF_LD | BPF_W | BPF_ABS:
+        case BPF_LD | BPF_H | BPF_ABS:
+        case BPF_LD | BPF_B | BPF_ABS:
+            if (!bpf_load(pkt, len, k, bpf_load_size(insn->code), &a)) {
+                return 0;
+            }
+            break;
+        case BPF_LD | BPF_W | BPF_IND:
+        case BPF_LD | BPF_H | BPF_IND:
+        case BPF_LD | BPF_B | BPF_IND:
+            if (!bpf_load(pkt, len, (uint64_t)x + k, bpf_load_size(insn->code), &a)) {
+                return 0;
+            }
+            break;
+        case BPF_LD | BPF_W | BPF_LEN:
+            a = len;
+            break;
+        case BPF_LD | BPF_IMM:
+            a = k;
+            break;
+        case BPF_LD | BPF_MEM:
+            a = mem[k];
+            break;
+        case BPF_LDX | BPF_W | BPF_IMM:
+            x = k;
+            break;
+        case BPF_LDX | BPF_W | BPF_LEN:
+            x = len;
+            break;
+        case BPF_LDX | BPF_MEM:
+            x = mem[k];
+            break;
+        case BPF_LDX | BPF_B | BPF_MSH:
+            /* Length of the IPv4 header at k */
+            if (!bpf_load(pkt, len, k, 1, &x)) {
+                return 0;
+            }
+            x = (x & 0xf) * 4;
+            break;
+        case BPF_ST:
+            mem[k] = a;
+            break;
+        case BPF_STX:
+            mem[k] = x;
+            break;
+        case BPF_ALU | BPF_ADD | BPF_K:
+            a += k;
+            break;
+        case BPF_ALU | BPF_ADD | BPF_X:
+            a += x;
+            break;
+        case BPF_ALU | BPF_SUB | BPF_K:
+            a -= k;
+            break;
+        case BPF_ALU | BPF_SUB | BPF_X:
+            a -= x;
+            break;
+        case BPF_ALU | BPF_MUL | BPF_K:
+            a *= k;
+            break;
+        case BPF_ALU | BPF_MUL | BPF_X:
+            a *= x;
+            break;
+        case BPF_ALU | BPF_DIV | BPF_K:
+            a /= k;
+            break;
+        case BPF_ALU | BPF_DIV | BPF_X:
+            if (x == 0) {
+                return 0;
+            }
+            a /= x;
+            break;
+        case BPF_ALU | BPF_MOD | BPF_K:
+            a %= k;
+            break;
+        case BPF_ALU | BPF_MOD | BPF_X:
+            if (x == 0) {
+                return 0;
+            }
+            a %= x;
+            break;
+        case BPF_ALU | BPF_OR | BPF_K:
+            a |= k;
+            break;
+        case BPF_ALU | BPF_OR | BPF_X:
+            a |= x;
+            break;
+        case BPF_ALU | BPF_AND | BPF_K:
+            a &= k;
+            break;
+        case BPF_ALU | BPF_AND | BPF_X:
+            a &= x;
+            break;
+        case BPF_ALU | BPF_XOR | BPF_K:
+            a ^= k;
+            break;
+        case BPF_ALU | BPF_XOR | BPF_X:
+            a ^= x;
+            break;
+        case BPF_ALU | BPF_LSH | BPF_K:
+            a <<= k;
+            break;
+        case BPF_ALU | BPF_LSH | BPF_X:
+            a = x < 32 ? a << x : 0;
+            break;
+        case BPF_ALU | BPF_RSH | BPF_K:
+            a >>= k;
+            break;
+        case BPF_ALU | BPF_RSH | BPF_X:
+            a = x < 32 ? a >> x : 0;
+            break;
+        case BPF_ALU | BPF_NEG:
+            a = -a;
+            break;
+        case BPF_JMP | BPF_JA:
+            pc += k;
+            break;
+        case BPF_JMP | BPF_JEQ | BPF_K:
+            pc += a == k ? insn->jt : insn->jf;
+            break;
+        case BPF_JMP | BPF_JEQ | BPF_X:
+            pc += a == x ? insn->jt : insn->jf;
+            break;
+        case BPF_JMP | BPF_JGT | BPF_K:
+            pc += a > k ? insn->jt : insn->jf;
+            break;
+        case BPF_JMP | BPF_JGT | BPF_X:
+            pc += a > x ? insn->jt : insn->jf;
+            break;
+        case BPF_JMP | BPF_JGE | BPF_K:
+            pc += a >= k ? insn->jt : insn->jf;
+            break;
+        case BPF_JMP | BPF_JGE | BPF_X:
+            pc += a >= x ? insn->jt : insn->jf;
+            break;
+        case BPF_JMP | BPF_JSET | BPF_K:
+            pc += (a & k) ? insn->jt : insn->jf;
+            break;
+        case BPF_JMP | BPF_JSET | BPF_X:
+            pc += (a & x) ? insn->jt : insn->jf;
+            break;
+        case BPF_RET | BPF_K:
+            return k;
+        case BPF_RET | BPF_A:
+            return a;
+        case BPF_MISC | BPF_TAX:
+            x = a;
+            break;
+        case BPF_MISC | BPF_TXA:
+            a = x;
+            break;
+        default:
+            /* Not possible for a verified program */
+            return 0;
+        }
+    }
+}
+
+/* tcpdump -dd 'ip and tcp dst port 22' */
+static const bpf_insn_t ssh_filter[] = {
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x800, 0, 8),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 6),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+    BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+    BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 22, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 262144),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+/* -((((100 - (10 + 5) * 3) % 7) << 4 | 1) ^ 0xff) */
+static const bpf_insn_t alu_prog[] = {
+    BPF_STMT(BPF_LD | BPF_IMM, 10),
+    BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 5),
+    BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 3),
+    BPF_STMT(BPF_MISC | BPF_TAX, 0),
+    BPF_STMT(BPF_LD | BPF_IMM, 100),
+    BPF_STMT(BPF_ALU | BPF_SUB | BPF_X, 0),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, 7),
+    BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 4),
+    BPF_STMT(BPF_ALU | BPF_OR | BPF_K, 1),
+    BPF_STMT(BPF_ALU | BPF_XOR | BPF_K, 0xff),
+    BPF_STMT(BPF_ALU | BPF_NEG, 0),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+/* Twice the packet length, through scratch memory, unless that is over 100
+ * in which case it divides by zero */
+static const bpf_insn_t mem_prog[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_STMT(BPF_ST, 3),
+    BPF_STMT(BPF_LDX | BPF_MEM, 3),
+    BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+    BPF_STMT(BPF_LDX | BPF_IMM, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, 100, 0, 1),
+    BPF_STMT(BPF_ALU | BPF_DIV | BPF_X, 0),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+/* Loads scratch memory that is only stored to on one path */
+static const bpf_insn_t uninit_prog[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 64, 0, 1),
+    BPF_STMT(BPF_ST, 0),
+    BPF_STMT(BPF_LD | BPF_MEM, 0),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+static const bpf_insn_t bad_jump_prog[] = {
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static const bpf_insn_t no_ret_prog[] = {
+    BPF_STMT(BPF_LD | BPF_IMM, 1),
+};
+
+static const bpf_insn_t div_zero_prog[] = {
+    BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 0),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+static const bpf_insn_t ancillary_prog[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0xfffff000),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+bool bpf_self_test(void)
+{
+    /* An Ethernet frame with an IPv4 header and the start of a TCP header */
+    uint8_t pkt[54] = { 0 };
+    pkt[12] = 0x08;
+    pkt[14] = 0x45;
+    pkt[23] = 6;
+    pkt[36] = 0;
+    pkt[37] = 22;
+
+    if (!bpf_verify(ssh_filter, sizeof(ssh_filter) / sizeof(ssh_filter[0]))
+        || bpf_run(ssh_filter, pkt, sizeof(pkt)) != 262144) {
+        return false;
+    }
+    /* Another port, a fragment, and a frame too short for the port */
+    pkt[37] = 80;
+    if (bpf_run(ssh_filter, pkt, sizeof(pkt)) != 0) {
+        return false;
+    }
+    pkt[37] = 22;
+    pkt[21] = 1;
+    if (bpf_run(ssh_filter, pkt, sizeof(pkt)) != 0) {
+        return false;
+    }
+    pkt[21] = 0;
+    if (bpf_run(ssh_filter, pkt, 37) != 0) {
+        return false;
+    }
+
+    if (!bpf_verify(alu_prog, sizeof(alu_prog) / sizeof(alu_prog[0]))
+        || bpf_run(alu_prog, pkt, sizeof(pkt)) != 0xffffff62) {
+        return false;
+    }
+
+    if (!bpf_verify(mem_prog, sizeof(mem_prog) / sizeof(mem_prog[0]))
+        || bpf_run(mem_prog, pkt, 40) != 80 || bpf_run(mem_prog, pkt, sizeof(pkt)) != 0) {
+        return false;
+    }
+
+    /* Programs the verifier must reject */
+    return !bpf_verify(uninit_prog, sizeof(uninit_prog) / sizeof(uninit_prog[0]))
+           && !bpf_verify(bad_jump_prog, sizeof(bad_jump_prog) / sizeof(bad_jump_prog[0]))
+           && !bpf_verify(no_ret_prog, sizeof(no_ret_prog) / sizeof(no_ret_prog[0]))
+           && !bpf_verify(div_zero_prog, sizeof(div_zero_prog) / sizeof(div_zero_prog[0]))
+           && !bpf_verify(ancillary_prog, sizeof(ancillary_prog) / sizeof(ancillary_prog[0]))
+           && !bpf_verify(ssh_filter, 0);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/util.h>
+#include <libvmm/util/buddy.h>
+
+/* Smallest order whose block can hold count cells */
+static inline uint32_t order_for(uint32_t count)
+{
+    return count <= 1 ? 0 : 32 - __builtin_clz(count - 1);
+}
+
+/* Largest order that is no bigger than count cells */
+static inline uint32_t order_floor(uint32_t count)
+{
+    return 31 - __builtin_clz(count);
+}
+
+static void list_push(buddy_t *buddy, uint32_t idx, uint32_t order)
+{
+    buddy_cell_t *cell = &buddy->cells[idx];
+
+    cell->order = order;
+    cell->free = true;
+    cell->prev = BUDDY_NONE;
+    cell->next = buddy->free_heads[order];
+    if (cell->next != BUDDY_NONE) {
+        buddy->cells[cell->next].prev = idx;
+    }
+    buddy->free_heads[order] = idx;
+    buddy->nonempty |= (1u << order);
+    buddy->stats.free_blocks[order]++;
+}
+
+static void list_remove(buddy_t *buddy, uint32_t idx)
+{
+    buddy_cell_t *cell = &buddy->cells[idx];
+    uint32_t order = cell->order;
+
+    if (cell->prev != BUDDY_NONE) {
+        buddy->cells[cell->prev].next = cell->next;
+    } else {
+        buddy->free_heads[order] = cell->next;
+        if (cell->next == BUDDY_NONE) {
+            buddy->nonempty &= ~(1u << order);
+        }
+    }
+    if (cell->next != BUDDY_NONE) {
+        buddy->cells[cell->next].prev = cell->prev;
+    }
+    cell->free = false;
+    buddy->stats.free_blocks[order]--;
+}
+
+/* Free an aligned block, merging it with its buddy for as long as possible */
+static void free_block(buddy_t *buddy, uint32_t idx, uint32_t order)
+{
+    while (order < BUDDY_NUM_ORDERS - 1) {
+        uint32_t buddy_idx = idx ^ (1u << order);
+        if (buddy_idx >= buddy->num_cells || (uint64_t)buddy_idx + (1u << order) > buddy->num_cells) {
+            break;
+        }
+        buddy_cell_t *b = &buddy->cells[buddy_idx];
+        if (!b->free || b->order != order) {
+            break;
+        }
+        list_remove(buddy, buddy_idx);
+        idx = MIN(idx, buddy_idx);
+        order++;
+    }
+    list_push(buddy, idx, order);
+}
+
+/* Free an arbitrary range by splitting it into aligned blocks */
+static void free_range(buddy_t *buddy, uint32_t idx, uint32_t count)
+{
+    while (count > 0) {
+        uint32_t order = order_floor(count);
+        if (idx != 0) {
+            order = MIN(order, (uint32_t)__builtin_ctz(idx));
+        }
+        free_block(buddy, idx, order);
+        idx += (1u << order);
+        count -= (1u << order);
+    }
+}
+
+bool buddy_init(buddy_t *buddy, uintptr_t base, uint64_t cell_size, uint32_t num_cells,
+                void *meta, size_t meta_size)
+{
+    if (meta_size < BUDDY_META_SIZE(num_cells)) {
+        return false;
+    }
+
+    buddy->base = base;
+    buddy->cell_size = cell_size;
+    buddy->num_cells = num_cells;
+    buddy->cells = meta;
+    buddy->nonempty = 0;
+    memset(&buddy->stats, 0, sizeof(buddy->stats));
+    for (int i = 0; i < BUDDY_NUM_ORDERS; i++) {
+        buddy->free_heads[i] = BUDDY_NONE;
+    }
+    for (uint32_t i = 0; i < num_cells; i++) {
+        buddy->cells[i].free = false;
+    }
+
+    free_range(buddy, 0, num_cells);
+    buddy->stats.free_cells = num_cells;
+
+    return true;
+}
+
+static void alloc_failed(buddy_t *buddy, uint32_t count)
+{
+    buddy->stats.failed_allocs++;
+    if (count != 0 && buddy->stats.free_cells >= count) {
+        buddy->stats.fragmented_allocs++;
+    }
+}
+
+bool buddy_full(buddy_t *buddy, uint32_t count)
+{
+    return count == 0 || (buddy->nonempty >> order_for(count)) == 0;
+}
+
+bool buddy_full_counted(buddy_t *buddy, uint32_t count)
+{
+    if (!buddy_full(buddy, count)) {
+        return false;
+    }
+    alloc_failed(buddy, count);
+
+    return true;
+}
+
+int buddy_alloc(buddy_t *buddy, uintptr_t *addr, uint32_t count)
+{
+    uint32_t want = order_for(count);
+    uint32_t avail = (count == 0) ? 0 : buddy->nonempty >> want;
+    if (avail == 0) {
+        alloc_failed(buddy, count);
+        return -1;
+    }
+
+    uint32_t order = want + __builtin_ctz(avail);
+    uint32_t idx = buddy->free_heads[order];
+    list_remove(buddy, idx);
+
+    /* Give back whatever we do not need from the block */
+    if ((1u << order) > count) {
+        free_range(buddy, idx + count, (1u << order) - count);
+    }
+
+    buddy->stats.free_cells -= count;
+    *addr = buddy->base + (uintptr_t)idx * buddy->cell_size;
+
+    return 0;
+}
+
+void buddy_free(buddy_t *buddy, uintptr_t addr, uint32_t count)
+{
+    uint32_t idx = (addr - buddy->base) / buddy->cell_size;
+    assert(idx + count <= buddy->num_cells);
+
+    free_range(buddy, idx, count);
+    buddy->stats.free_cells += count;
+}
+
+int buddy_largest_free_order(buddy_t *buddy)
+{
+    return buddy->nonempty == 0 ? -1 : 31 - __builtin_clz(buddy->nonempty);
+}
@@ -16,6 +16,9 @@
 #include <sddf/blk/queue.h>
 #include <sddf/util/fsmalloc.h>
 #include <sddf/util/ialloc.h>
+#include <libvmm/util/buddy.h>
+#include <libvmm/arch/aarch64/counter.h>
+#include <sddf/timer/client.h>
 
 /* Uncomment this to enable debug logging */
 // #define DEBUG_BLOCK
@@ -28,15 +31,125 @@
 
 #define LOG_BLOCK_ERR(...) do{ printf("VIRTIO(BLOCK)|ERROR: "); printf(__VA_ARGS__); }while(0)
 
+/* Uncomment this to print the trace points of every request while statistics are enabled */
+// #define TRACE_BLOCK
+
 static inline struct virtio_blk_device *device_state(struct virtio_device *dev)
 {
     return (struct virtio_blk_device *)dev->device_data;
 }
 
+/* Each virtqueue is bound to one of the sDDF handles in a round-robin fashion */
+static inline struct virtio_blk_sddf_handle *sddf_handle(struct virtio_blk_device *state, uint16_t vq_idx)
+{
+    return &state->sddf_handles[vq_idx % state->num_sddf_handles];
+}
+
+static bool virtio_blk_write_zeroes_supported(struct virtio_blk_device *state)
+{
+    /* The zero buffers would be written to the disk unencrypted */
+    if (state->xts != NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < state->num_sddf_handles; i++) {
+        if (state->sddf_handles[i].zero_count == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Drop all held requests */
+static void virtio_blk_prio_reset(struct virtio_blk_device *state)
+{
+    for (int i = 0; i < VIRTIO_BLK_MAX_HELD; i++) {
+        state->held[i].next = (i + 1 < VIRTIO_BLK_MAX_HELD) ? i + 1 : VIRTIO_BLK_HELD_NONE;
+    }
+    state->held_free = 0;
+
+    for (int i = 0; i < state->num_sddf_handles; i++) {
+        struct virtio_blk_sddf_handle *h = &state->sddf_handles[i];
+        for (int class = 0; class < VIRTIO_BLK_PRIO_NUM_CLASSES; class++) {
+            h->held_head[class] = VIRTIO_BLK_HELD_NONE;
+            h->held_tail[class] = VIRTIO_BLK_HELD_NONE;
+        }
+        h->num_held = 0;
+        h->held_dispatched = 0;
+    }
+}
+
+/*
+ * Drop the flushes that have not been completed and the writes that were
+ * acknowledged early. The waiting flushes were never sent to sDDF and are
+ * freed now, the flush and writes in sDDF are freed when it responds.
+ */
+static void virtio_blk_flush_reset(struct virtio_blk_device *state)
+{
+    uint32_t id = state->wb_inflight;
+    while (id != REQBK_NONE) {
+        reqbk_t *data = &state->reqbk[id];
+        id = data->wb_next;
+        data->wb_prev = REQBK_NONE;
+        data->wb_next = REQBK_NONE;
+        data->dropped = true;
+    }
+    state->wb_inflight = REQBK_NONE;
+    state->wb_pending = 0;
+    state->wb_error = false;
+
+    id = state->flush_waiting_head;
+    while (id != REQBK_NONE) {
+        uint32_t next = state->reqbk[id].merge_next;
+        ialloc_free(&state->ialloc, id);
+        id = next;
+    }
+    state->flush_waiting_head = REQBK_NONE;
+    state->flush_waiting_tail = REQBK_NONE;
+
+    if (state->flush_inflight == REQBK_NONE) {
+        return;
+    }
+    reqbk_t *head = &state->reqbk[state->flush_inflight];
+    id = head->merge_next;
+    while (id != REQBK_NONE) {
+        uint32_t next = state->reqbk[id].merge_next;
+        ialloc_free(&state->ialloc, id);
+        id = next;
+    }
+    head->merge_next = REQBK_NONE;
+    head->dropped = true;
+}
+
 static void virtio_blk_mmio_reset(struct virtio_device *dev)
 {
-    dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].ready = false;
-    dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].last_idx = 0;
+    struct virtio_blk_device *state = device_state(dev);
+
+    for (int i = 0; i < dev->num_vqs; i++) {
+        dev->vqs[i].ready = false;
+        dev->vqs[i].last_idx = 0;
+        state->stalled[i] = false;
+    }
+
+    virtio_blk_prio_reset(state);
+    virtio_blk_flush_reset(state);
+}
+
+static uint32_t virtio_blk_device_features_low(struct virtio_device *dev)
+{
+    uint32_t features = BIT_LOW(VIRTIO_BLK_F_FLUSH);
+    features = features | BIT_LOW(VIRTIO_BLK_F_CONFIG_WCE);
+    features = features | BIT_LOW(VIRTIO_BLK_F_BLK_SIZE);
+    if (dev->num_vqs > 1) {
+        features = features | BIT_LOW(VIRTIO_BLK_F_MQ);
+    }
+    features = features | BIT_LOW(VIRTIO_BLK_F_DISCARD);
+    if (virtio_blk_write_zeroes_supported(device_state(dev))) {
+        features = features | BIT_LOW(VIRTIO_BLK_F_WRITE_ZEROES);
+    }
+
+    return features;
 }
 
 static bool virtio_blk_mmio_get_device_features(struct virtio_device *dev, uint32_t *features)
@@ -48,8 +161,7 @@ static bool virtio_blk_mmio_get_device_features(struct virtio_device *dev, uint3
     switch (dev->data.DeviceFeaturesSel) {
     /* feature bits 0 to 31 */
     case 0:
-        *features = BIT_LOW(VIRTIO_BLK_F_FLUSH);
-        *features = *features | BIT_LOW(VIRTIO_BLK_F_BLK_SIZE);
+        *features = virtio_blk_device_features_low(dev);
         break;
     /* features bits 32 to 63 */
     case 1:
@@ -71,14 +183,14 @@ static bool virtio_blk_mmio_set_driver_features(struct virtio_device *dev, uint3
        by the driver. */
     bool success = false;
 
-    uint32_t device_features = 0;
-    device_features = device_features | BIT_LOW(VIRTIO_BLK_F_FLUSH);
-    device_features = device_features | BIT_LOW(VIRTIO_BLK_F_BLK_SIZE);
+    uint32_t device_features = virtio_blk_device_features_low(dev);
 
     switch (dev->data.DriverFeaturesSel) {
     /* feature bits 0 to 31 */
     case 0:
-        success = (features == device_features);
+        /* The driver may accept a subset of what we offer, e.g a driver that does
+         * not know about VIRTIO_BLK_F_MQ will only ever use the default virtqueue */
+        success = ((features & ~device_features) == 0);
         break;
     /* features bits 32 to 63 */
     case 1:
@@ -102,7 +214,14 @@ static bool virtio_blk_mmio_get_device_config(struct virtio_device *dev, uint32_
     struct virtio_blk_device *state = device_state(dev);
 
     uintptr_t config_base_addr = (uintptr_t)&state->config;
-    uintptr_t config_field_offset = (uintptr_t)(offset - REG_VIRTIO_MMIO_CONFIG);
+    /* Sub-word fields such as num_queues are read by the driver with smaller
+     * loads, the MMIO layer expects the aligned word containing the field and
+     * masks out the rest itself. */
+    uintptr_t config_field_offset = (uintptr_t)(offset - REG_VIRTIO_MMIO_CONFIG) & ~0x3;
+    if (config_field_offset + sizeof(uint32_t) > sizeof(struct virtio_blk_config)) {
+        LOG_BLOCK_ERR("driver reads invalid device config offset 0x%x\n", offset);
+        return false;
+    }
     uint32_t *config_field_addr = (uint32_t *)(config_base_addr + config_field_offset);
     *ret_val = *config_field_addr;
     LOG_BLOCK("get device config with base_addr 0x%x and field_address 0x%x has value %d\n",
@@ -115,19 +234,22 @@ static bool virtio_blk_mmio_set_device_config(struct virtio_device *dev, uint32_
 {
     struct virtio_blk_device *state = device_state(dev);
 
-    uintptr_t config_base_addr = (uintptr_t)&state->config;
+    /* The only field the driver may write to is writeback, which is a single
+     * byte so the value is in the low bits whatever the access size */
     uintptr_t config_field_offset = (uintptr_t)(offset - REG_VIRTIO_MMIO_CONFIG);
-    uint32_t *config_field_addr = (uint32_t *)(config_base_addr + config_field_offset);
-    *config_field_addr = val;
-    LOG_BLOCK("set device config with base_addr 0x%x and field_address 0x%x with value %d\n",
-              config_base_addr, config_field_addr, val);
+    if (config_field_offset != offsetof(struct virtio_blk_config, writeback)) {
+        LOG_BLOCK_ERR("driver writes read-only device config offset 0x%x\n", offset);
+        return false;
+    }
+
+    state->config.writeback = val & 0xff;
+    LOG_BLOCK("driver set cache mode to %s\n", state->config.writeback ? "writeback" : "writethrough");
 
     return true;
 }
 
-static void virtio_blk_used_buffer(struct virtio_device *dev, uint16_t desc)
+static void virtio_blk_used_buffer(struct virtq *virtq, uint16_t desc)
 {
-    struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
     struct virtq_used_elem used_elem = {desc, 0};
 
     virtq->used->ring[virtq->used->idx % virtq->num] = used_elem;
@@ -150,346 +272,2045 @@ static void virtio_blk_set_interrupt_status(struct virtio_device *dev,
 }
 
 /* Set response to virtio request to error */
-static void virtio_blk_set_req_fail(struct virtio_device *dev, uint16_t desc)
+static void virtio_blk_set_req_fail(struct virtq *virtq, uint16_t desc)
 {
-    struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
-
     uint16_t curr_virtio_desc = desc;
     for (; virtq->desc[curr_virtio_desc].flags & VIRTQ_DESC_F_NEXT;
          curr_virtio_desc = virtq->desc[curr_virtio_desc].next) {}
     *((uint8_t *)virtq->desc[curr_virtio_desc].addr) = VIRTIO_BLK_S_IOERR;
 }
 
-static void virtio_blk_set_req_success(struct virtio_device *dev, uint16_t desc)
+static void virtio_blk_set_req_success(struct virtq *virtq, uint16_t desc)
 {
-    struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
-
     uint16_t curr_virtio_desc = desc;
     for (; virtq->desc[curr_virtio_desc].flags & VIRTQ_DESC_F_NEXT;
          curr_virtio_desc = virtq->desc[curr_virtio_desc].next) {}
     *((uint8_t *)virtq->desc[curr_virtio_desc].addr) = VIRTIO_BLK_S_OK;
 }
 
-static bool sddf_make_req_check(struct virtio_blk_device *state, uint16_t sddf_count)
+static inline uint64_t virtio_blk_stats_now(struct virtio_blk_device *state)
+{
+    return state->stats_enabled ? arch_counter_read() : 0;
+}
+
+static inline uint32_t virtio_blk_stats_bucket(uint64_t val)
+{
+    if (val == 0) {
+        return 0;
+    }
+    return MIN(63 - __builtin_clzll(val), VIRTIO_BLK_STATS_BUCKETS - 1);
+}
+
+/* Send a request to sDDF, recording when it was sent and how many were in-flight */
+static void virtio_blk_sddf_enqueue(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h,
+                                    blk_req_code_t code, uintptr_t offset, uint32_t block_number, uint16_t count,
+                                    uint32_t req_id, uint64_t avail_time)
+{
+    int err = blk_enqueue_req(&h->queue_h, code, offset, block_number, count, req_id);
+    assert(!err);
+    h->inflight++;
+
+    if (state->stats_enabled) {
+        state->req_times[req_id].avail = avail_time;
+        state->req_times[req_id].enqueue = arch_counter_read();
+        state->stats.queue_depth[virtio_blk_stats_bucket(h->inflight)]++;
+        state->stats.max_queue_depth = MAX(state->stats.max_queue_depth, h->inflight);
+    }
+}
+
+/*
+ * Record a request that has just been put in the used ring. The enqueue and
+ * complete times are 0 for requests that never went to sDDF. Requests that
+ * are not reads, writes or flushes, and those taken off the available ring
+ * before statistics were enabled, are ignored.
+ */
+static void virtio_blk_stats_complete(struct virtio_blk_device *state, uint32_t type, uint64_t avail,
+                                      uint64_t enqueue, uint64_t complete)
+{
+    if (!state->stats_enabled || avail == 0) {
+        return;
+    }
+
+    int op;
+    switch (type) {
+    case VIRTIO_BLK_T_IN:
+        op = VIRTIO_BLK_STATS_READ;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        op = VIRTIO_BLK_STATS_WRITE;
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        op = VIRTIO_BLK_STATS_FLUSH;
+        break;
+    default:
+        return;
+    }
+
+    uint64_t used = arch_counter_read();
+    uint32_t (*latency)[VIRTIO_BLK_STATS_BUCKETS] = state->stats.latency[op];
+    if (enqueue != 0) {
+        latency[VIRTIO_BLK_STATS_QUEUED][virtio_blk_stats_bucket(enqueue - avail)]++;
+        latency[VIRTIO_BLK_STATS_BACKEND][virtio_blk_stats_bucket(complete - enqueue)]++;
+    }
+    latency[VIRTIO_BLK_STATS_TOTAL][virtio_blk_stats_bucket(used - avail)]++;
+    state->stats.completed[op]++;
+    state->stats_since_dump++;
+
+#if defined(TRACE_BLOCK)
+    printf("VIRTIO(BLOCK)|TRACE: op %d avail %lu enqueue %lu complete %lu used %lu\n", op, avail, enqueue, complete,
+           used);
+#endif
+}
+
+/* Allocation of data buffers, from either fsmalloc or the buddy allocator */
+static bool virtio_blk_data_full(struct virtio_blk_sddf_handle *h, uint16_t count)
+{
+    if (h->use_buddy) {
+        return count != 0 && buddy_full_counted(&h->buddy, count);
+    }
+    return fsmalloc_full(&h->fsmalloc, count);
+}
+
+static void virtio_blk_data_alloc(struct virtio_blk_sddf_handle *h, uintptr_t *addr, uint16_t count)
+{
+    if (h->use_buddy) {
+        int err = buddy_alloc(&h->buddy, addr, count);
+        assert(!err);
+    } else {
+        fsmalloc_alloc(&h->fsmalloc, addr, count);
+    }
+}
+
+static void virtio_blk_data_free(struct virtio_blk_sddf_handle *h, uintptr_t addr, uint16_t count)
+{
+    if (h->use_buddy) {
+        buddy_free(&h->buddy, addr, count);
+    } else {
+        fsmalloc_free(&h->fsmalloc, addr, count);
+    }
+}
+
+static bool sddf_make_req_check(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h,
+                                uint16_t sddf_count)
 {
     /* Check if ialloc is full, if data region is full, if req queue is full.
-       If these all pass then this request can be handled successfully */
+       If these all pass then this request can be handled successfully. None of
+       these are errors, they only mean that we have to wait for sDDF to respond
+       to some of our outstanding requests. */
     if (ialloc_full(&state->ialloc)) {
-        LOG_BLOCK_ERR("Request bookkeeping array is full\n");
+        LOG_BLOCK("Request bookkeeping array is full\n");
         return false;
     }
 
-    if (blk_queue_full_req(&state->queue_h)) {
-        LOG_BLOCK_ERR("Request queue is full\n");
+    if (blk_queue_full_req(&h->queue_h)) {
+        LOG_BLOCK("Request queue is full\n");
         return false;
     }
 
-    if (fsmalloc_full(&state->fsmalloc, sddf_count)) {
-        LOG_BLOCK_ERR("Data region is full\n");
+    if (virtio_blk_data_full(h, sddf_count)) {
+        LOG_BLOCK("Data region is full\n");
         return false;
     }
 
     return true;
 }
 
-static bool virtio_blk_mmio_queue_notify(struct virtio_device *dev)
+/*
+ * Keep track of an sDDF write whose requests have all been completed to the
+ * driver. For a merged write this is its first request.
+ */
+static void virtio_blk_writeback_track(struct virtio_blk_device *state, uint32_t req_id)
 {
-    /* If multiqueue feature bit negotiated, should read which queue from dev->QueueNotify,
-       but for now we just assume it's the one and only default queue */
-    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ];
-    struct virtq *virtq = &vq->virtq;
-
-    struct virtio_blk_device *state = device_state(dev);
-
-    bool has_dropped = false; /* if any request has to be dropped due to any number of reasons, this becomes true */
+    reqbk_t *data = &state->reqbk[req_id];
 
-    /* get next available request to be handled */
-    uint16_t idx = vq->last_idx;
-
-    int err = 0;
-    LOG_BLOCK("------------- Driver notified device -------------\n");
-    for (; idx != virtq->avail->idx; idx++) {
-        uint16_t desc_head = virtq->avail->ring[idx % virtq->num];
+    data->wb_prev = REQBK_NONE;
+    data->wb_next = state->wb_inflight;
+    if (data->wb_next != REQBK_NONE) {
+        state->reqbk[data->wb_next].wb_prev = req_id;
+    }
+    state->wb_inflight = req_id;
+}
 
-        uint16_t curr_desc_head = desc_head;
+/*
+ * Whether any of count blocks from block are being written by an sDDF write
+ * that has already been completed to the driver. Reading them from sDDF could
+ * return the data from before the write, and writing them could be reordered
+ * with it, so such requests have to wait until the write has completed.
+ */
+static bool virtio_blk_writeback_overlaps(struct virtio_blk_device *state, uint32_t block, uint32_t count)
+{
+    for (uint32_t id = state->wb_inflight; id != REQBK_NONE; id = state->reqbk[id].wb_next) {
+        reqbk_t *data = &state->reqbk[id];
+        if (block < data->sddf_block_number + data->sddf_count && data->sddf_block_number < block + count) {
+            LOG_BLOCK("Request for blocks 0x%x-0x%x waiting on write of blocks 0x%x-0x%x\n", block,
+                      block + count - 1, data->sddf_block_number, data->sddf_block_number + data->sddf_count - 1);
+            return true;
+        }
+    }
 
-        /* Print out what the request type is */
-        struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[curr_desc_head].addr;
-        LOG_BLOCK("----- Request type is 0x%x -----\n", virtio_req->type);
+    return false;
+}
 
-        /* Parse different requests */
-        switch (virtio_req->type) {
-        /* There are three parts with each block request. The header, body (which contains the data) and reply. */
-        case VIRTIO_BLK_T_IN: {
-            LOG_BLOCK("Request type is VIRTIO_BLK_T_IN\n");
-            LOG_BLOCK("Sector (read/write offset) is %d\n", virtio_req->sector);
+/* Send as many sDDF writes from the zero buffers as resources allow for a
+ * write zeroes request. Returns true if any request was enqueued. */
+static bool virtio_blk_write_zeroes_enqueue(struct virtio_blk_device *state,
+                                            struct virtio_blk_sddf_handle *h,
+                                            uint32_t parent_id)
+{
+    reqbk_t *parent = &state->reqbk[parent_id];
+
+    bool enqueued = false;
+    while (parent->remaining > 0 && !ialloc_full(&state->ialloc) && !blk_queue_full_req(&h->queue_h)) {
+        uint16_t count = MIN(parent->remaining, h->zero_count);
+
+        uint32_t req_id;
+        ialloc_alloc(&state->ialloc, &req_id);
+        state->reqbk[req_id] = (reqbk_t) {
+            .virtio_desc_head = parent->virtio_desc_head,
+            .sddf_block_number = parent->sddf_block_number,
+            .sddf_count = count,
+            .vq_idx = parent->vq_idx,
+            .parent_id = parent_id,
+        };
+
+        /* Write zeroes is not one of the operations we keep statistics for */
+        virtio_blk_sddf_enqueue(state, h, BLK_REQ_WRITE, h->zero_data - h->data_region,
+                                parent->sddf_block_number, count, req_id, 0);
+
+        parent->sddf_block_number += count;
+        parent->remaining -= count;
+        parent->pending++;
+        enqueued = true;
+    }
 
-            curr_desc_head = virtq->desc[curr_desc_head].next;
-            LOG_BLOCK("Descriptor index is %d, Descriptor flags are: 0x%x, length is 0x%x\n", curr_desc_head,
-                      (uint16_t)virtq->desc[curr_desc_head].flags, virtq->desc[curr_desc_head].len);
+    return enqueued;
+}
 
-            /* Converting virtio sector number to sddf block number, we are rounding down */
-            uint32_t sddf_block_number = (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
-            /* Converting bytes to the number of blocks, we are rounding up */
-            uint16_t sddf_count = (virtq->desc[curr_desc_head].len + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
+/* Handle the response of one of the sDDF writes belonging to a write zeroes
+ * request. Returns true if the whole virtIO request has now completed. */
+static bool virtio_blk_write_zeroes_resp(struct virtio_blk_device *state,
+                                         struct virtio_blk_sddf_handle *h,
+                                         uint32_t parent_id,
+                                         bool success)
+{
+    reqbk_t *parent = &state->reqbk[parent_id];
 
-            if (!sddf_make_req_check(state, sddf_count)) {
-                virtio_blk_set_req_fail(dev, desc_head);
-                has_dropped = true;
-                break;
-            }
+    parent->pending--;
+    if (!success) {
+        parent->failed = true;
+    }
 
-            /* Allocate data buffer from data region based on sddf_count */
-            uintptr_t sddf_data;
-            fsmalloc_alloc(&state->fsmalloc, &sddf_data, sddf_count);
-
-            /* Bookkeep the virtio sddf block size translation */
-            uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
-            uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
-
-            /* Book keep the request */
-            uint32_t req_id;
-            ialloc_alloc(&state->ialloc, &req_id);
-            state->reqbk[req_id] = (reqbk_t) {
-                desc_head, sddf_data, sddf_count, sddf_block_number,
-                           virtio_data, virtio_data_size, 0
-            };
-
-            uintptr_t offset = sddf_data - ((struct virtio_blk_device *)dev->device_data)->data_region;
-            err = blk_enqueue_req(&state->queue_h, BLK_REQ_READ, offset, sddf_block_number, sddf_count, req_id);
-            assert(!err);
-            break;
+    if (!parent->failed && parent->remaining > 0) {
+        /* The response we just got frees up room to send more */
+        if (virtio_blk_write_zeroes_enqueue(state, h, parent_id)) {
+            microkit_notify(h->server_ch);
         }
-        case VIRTIO_BLK_T_OUT: {
-            LOG_BLOCK("Request type is VIRTIO_BLK_T_OUT\n");
-            LOG_BLOCK("Sector (read/write offset) is %d\n", virtio_req->sector);
-
-            curr_desc_head = virtq->desc[curr_desc_head].next;
-            LOG_BLOCK("Descriptor index is %d, Descriptor flags are: 0x%x, length is 0x%x\n", curr_desc_head,
-                      (uint16_t)virtq->desc[curr_desc_head].flags, virtq->desc[curr_desc_head].len);
-
-            /* Converting virtio sector number to sddf block number, we are rounding down */
-            uint32_t sddf_block_number = (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
-            /* Converting bytes to the number of blocks, we are rounding up */
-            uint16_t sddf_count = (virtq->desc[curr_desc_head].len + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
-
-            bool aligned = ((virtio_req->sector % (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE)) == 0);
-
-            /* If the write request is not aligned to the sddf transfer size, we need to do a read-modify-write:
-            we need to first read the surrounding aligned memory, overwrite that read memory on the unaligned areas
-            we want write to, and then write the entire memory back to disk. */
-            if (!aligned) {
-                if (!sddf_make_req_check(state, sddf_count)) {
-                    virtio_blk_set_req_fail(dev, desc_head);
-                    has_dropped = true;
-                    break;
-                }
-
-                /* Allocate data buffer from data region based on sddf_count */
-                uintptr_t sddf_data;
-                fsmalloc_alloc(&state->fsmalloc, &sddf_data, sddf_count);
-
-                /* Bookkeep the virtio sddf block size translation */
-                uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
-                uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
-
-                /* Book keep the request */
-                uint32_t req_id;
-                ialloc_alloc(&state->ialloc, &req_id);
-                state->reqbk[req_id] = (reqbk_t) {
-                    desc_head, sddf_data, sddf_count, sddf_block_number,
-                               virtio_data, virtio_data_size, aligned
-                };
-
-                uintptr_t offset = sddf_data - ((struct virtio_blk_device *)dev->device_data)->data_region;
-                err = blk_enqueue_req(&state->queue_h, BLK_REQ_READ, offset, sddf_block_number, sddf_count, req_id);
-                assert(!err);
-            } else {
-                if (!sddf_make_req_check(state, sddf_count)) {
-                    virtio_blk_set_req_fail(dev, desc_head);
-                    has_dropped = true;
-                    break;
-                }
+        return false;
+    }
 
-                /* Allocate data buffer from data region based on sddf_count */
-                uintptr_t sddf_data;
-                fsmalloc_alloc(&state->fsmalloc, &sddf_data, sddf_count);
+    if (parent->pending > 0) {
+        return false;
+    }
 
-                /* Bookkeep the virtio sddf block size translation */
-                uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
-                uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
+    struct virtq *virtq = &state->virtio_device.vqs[parent->vq_idx].virtq;
+    if (parent->failed) {
+        virtio_blk_set_req_fail(virtq, parent->virtio_desc_head);
+    } else {
+        virtio_blk_set_req_success(virtq, parent->virtio_desc_head);
+    }
+    virtio_blk_used_buffer(virtq, parent->virtio_desc_head);
+    ialloc_free(&state->ialloc, parent_id);
 
-                /* Book keep the request */
-                uint32_t req_id;
-                ialloc_alloc(&state->ialloc, &req_id);
-                state->reqbk[req_id] = (reqbk_t) {
-                    desc_head, sddf_data, sddf_count, sddf_block_number,
-                               virtio_data, virtio_data_size, aligned
-                };
+    return true;
+}
 
-                /* Copy data from virtio buffer to data buffer, create sddf write request and initialise it with data buffer */
-                memcpy((void *)sddf_data, (void *)virtq->desc[curr_desc_head].addr, virtq->desc[curr_desc_head].len);
+/* Number of sDDF blocks covered by len bytes starting at the given sector */
+static uint32_t virtio_blk_span_blocks(uint64_t sector, uint32_t len)
+{
+    uint32_t offset = (sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
+    return (offset + len + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
+}
 
-                uintptr_t offset = sddf_data - ((struct virtio_blk_device *)dev->device_data)->data_region;
-                err = blk_enqueue_req(&state->queue_h, BLK_REQ_WRITE, offset, sddf_block_number, sddf_count, req_id);
-                assert(!err);
-            }
-            break;
-        }
-        case VIRTIO_BLK_T_FLUSH: {
-            LOG_BLOCK("Request type is VIRTIO_BLK_T_FLUSH\n");
+/* Copy data from the driver into the data region, sector is where it goes on
+ * the disk */
+static void virtio_blk_copy_to_sddf(struct virtio_blk_device *state, uintptr_t dst, uintptr_t src, uint32_t len,
+                                    uint64_t sector)
+{
+    if (state->xts != NULL) {
+        aes_xts_encrypt(state->xts, sector, (void *)dst, (void *)src, len);
+    } else {
+        memcpy((void *)dst, (void *)src, len);
+    }
+}
 
-            if (!sddf_make_req_check(state, 0)) {
-                virtio_blk_set_req_fail(dev, desc_head);
-                has_dropped = true;
-                break;
-            }
+/* Copy data read from the disk to the driver */
+static void virtio_blk_copy_from_sddf(struct virtio_blk_device *state, uintptr_t dst, uintptr_t src, uint32_t len,
+                                      uint64_t sector)
+{
+    if (state->xts != NULL) {
+        aes_xts_decrypt(state->xts, sector, (void *)dst, (void *)src, len);
+    } else {
+        memcpy((void *)dst, (void *)src, len);
+    }
+}
 
-            /* Book keep the request */
-            uint32_t req_id;
-            ialloc_alloc(&state->ialloc, &req_id);
-            /* except for virtio desc, nothing else needs to be retrieved later
-             * so leave as 0 */
-            state->reqbk[req_id] = (reqbk_t) {
-                desc_head, 0, 0, 0, 0, 0
-            };
+/* Serve a read from the cache, only if every block it covers is cached */
+static bool virtio_blk_cache_read(struct virtio_blk_device *state, uint64_t sector, uintptr_t addr, uint32_t len)
+{
+    blk_cache_t *cache = state->cache;
+    if (cache == NULL || len == 0) {
+        return false;
+    }
 
-            err = blk_enqueue_req(&state->queue_h, BLK_REQ_FLUSH, 0, 0, 0, req_id);
-            break;
-        }
-        default: {
-            LOG_BLOCK_ERR(
-                "Handling VirtIO block request, but virtIO request type is not recognised: %d\n",
-                virtio_req->type);
-            virtio_blk_set_req_fail(dev, desc_head);
-            has_dropped = true;
-            break;
-        }
+    uint32_t block = (sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
+    uint32_t count = virtio_blk_span_blocks(sector, len);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!blk_cache_contains(cache, block + i)) {
+            /* Counts the miss */
+            blk_cache_lookup(cache, block + i);
+            return false;
         }
     }
 
-    /* Update virtq index to the next available request to be handled */
-    vq->last_idx = idx;
+    uint32_t offset = (sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
+    for (uint32_t i = 0; len > 0; i++) {
+        uint8_t *data = blk_cache_lookup(cache, block + i);
+        uint32_t n = MIN(len, BLK_TRANSFER_SIZE - offset);
+        uint64_t data_sector = ((uint64_t)(block + i) * BLK_TRANSFER_SIZE + offset) / VIRTIO_BLK_SECTOR_SIZE;
+        virtio_blk_copy_from_sddf(state, addr, (uintptr_t)(data + offset), n, data_sector);
+        addr += n;
+        len -= n;
+        offset = 0;
+    }
 
-    bool success = true;
+    return true;
+}
 
-    /* If any request has to be dropped due to any number of reasons, we inject an interrupt */
-    if (has_dropped) {
-        virtio_blk_set_interrupt_status(dev, true, false);
-        success = virtio_blk_virq_inject(dev);
+/* Add blocks that have been read from sDDF to the cache */
+static void virtio_blk_cache_fill(struct virtio_blk_device *state, uint32_t epoch, uint32_t block, uint32_t count,
+                                  uintptr_t data)
+{
+    if (state->cache == NULL || epoch != state->cache_epoch) {
+        return;
     }
 
-    if (!blk_queue_plugged_req(&state->queue_h)) {
-        /* there is a world where all requests to be handled during this batch
-         * are dropped and hence this notify to the other PD would be redundant */
-        microkit_notify(state->server_ch);
+    for (uint32_t i = 0; i < count; i++) {
+        blk_cache_insert(state->cache, block + i, (void *)(data + i * BLK_TRANSFER_SIZE));
     }
+}
 
-    return success;
+/* Free a read-ahead buffer that sDDF has responded to, adapting the window to
+ * how much of it the driver used */
+static void virtio_blk_readahead_drop(struct virtio_blk_device *state, struct virtio_blk_readahead_buf *buf)
+{
+    struct virtio_blk_readahead *ra = &state->readahead;
+
+    uint16_t window;
+    if (buf->consumed < buf->count) {
+        ra->wasted += buf->count - buf->consumed;
+        window = MAX(ra->window / 2, VIRTIO_BLK_READAHEAD_MIN_WINDOW);
+    } else {
+        window = ra->window * 2;
+    }
+    ra->window = MIN(window, ra->max_window);
+
+    virtio_blk_data_free(&state->sddf_handles[buf->handle], buf->data, buf->count);
+    buf->valid = false;
 }
 
-bool virtio_blk_handle_resp(struct virtio_blk_device *state)
+static bool virtio_blk_readahead_usable(struct virtio_blk_readahead_buf *buf)
 {
-    struct virtio_device *dev = &state->virtio_device;
+    return buf->valid && !buf->inflight && !buf->stale;
+}
 
-    blk_resp_status_t sddf_ret_status;
-    uint16_t sddf_ret_success_count;
-    uint32_t sddf_ret_id;
+/* Whether the given block is in a read-ahead buffer that can be read from */
+static bool virtio_blk_readahead_contains(struct virtio_blk_device *state, uint32_t block)
+{
+    for (int i = 0; i < VIRTIO_BLK_READAHEAD_BUFFERS; i++) {
+        struct virtio_blk_readahead_buf *buf = &state->readahead.bufs[i];
+        if (virtio_blk_readahead_usable(buf) && block >= buf->block && block < buf->block + buf->count) {
+            return true;
+        }
+    }
 
-    bool handled = false;
-    int err = 0;
-    while (!blk_queue_empty_resp(&state->queue_h)) {
-        err = blk_dequeue_resp(&state->queue_h,
-                               &sddf_ret_status,
-                               &sddf_ret_success_count,
-                               &sddf_ret_id);
-        assert(!err);
+    return false;
+}
 
-        /* Freeing and retrieving data store */
-        reqbk_t *data = &state->reqbk[sddf_ret_id];
-        ialloc_free(&state->ialloc, sddf_ret_id);
+/* Serve a read from a read-ahead buffer, only if one buffer covers all of it */
+static bool virtio_blk_readahead_read(struct virtio_blk_device *state, uint64_t sector, uintptr_t addr,
+                                      uint32_t len)
+{
+    struct virtio_blk_readahead *ra = &state->readahead;
+    if (ra->max_window == 0 || len == 0) {
+        return false;
+    }
 
-        struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
+    uint32_t block = (sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
+    uint32_t count = virtio_blk_span_blocks(sector, len);
+    for (int i = 0; i < VIRTIO_BLK_READAHEAD_BUFFERS; i++) {
+        struct virtio_blk_readahead_buf *buf = &ra->bufs[i];
+        if (!virtio_blk_readahead_usable(buf) || block < buf->block || block + count > buf->block + buf->count) {
+            continue;
+        }
 
-        struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[data->virtio_desc_head].addr;
+        uintptr_t offset = (sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
+        virtio_blk_copy_from_sddf(state, addr, buf->data + (block - buf->block) * BLK_TRANSFER_SIZE + offset, len,
+                                  sector);
+        ra->hits++;
 
-        uint16_t curr_virtio_desc = virtq->desc[data->virtio_desc_head].next;
+        buf->consumed = MAX(buf->consumed, block + count - buf->block);
+        if (buf->consumed == buf->count) {
+            virtio_blk_readahead_drop(state, buf);
+        }
+        return true;
+    }
 
-        bool resp_success = false;
-        if (sddf_ret_status == BLK_RESP_OK) {
-            resp_success = true;
-            switch (virtio_req->type) {
-            case VIRTIO_BLK_T_IN: {
-                memcpy((void *)virtq->desc[curr_virtio_desc].addr,
-                       (void *)data->virtio_data, data->virtio_data_size);
-                break;
-            }
-            case VIRTIO_BLK_T_OUT: {
-                if (!data->aligned) {
-                    /* Copy the write data into an offset into the allocated sddf data buffer */
-                    memcpy((void *)data->virtio_data,
-                           (void *)virtq->desc[curr_virtio_desc].addr,
-                           data->virtio_data_size);
+    return false;
+}
 
-                    uint32_t new_sddf_id;
-                    ialloc_alloc(&state->ialloc, &new_sddf_id);
-                    state->reqbk[new_sddf_id] = (reqbk_t) {
-                        data->virtio_desc_head,
-                             data->sddf_data, data->sddf_count,
-                             data->sddf_block_number, 0, 0, true
-                    };
+/*
+ * Follow the stream of reads from the driver, called once a read has been
+ * served or sent to sDDF. If the stream is sequential, the next window is
+ * read ahead into the data region of h, as long as that does not take
+ * resources that requests from the driver are waiting on. Returns true if a
+ * read was sent to sDDF.
+ */
+static bool virtio_blk_readahead_update(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h,
+                                        uint32_t block, uint32_t count)
+{
+    struct virtio_blk_readahead *ra = &state->readahead;
+    if (ra->max_window == 0) {
+        return false;
+    }
 
-                    err = blk_enqueue_req(&state->queue_h,
-                                          BLK_REQ_WRITE,
-                                          data->sddf_data - state->data_region,
-                                          data->sddf_block_number,
-                                          data->sddf_count,
-                                          new_sddf_id);
-                    assert(!err);
-                    microkit_notify(state->server_ch);
-                    continue;
-                }
-                break;
-            }
-            case VIRTIO_BLK_T_FLUSH:
-                break;
-            default: {
-                LOG_BLOCK_ERR(
-                    "Retrieving sDDF block response, but virtIO request type is not recognised: %d\n",
-                    virtio_req->type);
-                resp_success = false;
-                break;
+    if (block == ra->next_block) {
+        ra->seq_reads++;
+    } else {
+        /* The stream has moved, whatever was read ahead of it is not needed */
+        ra->seq_reads = 1;
+        for (int i = 0; i < VIRTIO_BLK_READAHEAD_BUFFERS; i++) {
+            struct virtio_blk_readahead_buf *buf = &ra->bufs[i];
+            if (!buf->valid || (block >= buf->block && block < buf->block + buf->count)) {
+                continue;
             }
+            if (buf->inflight) {
+                buf->stale = true;
+            } else {
+                virtio_blk_readahead_drop(state, buf);
             }
         }
+    }
+    ra->next_block = block + count;
 
-        if (resp_success) {
-            virtio_blk_set_req_success(dev, data->virtio_desc_head);
-        } else {
-            virtio_blk_set_req_fail(dev, data->virtio_desc_head);
-        }
+    if (ra->seq_reads < VIRTIO_BLK_READAHEAD_SEQ_THRESHOLD) {
+        return false;
+    }
 
-        /* Free corresponding bookkeeping structures regardless of the request's
-         * success status */
-        if (virtio_req->type == VIRTIO_BLK_T_IN || virtio_req->type == VIRTIO_BLK_T_OUT) {
-            fsmalloc_free(&state->fsmalloc, data->sddf_data, data->sddf_count);
+    /* Read ahead from the end of what has already been read ahead, as long
+     * as less than a window is ready for the driver */
+    uint32_t start = ra->next_block;
+    int free_buf = -1;
+    for (int i = 0; i < VIRTIO_BLK_READAHEAD_BUFFERS; i++) {
+        struct virtio_blk_readahead_buf *buf = &ra->bufs[i];
+        if (!buf->valid) {
+            free_buf = i;
+        } else if (!buf->stale) {
+            start = MAX(start, buf->block + buf->count);
         }
-
-        virtio_blk_used_buffer(dev, data->virtio_desc_head);
-
-        handled = true;
+    }
+    if (free_buf == -1 || start - ra->next_block >= ra->window || start >= state->storage_info->capacity) {
+        return false;
     }
 
-    bool success = true;
-
-    /* We need to know if we handled any responses, if we did we inject an
-     * interrupt, if we didn't we don't inject */
-    if (handled) {
-        virtio_blk_set_interrupt_status(dev, true, false);
-        success = virtio_blk_virq_inject(dev);
+    uint16_t ahead = MIN(ra->window, state->storage_info->capacity - start);
+    if (virtio_blk_writeback_overlaps(state, start, ahead) || !sddf_make_req_check(state, h, ahead)) {
+        return false;
     }
 
-    return success;
+    uintptr_t sddf_data;
+    virtio_blk_data_alloc(h, &sddf_data, ahead);
+
+    uint32_t req_id;
+    ialloc_alloc(&state->ialloc, &req_id);
+    state->reqbk[req_id] = (reqbk_t) {
+        .sddf_data = sddf_data,
+        .sddf_count = ahead,
+        .sddf_block_number = start,
+        .parent_id = free_buf,
+        .cache_epoch = state->cache_epoch,
+        .readahead = true,
+    };
+
+    ra->bufs[free_buf] = (struct virtio_blk_readahead_buf) {
+        .data = sddf_data,
+        .block = start,
+        .count = ahead,
+        .handle = h - state->sddf_handles,
+        .valid = true,
+        .inflight = true,
+    };
+    ra->prefetched += ahead;
+
+    LOG_BLOCK("Reading ahead %d blocks from block %d\n", ahead, start);
+    virtio_blk_sddf_enqueue(state, h, BLK_REQ_READ, sddf_data - h->data_region, start, ahead, req_id, 0);
+
+    return true;
+}
+
+/* sDDF has responded to a read-ahead */
+static void virtio_blk_readahead_resp(struct virtio_blk_device *state, uint32_t req_id, bool success)
+{
+    reqbk_t *data = &state->reqbk[req_id];
+    struct virtio_blk_readahead_buf *buf = &state->readahead.bufs[data->parent_id];
+
+    buf->inflight = false;
+    if (!success || buf->stale) {
+        buf->stale = false;
+        virtio_blk_readahead_drop(state, buf);
+        return;
+    }
+
+    virtio_blk_cache_fill(state, data->cache_epoch, buf->block, buf->count, buf->data);
+}
+
+/* Called when a write to the given blocks is sent to sDDF */
+static void virtio_blk_cache_write(struct virtio_blk_device *state, uint32_t block, uint32_t count)
+{
+    for (int i = 0; i < VIRTIO_BLK_READAHEAD_BUFFERS; i++) {
+        struct virtio_blk_readahead_buf *buf = &state->readahead.bufs[i];
+        if (!buf->valid || block + count <= buf->block || block >= buf->block + buf->count) {
+            continue;
+        }
+        if (buf->inflight) {
+            buf->stale = true;
+        } else {
+            virtio_blk_readahead_drop(state, buf);
+        }
+    }
+
+    if (state->cache == NULL) {
+        return;
+    }
+
+    blk_cache_invalidate(state->cache, block, count);
+    state->cache_epoch++;
+}
+
+/*
+ * Whether a write can be completed to the driver as soon as it is sent to
+ * sDDF. Only writes whose data has already been copied into the data region
+ * can be, and not while a flush is waiting so that pending writes drain and
+ * the flush is not held up indefinitely.
+ */
+static bool virtio_blk_writeback_ack(struct virtio_blk_device *state)
+{
+    return state->config.writeback && state->flush_waiting_head == REQBK_NONE;
+}
+
+/* Complete a write to the driver before sDDF has responded to it */
+static void virtio_blk_writeback_complete(struct virtio_blk_device *state, uint32_t req_id)
+{
+    reqbk_t *data = &state->reqbk[req_id];
+    struct virtq *virtq = &state->virtio_device.vqs[data->vq_idx].virtq;
+
+    virtio_blk_set_req_success(virtq, data->virtio_desc_head);
+    virtio_blk_used_buffer(virtq, data->virtio_desc_head);
+    virtio_blk_stats_complete(state, VIRTIO_BLK_T_OUT, state->req_avail_time, 0, 0);
+
+    data->acked = true;
+    state->wb_pending++;
+}
+
+/* sDDF has responded to a write that was already completed to the driver */
+static void virtio_blk_writeback_resp(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h,
+                                      uint32_t req_id, bool success)
+{
+    reqbk_t *data = &state->reqbk[req_id];
+    /* Writes from before the device was reset are no longer tracked */
+    bool tracked = !data->dropped;
+
+    if (tracked && data->wb_prev != REQBK_NONE) {
+        state->reqbk[data->wb_prev].wb_next = data->wb_next;
+    } else if (tracked) {
+        state->wb_inflight = data->wb_next;
+    }
+    if (tracked && data->wb_next != REQBK_NONE) {
+        state->reqbk[data->wb_next].wb_prev = data->wb_prev;
+    }
+
+    virtio_blk_data_free(h, data->sddf_data, data->sddf_count);
+
+    /* The error is reported by the next flush */
+    if (!success) {
+        LOG_BLOCK_ERR("write that was completed in writeback mode has failed\n");
+        state->wb_error = state->wb_error || tracked;
+    }
+
+    if (tracked) {
+        state->wb_pending--;
+    }
+    if (!data->merged) {
+        return;
+    }
+
+    /* Merged writes have one acknowledged request for each member, the first
+     * ID has already been freed by the caller */
+    uint32_t id = data->merge_next;
+    while (id != REQBK_NONE) {
+        uint32_t next = state->reqbk[id].merge_next;
+        ialloc_free(&state->ialloc, id);
+        if (tracked) {
+            state->wb_pending--;
+        }
+        id = next;
+    }
+}
+
+/*
+ * Send the waiting flushes to sDDF as one flush, once every write that was
+ * acknowledged early has completed and the previous flush has finished.
+ * Flushes always go through the default sDDF queue as they apply to the
+ * whole disk.
+ */
+static void virtio_blk_flush_kick(struct virtio_blk_device *state)
+{
+    if (state->flush_waiting_head == REQBK_NONE || state->flush_inflight != REQBK_NONE || state->wb_pending > 0) {
+        return;
+    }
+
+    struct virtio_blk_sddf_handle *h = &state->sddf_handles[SDDF_BLK_DEFAULT_HANDLE];
+    if (blk_queue_full_req(&h->queue_h)) {
+        return;
+    }
+
+    uint32_t head_id = state->flush_waiting_head;
+    state->flush_inflight = head_id;
+    state->flush_waiting_head = REQBK_NONE;
+    state->flush_waiting_tail = REQBK_NONE;
+
+    /* Any error from an earlier write is reported by this flush */
+    state->reqbk[head_id].failed = state->wb_error;
+    state->wb_error = false;
+
+    uint64_t avail_time = state->stats_enabled ? state->req_times[head_id].avail : 0;
+    virtio_blk_sddf_enqueue(state, h, BLK_REQ_FLUSH, 0, 0, 0, head_id, avail_time);
+    if (!blk_queue_plugged_req(&h->queue_h)) {
+        microkit_notify(h->server_ch);
+    }
+}
+
+/* Complete all the flushes that were sent to sDDF as one */
+static void virtio_blk_flush_resp(struct virtio_blk_device *state, uint32_t head_id, bool success,
+                                  struct virtio_blk_req_times *times, uint64_t complete)
+{
+    struct virtio_device *dev = &state->virtio_device;
+
+    success = success && !state->reqbk[head_id].failed;
+    state->flush_inflight = REQBK_NONE;
+
+    /* The head's ID has already been freed by the caller */
+    uint32_t id = head_id;
+    while (id != REQBK_NONE) {
+        reqbk_t *data = &state->reqbk[id];
+        struct virtq *virtq = &dev->vqs[data->vq_idx].virtq;
+
+        if (success) {
+            virtio_blk_set_req_success(virtq, data->virtio_desc_head);
+        } else {
+            virtio_blk_set_req_fail(virtq, data->virtio_desc_head);
+        }
+        virtio_blk_used_buffer(virtq, data->virtio_desc_head);
+        virtio_blk_stats_complete(state, VIRTIO_BLK_T_FLUSH, times->avail, times->enqueue, complete);
+
+        uint32_t next = data->merge_next;
+        if (id != head_id) {
+            ialloc_free(&state->ialloc, id);
+        }
+        id = next;
+    }
+
+    virtio_blk_flush_kick(state);
+}
+
+/*
+ * Check whether a read/write can go straight to/from the guest's buffer. The
+ * buffer must be within guest RAM that the sDDF virtualiser can see and,
+ * since sDDF transfers whole blocks, both the buffer and the sector range must
+ * be aligned to the transfer size. On success the offset of the buffer that
+ * is given to sDDF is returned in sddf_offset.
+ */
+static bool virtio_blk_zero_copy_offset(struct virtio_blk_sddf_handle *h, uint64_t sector, uintptr_t addr,
+                                        uint32_t len, uintptr_t *sddf_offset)
+{
+    if (h->zero_copy_size == 0) {
+        return false;
+    }
+
+    if ((sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE != 0 || addr % BLK_TRANSFER_SIZE != 0
+        || len % BLK_TRANSFER_SIZE != 0 || len == 0) {
+        return false;
+    }
+
+    if (addr < h->zero_copy_base || addr - h->zero_copy_base > h->zero_copy_size
+        || len > h->zero_copy_size - (addr - h->zero_copy_base)) {
+        return false;
+    }
+
+    *sddf_offset = h->zero_copy_offset + (addr - h->zero_copy_base);
+    return true;
+}
+
+static bool virtio_blk_zero_copy_enqueue(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h,
+                                         uint16_t vq_idx, uint16_t desc_head, blk_req_code_t code,
+                                         uintptr_t sddf_offset, uint32_t sddf_block_number, uint16_t sddf_count)
+{
+    /* No data buffers are needed, only an ID and room in the queue */
+    if (!sddf_make_req_check(state, h, 0)) {
+        return false;
+    }
+
+    uint32_t req_id;
+    ialloc_alloc(&state->ialloc, &req_id);
+    state->reqbk[req_id] = (reqbk_t) {
+        .virtio_desc_head = desc_head,
+        .sddf_count = sddf_count,
+        .sddf_block_number = sddf_block_number,
+        .aligned = true,
+        .vq_idx = vq_idx,
+        .zero_copy = true,
+        .cache_epoch = state->cache_epoch,
+    };
+
+    if (code == BLK_REQ_WRITE) {
+        virtio_blk_cache_write(state, sddf_block_number, sddf_count);
+    }
+
+    virtio_blk_sddf_enqueue(state, h, code, sddf_offset, sddf_block_number, sddf_count, req_id,
+                            state->req_avail_time);
+
+    return true;
+}
+
+/* What happened to a request taken from the available ring */
+typedef enum virtio_blk_req_status {
+    /* The request was sent to sDDF, it is completed once sDDF responds */
+    VIRTIO_BLK_REQ_SUBMITTED,
+    /* The request was completed (successfully or not) without going to sDDF */
+    VIRTIO_BLK_REQ_COMPLETED,
+    /* Something was sent to sDDF and the request has already been completed,
+     * a write in writeback mode or a read that triggered read-ahead */
+    VIRTIO_BLK_REQ_ACKNOWLEDGED,
+    /* Not enough resources to handle the request right now, nothing has been
+     * done with it and it should be retried after sDDF has responded */
+    VIRTIO_BLK_REQ_STALLED,
+} virtio_blk_req_status_t;
+
+/* Complete a request that cannot be handled with an error */
+static virtio_blk_req_status_t virtio_blk_req_fail(struct virtq *virtq, uint16_t desc_head)
+{
+    virtio_blk_set_req_fail(virtq, desc_head);
+    virtio_blk_used_buffer(virtq, desc_head);
+    return VIRTIO_BLK_REQ_COMPLETED;
+}
+
+static virtio_blk_req_status_t virtio_blk_handle_req(struct virtio_blk_device *state, uint16_t vq_idx,
+                                                     uint16_t desc_head)
+{
+    struct virtq *virtq = &state->virtio_device.vqs[vq_idx].virtq;
+    struct virtio_blk_sddf_handle *h = sddf_handle(state, vq_idx);
+
+    uint16_t curr_desc_head = desc_head;
+
+    /* Print out what the request type is */
+    struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[curr_desc_head].addr;
+    LOG_BLOCK("----- Request type is 0x%x -----\n", virtio_req->type);
+
+    /* Parse different requests */
+    switch (virtio_req->type) {
+    /* There are three parts with each block request. The header, body (which contains the data) and reply. */
+    case VIRTIO_BLK_T_IN: {
+        LOG_BLOCK("Request type is VIRTIO_BLK_T_IN\n");
+        LOG_BLOCK("Sector (read/write offset) is %d\n", virtio_req->sector);
+
+        curr_desc_head = virtq->desc[curr_desc_head].next;
+        LOG_BLOCK("Descriptor index is %d, Descriptor flags are: 0x%x, length is 0x%x\n", curr_desc_head,
+                  (uint16_t)virtq->desc[curr_desc_head].flags, virtq->desc[curr_desc_head].len);
+
+        /* Data can only be encrypted in whole sectors */
+        if (state->xts != NULL && virtq->desc[curr_desc_head].len % VIRTIO_BLK_SECTOR_SIZE != 0) {
+            LOG_BLOCK_ERR("Request of 0x%x bytes is not a whole number of sectors\n", virtq->desc[curr_desc_head].len);
+            return virtio_blk_req_fail(virtq, desc_head);
+        }
+
+        /* Converting virtio sector number to sddf block number, we are rounding down */
+        uint32_t sddf_block_number = (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
+        /* Converting bytes to the number of blocks, we are rounding up */
+        uint16_t sddf_count = (virtq->desc[curr_desc_head].len + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
+
+        if (virtio_blk_cache_read(state, virtio_req->sector, virtq->desc[curr_desc_head].addr,
+                                  virtq->desc[curr_desc_head].len)
+            || virtio_blk_readahead_read(state, virtio_req->sector, virtq->desc[curr_desc_head].addr,
+                                         virtq->desc[curr_desc_head].len)) {
+            virtio_blk_set_req_success(virtq, desc_head);
+            virtio_blk_used_buffer(virtq, desc_head);
+            virtio_blk_stats_complete(state, VIRTIO_BLK_T_IN, state->req_avail_time, 0, 0);
+            if (virtio_blk_readahead_update(state, h, sddf_block_number, sddf_count)) {
+                return VIRTIO_BLK_REQ_ACKNOWLEDGED;
+            }
+            return VIRTIO_BLK_REQ_COMPLETED;
+        }
+
+        if (virtio_blk_writeback_overlaps(state, sddf_block_number, sddf_count)) {
+            return VIRTIO_BLK_REQ_STALLED;
+        }
+
+        uintptr_t zero_copy_offset;
+        if (virtio_blk_zero_copy_offset(h, virtio_req->sector, virtq->desc[curr_desc_head].addr,
+                                        virtq->desc[curr_desc_head].len, &zero_copy_offset)) {
+            if (!virtio_blk_zero_copy_enqueue(state, h, vq_idx, desc_head, BLK_REQ_READ, zero_copy_offset,
+                                              sddf_block_number, sddf_count)) {
+                return VIRTIO_BLK_REQ_STALLED;
+            }
+            virtio_blk_readahead_update(state, h, sddf_block_number, sddf_count);
+            return VIRTIO_BLK_REQ_SUBMITTED;
+        }
+
+        if (sddf_count > h->max_buffers) {
+            LOG_BLOCK_ERR("Request of %d blocks can never fit in the data region\n", sddf_count);
+            return virtio_blk_req_fail(virtq, desc_head);
+        }
+
+        if (!sddf_make_req_check(state, h, sddf_count)) {
+            return VIRTIO_BLK_REQ_STALLED;
+        }
+
+        /* Allocate data buffer from data region based on sddf_count */
+        uintptr_t sddf_data;
+        virtio_blk_data_alloc(h, &sddf_data, sddf_count);
+
+        /* Bookkeep the virtio sddf block size translation */
+        uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
+        uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
+
+        /* Book keep the request */
+        uint32_t req_id;
+        ialloc_alloc(&state->ialloc, &req_id);
+        state->reqbk[req_id] = (reqbk_t) {
+            .virtio_desc_head = desc_head,
+            .sddf_data = sddf_data,
+            .sddf_count = sddf_count,
+            .sddf_block_number = sddf_block_number,
+            .virtio_data = virtio_data,
+            .virtio_data_size = virtio_data_size,
+            .vq_idx = vq_idx,
+            .cache_epoch = state->cache_epoch,
+        };
+
+        uintptr_t offset = sddf_data - h->data_region;
+        virtio_blk_sddf_enqueue(state, h, BLK_REQ_READ, offset, sddf_block_number, sddf_count, req_id,
+                                state->req_avail_time);
+        virtio_blk_readahead_update(state, h, sddf_block_number, sddf_count);
+        return VIRTIO_BLK_REQ_SUBMITTED;
+    }
+    case VIRTIO_BLK_T_OUT: {
+        LOG_BLOCK("Request type is VIRTIO_BLK_T_OUT\n");
+        LOG_BLOCK("Sector (read/write offset) is %d\n", virtio_req->sector);
+
+        curr_desc_head = virtq->desc[curr_desc_head].next;
+        LOG_BLOCK("Descriptor index is %d, Descriptor flags are: 0x%x, length is 0x%x\n", curr_desc_head,
+                  (uint16_t)virtq->desc[curr_desc_head].flags, virtq->desc[curr_desc_head].len);
+
+        /* Data can only be encrypted in whole sectors */
+        if (state->xts != NULL && virtq->desc[curr_desc_head].len % VIRTIO_BLK_SECTOR_SIZE != 0) {
+            LOG_BLOCK_ERR("Request of 0x%x bytes is not a whole number of sectors\n", virtq->desc[curr_desc_head].len);
+            return virtio_blk_req_fail(virtq, desc_head);
+        }
+
+        /* Converting virtio sector number to sddf block number, we are rounding down */
+        uint32_t sddf_block_number = (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
+        /* Converting bytes to the number of blocks, we are rounding up */
+        uint16_t sddf_count = (virtq->desc[curr_desc_head].len + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
+
+        bool aligned = ((virtio_req->sector % (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE)) == 0);
+
+        if (virtio_blk_writeback_overlaps(state, sddf_block_number, sddf_count)) {
+            return VIRTIO_BLK_REQ_STALLED;
+        }
+
+        uintptr_t zero_copy_offset;
+        if (virtio_blk_zero_copy_offset(h, virtio_req->sector, virtq->desc[curr_desc_head].addr,
+                                        virtq->desc[curr_desc_head].len, &zero_copy_offset)) {
+            if (!virtio_blk_zero_copy_enqueue(state, h, vq_idx, desc_head, BLK_REQ_WRITE, zero_copy_offset,
+                                              sddf_block_number, sddf_count)) {
+                return VIRTIO_BLK_REQ_STALLED;
+            }
+            return VIRTIO_BLK_REQ_SUBMITTED;
+        }
+
+        if (sddf_count > h->max_buffers) {
+            LOG_BLOCK_ERR("Request of %d blocks can never fit in the data region\n", sddf_count);
+            return virtio_blk_req_fail(virtq, desc_head);
+        }
+
+        if (!sddf_make_req_check(state, h, sddf_count)) {
+            return VIRTIO_BLK_REQ_STALLED;
+        }
+
+        virtio_blk_cache_write(state, sddf_block_number,
+                               virtio_blk_span_blocks(virtio_req->sector, virtq->desc[curr_desc_head].len));
+
+        /* Allocate data buffer from data region based on sddf_count */
+        uintptr_t sddf_data;
+        virtio_blk_data_alloc(h, &sddf_data, sddf_count);
+
+        /* Bookkeep the virtio sddf block size translation */
+        uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
+        uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
+
+        /* Book keep the request */
+        uint32_t req_id;
+        ialloc_alloc(&state->ialloc, &req_id);
+        state->reqbk[req_id] = (reqbk_t) {
+            .virtio_desc_head = desc_head,
+            .sddf_data = sddf_data,
+            .sddf_count = sddf_count,
+            .sddf_block_number = sddf_block_number,
+            .virtio_data = virtio_data,
+            .virtio_data_size = virtio_data_size,
+            .aligned = aligned,
+            .vq_idx = vq_idx,
+        };
+
+        uintptr_t offset = sddf_data - h->data_region;
+
+        /* If the write request is not aligned to the sddf transfer size, we need to do a read-modify-write:
+        we need to first read the surrounding aligned memory, overwrite that read memory on the unaligned areas
+        we want write to, and then write the entire memory back to disk. */
+        if (!aligned) {
+            virtio_blk_sddf_enqueue(state, h, BLK_REQ_READ, offset, sddf_block_number, sddf_count, req_id,
+                                    state->req_avail_time);
+        } else {
+            /* Copy data from virtio buffer to data buffer, create sddf write request and initialise it with data buffer */
+            virtio_blk_copy_to_sddf(state, sddf_data, virtq->desc[curr_desc_head].addr, virtq->desc[curr_desc_head].len,
+                                    virtio_req->sector);
+
+            virtio_blk_sddf_enqueue(state, h, BLK_REQ_WRITE, offset, sddf_block_number, sddf_count, req_id,
+                                    state->req_avail_time);
+
+            if (virtio_blk_writeback_ack(state)) {
+                virtio_blk_writeback_complete(state, req_id);
+                virtio_blk_writeback_track(state, req_id);
+                return VIRTIO_BLK_REQ_ACKNOWLEDGED;
+            }
+        }
+        return VIRTIO_BLK_REQ_SUBMITTED;
+    }
+    case VIRTIO_BLK_T_FLUSH: {
+        LOG_BLOCK("Request type is VIRTIO_BLK_T_FLUSH\n");
+
+        if (!sddf_make_req_check(state, h, 0)) {
+            return VIRTIO_BLK_REQ_STALLED;
+        }
+
+        /* Book keep the request */
+        uint32_t req_id;
+        ialloc_alloc(&state->ialloc, &req_id);
+        /* except for virtio desc and virtqueue, nothing else needs to be
+         * retrieved later so leave as 0 */
+        state->reqbk[req_id] = (reqbk_t) {
+            .virtio_desc_head = desc_head,
+            .vq_idx = vq_idx,
+            .merge_next = REQBK_NONE,
+        };
+        if (state->stats_enabled) {
+            state->req_times[req_id].avail = state->req_avail_time;
+        }
+
+        /* Flushes wait until all writes completed before them have completed in
+         * sDDF, flushes that wait together are sent to sDDF as one */
+        if (state->flush_waiting_head == REQBK_NONE) {
+            state->flush_waiting_head = req_id;
+        } else {
+            state->reqbk[state->flush_waiting_tail].merge_next = req_id;
+        }
+        state->flush_waiting_tail = req_id;
+
+        virtio_blk_flush_kick(state);
+        return VIRTIO_BLK_REQ_SUBMITTED;
+    }
+    case VIRTIO_BLK_T_DISCARD: {
+        LOG_BLOCK("Request type is VIRTIO_BLK_T_DISCARD\n");
+
+        /* sDDF has no request for discarding blocks. Discarding is only a
+         * hint and we never advertise write_zeroes_may_unmap, so we are
+         * free to complete the request without touching the backend. */
+        virtio_blk_set_req_success(virtq, desc_head);
+        virtio_blk_used_buffer(virtq, desc_head);
+        return VIRTIO_BLK_REQ_COMPLETED;
+    }
+    case VIRTIO_BLK_T_WRITE_ZEROES: {
+        LOG_BLOCK("Request type is VIRTIO_BLK_T_WRITE_ZEROES\n");
+
+        curr_desc_head = virtq->desc[curr_desc_head].next;
+        struct virtio_blk_discard_write_zeroes *range = (void *)virtq->desc[curr_desc_head].addr;
+        uint32_t num_ranges = virtq->desc[curr_desc_head].len / sizeof(struct virtio_blk_discard_write_zeroes);
+
+        /* We advertise a max_write_zeroes_seg of one, and the range must be
+         * aligned to the sDDF transfer size as we have no data to do a
+         * read-modify-write with. */
+        uint64_t sectors_per_block = BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE;
+        if (!virtio_blk_write_zeroes_supported(state) || num_ranges != 1
+            || range->sector % sectors_per_block != 0 || range->num_sectors % sectors_per_block != 0
+            || range->num_sectors > state->config.max_write_zeroes_sectors
+            || range->sector + range->num_sectors > state->config.capacity) {
+            LOG_BLOCK_ERR("Invalid write zeroes request, %d ranges, sector 0x%lx, number of sectors 0x%x\n",
+                          num_ranges, range->sector, range->num_sectors);
+            return virtio_blk_req_fail(virtq, desc_head);
+        }
+
+        if (range->num_sectors == 0) {
+            virtio_blk_set_req_success(virtq, desc_head);
+            virtio_blk_used_buffer(virtq, desc_head);
+            return VIRTIO_BLK_REQ_COMPLETED;
+        }
+
+        if (virtio_blk_writeback_overlaps(state, range->sector / sectors_per_block,
+                                          range->num_sectors / sectors_per_block)
+            || !sddf_make_req_check(state, h, 0)) {
+            return VIRTIO_BLK_REQ_STALLED;
+        }
+
+        /* Book keep the parent of the request, the actual sDDF requests are
+         * writes of the zero buffers which are made by write_zeroes_enqueue */
+        uint32_t parent_id;
+        ialloc_alloc(&state->ialloc, &parent_id);
+        state->reqbk[parent_id] = (reqbk_t) {
+            .virtio_desc_head = desc_head,
+            .sddf_block_number = range->sector / sectors_per_block,
+            .vq_idx = vq_idx,
+            .remaining = range->num_sectors / sectors_per_block,
+        };
+
+        if (!virtio_blk_write_zeroes_enqueue(state, h, parent_id)) {
+            /* There was no ID left for the first write */
+            ialloc_free(&state->ialloc, parent_id);
+            return VIRTIO_BLK_REQ_STALLED;
+        }
+        virtio_blk_cache_write(state, range->sector / sectors_per_block, range->num_sectors / sectors_per_block);
+        return VIRTIO_BLK_REQ_SUBMITTED;
+    }
+    default: {
+        LOG_BLOCK_ERR(
+            "Handling VirtIO block request, but virtIO request type is not recognised: %d\n",
+            virtio_req->type);
+        return virtio_blk_req_fail(virtq, desc_head);
+    }
+    }
+}
+
+/* A read or write that is a candidate for being merged with its neighbours */
+struct virtio_blk_rw {
+    uint32_t type;
+    uintptr_t addr;
+    uint32_t len;
+    uint32_t block_number;
+    uint16_t count;
+    bool zero_copy;
+    uintptr_t zero_copy_offset;
+};
+
+/*
+ * Decode the request at desc_head if it is a read or write that covers whole
+ * sDDF blocks, only those can be merged as each one then maps to a distinct
+ * range of blocks in the merged transfer.
+ */
+static bool virtio_blk_rw_mergeable(struct virtio_blk_sddf_handle *h, struct virtq *virtq, uint16_t desc_head,
+                                    struct virtio_blk_rw *rw)
+{
+    struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[desc_head].addr;
+    if (virtio_req->type != VIRTIO_BLK_T_IN && virtio_req->type != VIRTIO_BLK_T_OUT) {
+        return false;
+    }
+    if ((virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE != 0) {
+        return false;
+    }
+
+    uint16_t data_desc = virtq->desc[desc_head].next;
+    rw->type = virtio_req->type;
+    rw->addr = virtq->desc[data_desc].addr;
+    rw->len = virtq->desc[data_desc].len;
+    if (rw->len == 0 || rw->len % BLK_TRANSFER_SIZE != 0) {
+        return false;
+    }
+
+    rw->block_number = (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
+    rw->count = rw->len / BLK_TRANSFER_SIZE;
+    rw->zero_copy = virtio_blk_zero_copy_offset(h, virtio_req->sector, rw->addr, rw->len, &rw->zero_copy_offset);
+
+    return true;
+}
+
+/*
+ * Try to merge the request at avail ring index idx with the requests following
+ * it into a single sDDF transfer. Requests are merged while they have the same
+ * direction, are contiguous on disk (and in the sDDF address space when they
+ * are zero-copy) and the transfer stays within max_merge_blocks. Each request
+ * keeps its own bookkeeping entry, chained from the first one whose ID is
+ * given to sDDF, so the response can be fanned out to every descriptor.
+ *
+ * Returns the number of requests consumed from the available ring, or 0 if
+ * there was nothing to merge and the request should be handled on its own.
+ */
+static uint16_t virtio_blk_handle_merge(struct virtio_blk_device *state, uint16_t vq_idx, uint16_t idx,
+                                        virtio_blk_req_status_t *status)
+{
+    struct virtq *virtq = &state->virtio_device.vqs[vq_idx].virtq;
+    struct virtio_blk_sddf_handle *h = sddf_handle(state, vq_idx);
+
+    if (state->max_merge_blocks <= 1) {
+        return 0;
+    }
+
+    struct virtio_blk_rw first;
+    if (!virtio_blk_rw_mergeable(h, virtq, virtq->avail->ring[idx % virtq->num], &first)) {
+        return 0;
+    }
+    /* Reads that may be served from the cache or read-ahead are left to be
+     * handled alone */
+    if (first.type == VIRTIO_BLK_T_IN
+        && ((state->cache != NULL && blk_cache_contains(state->cache, first.block_number))
+            || virtio_blk_readahead_contains(state, first.block_number))) {
+        return 0;
+    }
+
+    /* A bounced transfer has to fit in the data region or it would never be
+     * able to make progress */
+    uint32_t max_blocks = state->max_merge_blocks;
+    if (!first.zero_copy) {
+        max_blocks = MIN(max_blocks, h->max_buffers);
+    }
+
+    /* Find how many of the following requests can be merged, without
+     * consuming anything yet */
+    uint16_t num_reqs = 1;
+    uint32_t total_count = first.count;
+    for (uint16_t i = idx + 1; i != virtq->avail->idx; i++) {
+        struct virtio_blk_rw next;
+        if (!virtio_blk_rw_mergeable(h, virtq, virtq->avail->ring[i % virtq->num], &next)) {
+            break;
+        }
+        if (next.type != first.type || next.zero_copy != first.zero_copy
+            || next.block_number != first.block_number + total_count || total_count + next.count > max_blocks) {
+            break;
+        }
+        if (first.zero_copy && next.zero_copy_offset != first.zero_copy_offset + total_count * BLK_TRANSFER_SIZE) {
+            break;
+        }
+        if (next.type == VIRTIO_BLK_T_IN && state->cache != NULL && blk_cache_contains(state->cache, next.block_number)) {
+            break;
+        }
+        if (next.type == VIRTIO_BLK_T_IN && virtio_blk_readahead_contains(state, next.block_number)) {
+            break;
+        }
+        num_reqs++;
+        total_count += next.count;
+    }
+
+    if (num_reqs == 1) {
+        return 0;
+    }
+
+    if (virtio_blk_writeback_overlaps(state, first.block_number, total_count)
+        || !sddf_make_req_check(state, h, first.zero_copy ? 0 : total_count)) {
+        *status = VIRTIO_BLK_REQ_STALLED;
+        return 0;
+    }
+
+    uintptr_t sddf_data = 0;
+    if (!first.zero_copy) {
+        virtio_blk_data_alloc(h, &sddf_data, total_count);
+    }
+
+    /* Bookkeep each request, if we run out of IDs part way through the merged
+     * transfer is cut short and the rest are left in the available ring */
+    uint32_t head_id = 0;
+    uint32_t prev_id = 0;
+    uint16_t merged = 0;
+    uint32_t merged_count = 0;
+    for (uint16_t i = idx; merged < num_reqs && !ialloc_full(&state->ialloc); i++, merged++) {
+        uint16_t desc_head = virtq->avail->ring[i % virtq->num];
+        struct virtio_blk_rw rw;
+        virtio_blk_rw_mergeable(h, virtq, desc_head, &rw);
+
+        uint32_t req_id;
+        ialloc_alloc(&state->ialloc, &req_id);
+        state->reqbk[req_id] = (reqbk_t) {
+            .virtio_desc_head = desc_head,
+            .sddf_count = rw.count,
+            .sddf_block_number = rw.block_number,
+            .virtio_data = first.zero_copy ? 0 : sddf_data + merged_count * BLK_TRANSFER_SIZE,
+            .virtio_data_size = rw.len,
+            .aligned = true,
+            .vq_idx = vq_idx,
+            .zero_copy = first.zero_copy,
+            .merge_next = REQBK_NONE,
+            .cache_epoch = state->cache_epoch,
+        };
+
+        if (rw.type == VIRTIO_BLK_T_OUT && !first.zero_copy) {
+            virtio_blk_copy_to_sddf(state, state->reqbk[req_id].virtio_data, rw.addr, rw.len,
+                                    (uint64_t)rw.block_number * (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE));
+        }
+
+        if (merged == 0) {
+            head_id = req_id;
+        } else {
+            state->reqbk[prev_id].merge_next = req_id;
+        }
+        prev_id = req_id;
+        merged_count += rw.count;
+    }
+
+    if (!first.zero_copy && merged_count != total_count) {
+        virtio_blk_data_free(h, sddf_data + merged_count * BLK_TRANSFER_SIZE, total_count - merged_count);
+    }
+
+    /* The first request describes the whole transfer */
+    reqbk_t *head = &state->reqbk[head_id];
+    head->merged = true;
+    head->sddf_data = sddf_data;
+    head->sddf_count = merged_count;
+
+    LOG_BLOCK("Merged %d requests into a transfer of %d blocks from block %d\n", merged, merged_count,
+              first.block_number);
+
+    if (first.type == VIRTIO_BLK_T_OUT) {
+        virtio_blk_cache_write(state, first.block_number, merged_count);
+    }
+
+    uintptr_t offset = first.zero_copy ? first.zero_copy_offset : sddf_data - h->data_region;
+    blk_req_code_t code = (first.type == VIRTIO_BLK_T_IN) ? BLK_REQ_READ : BLK_REQ_WRITE;
+    virtio_blk_sddf_enqueue(state, h, code, offset, first.block_number, merged_count, head_id,
+                            state->req_avail_time);
+    if (first.type == VIRTIO_BLK_T_IN) {
+        virtio_blk_readahead_update(state, h, first.block_number, merged_count);
+    }
+
+    *status = VIRTIO_BLK_REQ_SUBMITTED;
+    if (first.type == VIRTIO_BLK_T_OUT && !first.zero_copy && virtio_blk_writeback_ack(state)) {
+        for (uint32_t id = head_id; id != REQBK_NONE; id = state->reqbk[id].merge_next) {
+            virtio_blk_writeback_complete(state, id);
+        }
+        virtio_blk_writeback_track(state, head_id);
+        *status = VIRTIO_BLK_REQ_ACKNOWLEDGED;
+    }
+    return merged;
+}
+
+/* Complete every request that was part of a merged transfer */
+static void virtio_blk_merged_resp(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h,
+                                   uint32_t head_id, bool success, struct virtio_blk_req_times *times,
+                                   uint64_t complete)
+{
+    struct virtio_device *dev = &state->virtio_device;
+    reqbk_t *head = &state->reqbk[head_id];
+
+    if (!head->zero_copy) {
+        virtio_blk_data_free(h, head->sddf_data, head->sddf_count);
+    }
+
+    /* The head's ID has already been freed by the caller */
+    uint32_t id = head_id;
+    while (id != REQBK_NONE) {
+        reqbk_t *data = &state->reqbk[id];
+        struct virtq *virtq = &dev->vqs[data->vq_idx].virtq;
+        struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[data->virtio_desc_head].addr;
+        uint16_t curr_virtio_desc = virtq->desc[data->virtio_desc_head].next;
+
+        if (success) {
+            if (virtio_req->type == VIRTIO_BLK_T_IN) {
+                if (!data->zero_copy) {
+                    virtio_blk_copy_from_sddf(state, virtq->desc[curr_virtio_desc].addr, data->virtio_data,
+                                              data->virtio_data_size,
+                                              (uint64_t)data->sddf_block_number
+                                                  * (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE));
+                }
+                virtio_blk_cache_fill(state, data->cache_epoch, data->sddf_block_number,
+                                      data->virtio_data_size / BLK_TRANSFER_SIZE,
+                                      data->zero_copy ? virtq->desc[curr_virtio_desc].addr : data->virtio_data);
+            }
+            virtio_blk_set_req_success(virtq, data->virtio_desc_head);
+        } else {
+            virtio_blk_set_req_fail(virtq, data->virtio_desc_head);
+        }
+        virtio_blk_used_buffer(virtq, data->virtio_desc_head);
+        virtio_blk_stats_complete(state, virtio_req->type, times->avail, times->enqueue, complete);
+
+        uint32_t next = data->merge_next;
+        if (id != head_id) {
+            ialloc_free(&state->ialloc, id);
+        }
+        id = next;
+    }
+}
+
+/*
+ * Handle the available requests of a virtqueue until there are none left or
+ * we run out of resources. In the latter case, we stop consuming the available
+ * ring and leave the virtqueue stalled, it is resumed from last_idx once
+ * responses from sDDF have freed up resources. Returns true if any request was
+ * completed without going to sDDF, in which case the guest must be notified.
+ */
+static enum virtio_blk_prio_class virtio_blk_prio_class(uint32_t ioprio)
+{
+    switch (ioprio >> VIRTIO_BLK_IOPRIO_CLASS_SHIFT) {
+    case VIRTIO_BLK_IOPRIO_CLASS_RT:
+        return VIRTIO_BLK_PRIO_RT;
+    case VIRTIO_BLK_IOPRIO_CLASS_IDLE:
+        return VIRTIO_BLK_PRIO_IDLE;
+    default:
+        /* Requests without a class are best-effort */
+        return VIRTIO_BLK_PRIO_BE;
+    }
+}
+
+/* Take a request that cannot be sent to sDDF yet off the available ring */
+static void virtio_blk_prio_hold(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h,
+                                 uint16_t vq_idx, uint16_t desc_head)
+{
+    struct virtq *virtq = &state->virtio_device.vqs[vq_idx].virtq;
+    struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[desc_head].addr;
+    enum virtio_blk_prio_class class = virtio_blk_prio_class(virtio_req->ioprio);
+
+    /* There is an entry for every descriptor the virtqueues can have */
+    uint16_t i = state->held_free;
+    assert(i != VIRTIO_BLK_HELD_NONE);
+    state->held_free = state->held[i].next;
+
+    state->held[i] = (struct virtio_blk_held) {
+        .avail_time = state->req_avail_time,
+        .seq = h->held_dispatched,
+        .desc_head = desc_head,
+        .vq_idx = vq_idx,
+        .next = VIRTIO_BLK_HELD_NONE,
+    };
+
+    if (h->held_head[class] == VIRTIO_BLK_HELD_NONE) {
+        h->held_head[class] = i;
+    } else {
+        state->held[h->held_tail[class]].next = i;
+    }
+    h->held_tail[class] = i;
+    h->num_held++;
+}
+
+/* Pick the class to dispatch from next: the one with the request that has
+ * waited longest past the deadline, otherwise the highest priority one */
+static enum virtio_blk_prio_class virtio_blk_prio_next(struct virtio_blk_device *state,
+                                                       struct virtio_blk_sddf_handle *h)
+{
+    int next = -1;
+    uint32_t next_wait = 0;
+    for (int class = 0; class < VIRTIO_BLK_PRIO_NUM_CLASSES; class++) {
+        uint16_t i = h->held_head[class];
+        if (i == VIRTIO_BLK_HELD_NONE) {
+            continue;
+        }
+        uint32_t wait = h->held_dispatched - state->held[i].seq;
+        bool starved = state->prio_max_wait != 0 && wait >= state->prio_max_wait;
+        if (next == -1 || (starved && wait > next_wait)) {
+            next = class;
+            next_wait = wait;
+        }
+    }
+
+    assert(next != -1);
+    return next;
+}
+
+/* Send held requests to sDDF until it is saturated again, returns true if any
+ * of them were completed without going to sDDF */
+static bool virtio_blk_prio_dispatch(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h)
+{
+    bool has_completed = false;
+    bool has_submitted = false;
+
+    while (h->num_held > 0) {
+        enum virtio_blk_prio_class class = virtio_blk_prio_next(state, h);
+        uint16_t i = h->held_head[class];
+        struct virtio_blk_held *held = &state->held[i];
+
+        state->req_avail_time = held->avail_time;
+        virtio_blk_req_status_t status = virtio_blk_handle_req(state, held->vq_idx, held->desc_head);
+        if (status == VIRTIO_BLK_REQ_STALLED) {
+            break;
+        }
+
+        h->held_head[class] = held->next;
+        if (held->next == VIRTIO_BLK_HELD_NONE) {
+            h->held_tail[class] = VIRTIO_BLK_HELD_NONE;
+        }
+        held->next = state->held_free;
+        state->held_free = i;
+        h->num_held--;
+        h->held_dispatched++;
+
+        has_completed |= (status == VIRTIO_BLK_REQ_COMPLETED || status == VIRTIO_BLK_REQ_ACKNOWLEDGED);
+        has_submitted |= (status == VIRTIO_BLK_REQ_SUBMITTED || status == VIRTIO_BLK_REQ_ACKNOWLEDGED);
+    }
+
+    if (has_submitted && !blk_queue_plugged_req(&h->queue_h)) {
+        microkit_notify(h->server_ch);
+    }
+
+    return has_completed;
+}
+
+/* Bytes a request counts for towards the rate limit */
+static uint64_t virtio_blk_rate_bytes(struct virtq *virtq, uint16_t desc_head)
+{
+    struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[desc_head].addr;
+    if (virtio_req->type != VIRTIO_BLK_T_IN && virtio_req->type != VIRTIO_BLK_T_OUT) {
+        return 0;
+    }
+
+    return virtq->desc[virtq->desc[desc_head].next].len;
+}
+
+/* Tokens for cost units, capped at VIRTIO_BLK_RATE_MAX_TOKENS */
+static int64_t virtio_blk_rate_tokens(uint64_t cost, uint64_t freq)
+{
+    if (cost > VIRTIO_BLK_RATE_MAX_TOKENS / freq) {
+        return VIRTIO_BLK_RATE_MAX_TOKENS;
+    }
+    return cost * freq;
+}
+
+static void virtio_blk_bucket_init(struct virtio_blk_token_bucket *b, uint64_t rate, uint64_t burst, uint64_t freq)
+{
+    /* A rate this high fills any bucket in one tick */
+    b->rate = MIN(rate, VIRTIO_BLK_RATE_MAX_TOKENS);
+    b->max_tokens = virtio_blk_rate_tokens(burst != 0 ? burst : rate, freq);
+    b->tokens = b->max_tokens;
+}
+
+/* Take the tokens for a request, which a full bucket always has enough of. The
+ * debt is limited to the bucket size. */
+static void virtio_blk_bucket_charge(struct virtio_blk_token_bucket *b, uint64_t cost, uint64_t freq)
+{
+    if (b->rate == 0) {
+        return;
+    }
+
+    int64_t take = MIN(virtio_blk_rate_tokens(cost, freq), b->max_tokens);
+    b->tokens = MAX(b->tokens - take, -b->max_tokens);
+}
+
+static void virtio_blk_bucket_refill(struct virtio_blk_token_bucket *b, uint64_t elapsed)
+{
+    if (b->rate == 0) {
+        return;
+    }
+
+    /* Checked before multiplying so that a long idle period cannot overflow */
+    if (elapsed >= (b->max_tokens - b->tokens) / b->rate) {
+        b->tokens = b->max_tokens;
+    } else {
+        b->tokens += elapsed * b->rate;
+    }
+}
+
+/* Counter ticks until the bucket has enough tokens for the cost, 0 if it has
+ * them now. A full bucket always has enough so that a request bigger than the
+ * burst is not stalled forever. */
+static uint64_t virtio_blk_bucket_wait(struct virtio_blk_token_bucket *b, uint64_t cost, uint64_t freq)
+{
+    if (b->rate == 0) {
+        return 0;
+    }
+
+    int64_t need = MIN(virtio_blk_rate_tokens(cost, freq), b->max_tokens);
+    if (b->tokens >= need) {
+        return 0;
+    }
+
+    /* Both are within VIRTIO_BLK_RATE_MAX_TOKENS of 0, so this cannot overflow */
+    return ((uint64_t)(need - b->tokens) + b->rate - 1) / b->rate;
+}
+
+/* Nanoseconds, rounded up, in a number of counter ticks. Split into whole
+ * seconds so that long waits do not overflow. */
+static uint64_t virtio_blk_ticks_to_ns(uint64_t ticks, uint64_t freq)
+{
+    uint64_t secs = MIN(ticks / freq, UINT64_MAX / NS_IN_S - 1);
+    return secs * NS_IN_S + ((ticks % freq) * NS_IN_S + freq - 1) / freq;
+}
+
+/*
+ * Check whether a request of the given size is within the rate limit. If it
+ * is not, the timeout for when it will be is set.
+ */
+static bool virtio_blk_rate_allow(struct virtio_blk_device *state, uint64_t bytes)
+{
+    if (!state->rate_enabled) {
+        return true;
+    }
+
+    uint64_t freq = arch_counter_freq();
+    uint64_t now = arch_counter_read();
+    virtio_blk_bucket_refill(&state->iops_bucket, now - state->rate_last_refill);
+    virtio_blk_bucket_refill(&state->bps_bucket, now - state->rate_last_refill);
+    state->rate_last_refill = now;
+
+    uint64_t wait = MAX(virtio_blk_bucket_wait(&state->iops_bucket, 1, freq),
+                        virtio_blk_bucket_wait(&state->bps_bucket, bytes, freq));
+    if (wait == 0) {
+        return true;
+    }
+
+    state->rate_throttled++;
+    if (!state->rate_timer_armed) {
+        /* The sDDF timer takes nanoseconds */
+        sddf_timer_set_timeout(state->rate_timer_ch, virtio_blk_ticks_to_ns(wait, freq));
+        state->rate_timer_armed = true;
+    }
+
+    return false;
+}
+
+/* Take the tokens for requests that have been taken off the available ring.
+ * The buckets can go into debt when requests are merged after only the first
+ * one was checked. */
+static void virtio_blk_rate_charge(struct virtio_blk_device *state, struct virtq *virtq, uint16_t idx,
+                                   uint16_t num_reqs)
+{
+    if (!state->rate_enabled) {
+        return;
+    }
+
+    uint64_t freq = arch_counter_freq();
+    for (uint16_t i = 0; i < num_reqs; i++) {
+        uint16_t desc_head = virtq->avail->ring[(uint16_t)(idx + i) % virtq->num];
+        virtio_blk_bucket_charge(&state->iops_bucket, 1, freq);
+        virtio_blk_bucket_charge(&state->bps_bucket, virtio_blk_rate_bytes(virtq, desc_head), freq);
+    }
+}
+
+static bool virtio_blk_handle_virtq(struct virtio_blk_device *state, uint16_t vq_idx)
+{
+    virtio_queue_handler_t *vq = &state->virtio_device.vqs[vq_idx];
+    struct virtq *virtq = &vq->virtq;
+    struct virtio_blk_sddf_handle *h = sddf_handle(state, vq_idx);
+
+    bool has_completed = false;
+    bool has_submitted = false;
+
+    state->stalled[vq_idx] = false;
+
+    /* get next available request to be handled */
+    uint16_t idx = vq->last_idx;
+    for (; idx != virtq->avail->idx; idx++) {
+        uint16_t desc_head = virtq->avail->ring[idx % virtq->num];
+
+        /* Requests over the rate limit are left in the available ring */
+        if (!virtio_blk_rate_allow(state, virtio_blk_rate_bytes(virtq, desc_head))) {
+            LOG_BLOCK("Virtqueue %d stalled by the rate limit\n", vq_idx);
+            state->stalled[vq_idx] = true;
+            break;
+        }
+
+        state->req_avail_time = virtio_blk_stats_now(state);
+
+        /* New requests must not overtake held ones of the same class */
+        if (h->num_held > 0) {
+            virtio_blk_prio_hold(state, h, vq_idx, desc_head);
+            virtio_blk_rate_charge(state, virtq, idx, 1);
+            continue;
+        }
+
+        virtio_blk_req_status_t status = VIRTIO_BLK_REQ_SUBMITTED;
+        uint16_t consumed = virtio_blk_handle_merge(state, vq_idx, idx, &status);
+        if (consumed == 0 && status != VIRTIO_BLK_REQ_STALLED) {
+            status = virtio_blk_handle_req(state, vq_idx, desc_head);
+            consumed = 1;
+        }
+        if (status == VIRTIO_BLK_REQ_STALLED && state->prio_enabled) {
+            LOG_BLOCK("Holding requests from virtqueue %d until sDDF has room\n", vq_idx);
+            virtio_blk_prio_hold(state, h, vq_idx, desc_head);
+            virtio_blk_rate_charge(state, virtq, idx, 1);
+            continue;
+        }
+        if (status == VIRTIO_BLK_REQ_STALLED) {
+            LOG_BLOCK("Virtqueue %d stalled waiting on sDDF\n", vq_idx);
+            state->stalled[vq_idx] = true;
+            break;
+        }
+
+        has_completed |= (status == VIRTIO_BLK_REQ_COMPLETED || status == VIRTIO_BLK_REQ_ACKNOWLEDGED);
+        has_submitted |= (status == VIRTIO_BLK_REQ_SUBMITTED || status == VIRTIO_BLK_REQ_ACKNOWLEDGED);
+        virtio_blk_rate_charge(state, virtq, idx, consumed);
+
+        /* The loop increment accounts for one of the consumed requests */
+        idx += consumed - 1;
+    }
+
+    /* Update virtq index to the next available request to be handled */
+    vq->last_idx = idx;
+
+    if (has_submitted && !blk_queue_plugged_req(&h->queue_h)) {
+        microkit_notify(h->server_ch);
+    }
+
+    return has_completed;
+}
+
+static bool virtio_blk_mmio_queue_notify(struct virtio_device *dev)
+{
+    /* QueueNotify holds the index of the virtqueue the driver notified us about,
+       without VIRTIO_BLK_F_MQ this is always the default queue */
+    uint16_t vq_idx = dev->data.QueueNotify;
+    if (vq_idx >= dev->num_vqs) {
+        LOG_BLOCK_ERR("driver notified invalid virtqueue %d\n", vq_idx);
+        return false;
+    }
+    if (!dev->vqs[vq_idx].ready) {
+        LOG_BLOCK_ERR("driver notified virtqueue %d which is not ready\n", vq_idx);
+        return false;
+    }
+
+    struct virtio_blk_device *state = device_state(dev);
+
+    LOG_BLOCK("------------- Driver notified device (virtqueue %d) -------------\n", vq_idx);
+
+    /* If the virtqueue is stalled, the new requests are queued behind the ones
+     * that are already waiting and will be handled when sDDF responds */
+    if (state->stalled[vq_idx]) {
+        return true;
+    }
+
+    bool success = true;
+
+    /* If any request has completed straight away, either because it failed or
+     * because it did not need sDDF, we inject an interrupt */
+    if (virtio_blk_handle_virtq(state, vq_idx)) {
+        virtio_blk_set_interrupt_status(dev, true, false);
+        success = virtio_blk_virq_inject(dev);
+    }
+
+    return success;
+}
+
+static bool virtio_blk_handle_sddf_resp(struct virtio_blk_device *state, struct virtio_blk_sddf_handle *h)
+{
+    struct virtio_device *dev = &state->virtio_device;
+
+    blk_resp_status_t sddf_ret_status;
+    uint16_t sddf_ret_success_count;
+    uint32_t sddf_ret_id;
+
+    bool handled = false;
+    int err = 0;
+    while (!blk_queue_empty_resp(&h->queue_h)) {
+        err = blk_dequeue_resp(&h->queue_h,
+                               &sddf_ret_status,
+                               &sddf_ret_success_count,
+                               &sddf_ret_id);
+        assert(!err);
+
+        h->inflight--;
+        uint64_t complete = virtio_blk_stats_now(state);
+        struct virtio_blk_req_times times = { 0 };
+        if (state->stats_enabled) {
+            times = state->req_times[sddf_ret_id];
+        }
+
+        /* Freeing and retrieving data store */
+        reqbk_t *data = &state->reqbk[sddf_ret_id];
+        ialloc_free(&state->ialloc, sddf_ret_id);
+
+        if (data->readahead) {
+            virtio_blk_readahead_resp(state, sddf_ret_id, sddf_ret_status == BLK_RESP_OK);
+            continue;
+        }
+
+        if (data->acked) {
+            /* Nothing is visible to the driver, unless a flush was waiting on it */
+            virtio_blk_writeback_resp(state, h, sddf_ret_id, sddf_ret_status == BLK_RESP_OK);
+            continue;
+        }
+
+        if (data->dropped) {
+            /* A flush from before the device was reset */
+            state->flush_inflight = REQBK_NONE;
+            virtio_blk_flush_kick(state);
+            continue;
+        }
+
+        struct virtq *virtq = &dev->vqs[data->vq_idx].virtq;
+
+        struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[data->virtio_desc_head].addr;
+
+        if (virtio_req->type == VIRTIO_BLK_T_FLUSH) {
+            virtio_blk_flush_resp(state, sddf_ret_id, sddf_ret_status == BLK_RESP_OK, &times, complete);
+            handled = true;
+            continue;
+        }
+
+        if (data->merged) {
+            virtio_blk_merged_resp(state, h, sddf_ret_id, sddf_ret_status == BLK_RESP_OK, &times, complete);
+            handled = true;
+            continue;
+        }
+
+        if (virtio_req->type == VIRTIO_BLK_T_WRITE_ZEROES) {
+            /* The virtIO request is only completed once all of its sDDF requests are */
+            handled |= virtio_blk_write_zeroes_resp(state, h, data->parent_id, sddf_ret_status == BLK_RESP_OK);
+            continue;
+        }
+
+        uint16_t curr_virtio_desc = virtq->desc[data->virtio_desc_head].next;
+
+        bool resp_success = false;
+        if (sddf_ret_status == BLK_RESP_OK) {
+            resp_success = true;
+            switch (virtio_req->type) {
+            case VIRTIO_BLK_T_IN: {
+                if (!data->zero_copy) {
+                    virtio_blk_copy_from_sddf(state, virtq->desc[curr_virtio_desc].addr, data->virtio_data,
+                                              data->virtio_data_size, virtio_req->sector);
+                }
+                virtio_blk_cache_fill(state, data->cache_epoch, data->sddf_block_number, data->sddf_count,
+                                      data->zero_copy ? virtq->desc[curr_virtio_desc].addr : data->sddf_data);
+                break;
+            }
+            case VIRTIO_BLK_T_OUT: {
+                if (!data->aligned) {
+                    /* Copy the write data into an offset into the allocated sddf data buffer */
+                    virtio_blk_copy_to_sddf(state, data->virtio_data, virtq->desc[curr_virtio_desc].addr,
+                                            data->virtio_data_size, virtio_req->sector);
+
+                    uint32_t new_sddf_id;
+                    ialloc_alloc(&state->ialloc, &new_sddf_id);
+                    state->reqbk[new_sddf_id] = (reqbk_t) {
+                        .virtio_desc_head = data->virtio_desc_head,
+                        .sddf_data = data->sddf_data,
+                        .sddf_count = data->sddf_count,
+                        .sddf_block_number = data->sddf_block_number,
+                        .aligned = true,
+                        .vq_idx = data->vq_idx,
+                    };
+
+                    virtio_blk_sddf_enqueue(state, h,
+                                            BLK_REQ_WRITE,
+                                            data->sddf_data - h->data_region,
+                                            data->sddf_block_number,
+                                            data->sddf_count,
+                                            new_sddf_id,
+                                            times.avail);
+                    microkit_notify(h->server_ch);
+                    continue;
+                }
+                break;
+            }
+            case VIRTIO_BLK_T_FLUSH:
+                break;
+            default: {
+                LOG_BLOCK_ERR(
+                    "Retrieving sDDF block response, but virtIO request type is not recognised: %d\n",
+                    virtio_req->type);
+                resp_success = false;
+                break;
+            }
+            }
+        }
+
+        if (resp_success) {
+            virtio_blk_set_req_success(virtq, data->virtio_desc_head);
+        } else {
+            virtio_blk_set_req_fail(virtq, data->virtio_desc_head);
+        }
+
+        /* Free corresponding bookkeeping structures regardless of the request's
+         * success status */
+        if ((virtio_req->type == VIRTIO_BLK_T_IN || virtio_req->type == VIRTIO_BLK_T_OUT) && !data->zero_copy) {
+            virtio_blk_data_free(h, data->sddf_data, data->sddf_count);
+        }
+
+        virtio_blk_used_buffer(virtq, data->virtio_desc_head);
+        virtio_blk_stats_complete(state, virtio_req->type, times.avail, times.enqueue, complete);
+
+        handled = true;
+    }
+
+    return handled;
+}
+
+static bool virtio_blk_resume(struct virtio_blk_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+
+    bool handled = false;
+    for (int i = 0; i < dev->num_vqs; i++) {
+        if (state->stalled[i] && dev->vqs[i].ready) {
+            handled |= virtio_blk_handle_virtq(state, i);
+        }
+    }
+
+    return handled;
+}
+
+bool virtio_blk_handle_timeout(struct virtio_blk_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+
+    state->rate_timer_armed = false;
+    if (!virtio_blk_resume(state)) {
+        return true;
+    }
+
+    virtio_blk_set_interrupt_status(dev, true, false);
+    return virtio_blk_virq_inject(dev);
+}
+
+bool virtio_blk_handle_resp(struct virtio_blk_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+
+    bool handled = false;
+    for (int i = 0; i < state->num_sddf_handles; i++) {
+        handled |= virtio_blk_handle_sddf_resp(state, &state->sddf_handles[i]);
+    }
+
+    /* Held requests go before any from the available rings */
+    for (int i = 0; i < state->num_sddf_handles; i++) {
+        handled |= virtio_blk_prio_dispatch(state, &state->sddf_handles[i]);
+    }
+
+    /* Writes that flushes were waiting on may have completed */
+    virtio_blk_flush_kick(state);
+
+    /* Now that resources have been freed, resume any virtqueues that were
+     * waiting on them */
+    handled |= virtio_blk_resume(state);
+
+    bool success = true;
+
+    /* We need to know if we handled any responses, if we did we inject an
+     * interrupt, if we didn't we don't inject. virtIO MMIO only gives us one
+     * interrupt line, so it is shared between all virtqueues. */
+    if (handled) {
+        virtio_blk_set_interrupt_status(dev, true, false);
+        success = virtio_blk_virq_inject(dev);
+    }
+
+    if (state->stats_enabled && state->stats_dump_interval != 0
+        && state->stats_since_dump >= state->stats_dump_interval) {
+        virtio_blk_stats_dump(state);
+        state->stats_since_dump = 0;
+    }
+
+    return success;
+}
+
+bool virtio_blk_set_zero_copy(struct virtio_blk_device *blk_dev, size_t handle, uintptr_t guest_ram_vaddr,
+                              size_t guest_ram_size, uintptr_t sddf_offset)
+{
+    if (handle >= blk_dev->num_sddf_handles) {
+        LOG_BLOCK_ERR("invalid sDDF queue %lu for zero-copy\n", handle);
+        return false;
+    }
+    if (guest_ram_vaddr % BLK_TRANSFER_SIZE != 0 || sddf_offset % BLK_TRANSFER_SIZE != 0) {
+        LOG_BLOCK_ERR("zero-copy guest RAM 0x%lx and sDDF offset 0x%lx must be aligned to 0x%x\n",
+                      guest_ram_vaddr, sddf_offset, BLK_TRANSFER_SIZE);
+        return false;
+    }
+
+    if (blk_dev->xts != NULL && guest_ram_size != 0) {
+        LOG_BLOCK_ERR("zero-copy cannot be used with encryption\n");
+        return false;
+    }
+
+    struct virtio_blk_sddf_handle *h = &blk_dev->sddf_handles[handle];
+    h->zero_copy_base = guest_ram_vaddr;
+    h->zero_copy_size = guest_ram_size;
+    h->zero_copy_offset = sddf_offset;
+
+    return true;
+}
+
+bool virtio_blk_set_encryption(struct virtio_blk_device *blk_dev, const aes_xts_ctx_t *ctx)
+{
+    for (int i = 0; i < blk_dev->num_sddf_handles; i++) {
+        if (ctx != NULL && blk_dev->sddf_handles[i].zero_copy_size != 0) {
+            LOG_BLOCK_ERR("encryption cannot be used with zero-copy\n");
+            return false;
+        }
+    }
+
+    blk_dev->xts = ctx;
+    return true;
+}
+
+void virtio_blk_set_max_merge(struct virtio_blk_device *blk_dev, uint16_t max_merge_blocks)
+{
+    blk_dev->max_merge_blocks = max_merge_blocks;
+}
+
+bool virtio_blk_set_cache(struct virtio_blk_device *blk_dev, blk_cache_t *cache)
+{
+    if (cache != NULL && cache->block_size != BLK_TRANSFER_SIZE) {
+        LOG_BLOCK_ERR("block cache has block size 0x%x, expected 0x%x\n", cache->block_size, BLK_TRANSFER_SIZE);
+        return false;
+    }
+
+    blk_dev->cache = cache;
+
+    return true;
+}
+
+bool virtio_blk_set_buddy_alloc(struct virtio_blk_device *blk_dev, size_t handle, void *meta, size_t meta_size)
+{
+    if (handle >= blk_dev->num_sddf_handles) {
+        LOG_BLOCK_ERR("invalid sDDF queue %lu for buddy allocator\n", handle);
+        return false;
+    }
+
+    struct virtio_blk_sddf_handle *h = &blk_dev->sddf_handles[handle];
+    if (h->num_buffers == 0) {
+        LOG_BLOCK_ERR("no data buffers in sDDF queue %lu for buddy allocator\n", handle);
+        return false;
+    }
+
+    /* The zero buffers are kept at the start of the data region, outside of
+     * the cells managed by the buddy allocator, so that they do not split up
+     * the blocks it can hand out */
+    uintptr_t base = h->data_region + h->zero_count * BLK_TRANSFER_SIZE;
+    if (!buddy_init(&h->buddy, base, BLK_TRANSFER_SIZE, h->num_buffers, meta, meta_size)) {
+        LOG_BLOCK_ERR("buddy allocator metadata of 0x%lx bytes is too small, need 0x%lx bytes\n", meta_size,
+                      BUDDY_META_SIZE(h->num_buffers));
+        return false;
+    }
+    h->use_buddy = true;
+    /* No request can be given more than the largest block */
+    h->max_buffers = 1ul << buddy_largest_free_order(&h->buddy);
+
+    if (h->zero_count > 0) {
+        h->zero_data = h->data_region;
+        memset((void *)h->zero_data, 0, h->zero_count * BLK_TRANSFER_SIZE);
+    }
+
+    return true;
+}
+
+bool virtio_blk_stats_enable(struct virtio_blk_device *blk_dev,
+                             struct virtio_blk_req_times *req_times,
+                             size_t num_req_times,
+                             uint32_t dump_interval)
+{
+    if (num_req_times < blk_dev->num_reqs) {
+        LOG_BLOCK_ERR("need %d request trace entries, only given %lu\n", blk_dev->num_reqs, num_req_times);
+        return false;
+    }
+
+    blk_dev->req_times = req_times;
+    blk_dev->stats_dump_interval = dump_interval;
+    virtio_blk_stats_reset(blk_dev);
+    blk_dev->stats_enabled = true;
+
+    return true;
+}
+
+const struct virtio_blk_stats *virtio_blk_get_stats(struct virtio_blk_device *blk_dev)
+{
+    return &blk_dev->stats;
+}
+
+void virtio_blk_stats_reset(struct virtio_blk_device *blk_dev)
+{
+    memset(&blk_dev->stats, 0, sizeof(blk_dev->stats));
+    blk_dev->stats.counter_freq = arch_counter_freq();
+    blk_dev->stats_since_dump = 0;
+}
+
+static void virtio_blk_stats_dump_hist(const char *name, const uint32_t *hist)
+{
+    printf("VIRTIO(BLOCK)|STATS: %s:", name);
+    for (int i = 0; i < VIRTIO_BLK_STATS_BUCKETS; i++) {
+        if (hist[i] != 0) {
+            printf(" [2^%d]=%u", i, hist[i]);
+        }
+    }
+    printf("\n");
+}
+
+void virtio_blk_stats_dump(struct virtio_blk_device *blk_dev)
+{
+    static const char *op_names[VIRTIO_BLK_STATS_NUM_OPS] = { "read", "write", "flush" };
+    static const char *phase_names[VIRTIO_BLK_STATS_NUM_PHASES] = { "queued", "backend", "total" };
+    struct virtio_blk_stats *stats = &blk_dev->stats;
+
+    printf("VIRTIO(BLOCK)|STATS: latencies in ticks of a %lu Hz counter\n", stats->counter_freq);
+    for (int op = 0; op < VIRTIO_BLK_STATS_NUM_OPS; op++) {
+        if (stats->completed[op] == 0) {
+            continue;
+        }
+        printf("VIRTIO(BLOCK)|STATS: %s: %lu completed\n", op_names[op], stats->completed[op]);
+        for (int phase = 0; phase < VIRTIO_BLK_STATS_NUM_PHASES; phase++) {
+            virtio_blk_stats_dump_hist(phase_names[phase], stats->latency[op][phase]);
+        }
+    }
+    printf("VIRTIO(BLOCK)|STATS: max queue depth %u\n", stats->max_queue_depth);
+    virtio_blk_stats_dump_hist("queue depth", stats->queue_depth);
+}
+
+void virtio_blk_set_writeback(struct virtio_blk_device *blk_dev, bool writeback)
+{
+    blk_dev->config.writeback = writeback;
+}
+
+void virtio_blk_set_readahead(struct virtio_blk_device *blk_dev, uint16_t max_window)
+{
+    /* Leave at least half of every data region to requests from the driver */
+    for (int i = 0; i < blk_dev->num_sddf_handles; i++) {
+        max_window = MIN(max_window, blk_dev->sddf_handles[i].num_buffers / 2);
+    }
+
+    struct virtio_blk_readahead *ra = &blk_dev->readahead;
+    if (max_window == 0) {
+        for (int i = 0; i < VIRTIO_BLK_READAHEAD_BUFFERS; i++) {
+            struct virtio_blk_readahead_buf *buf = &ra->bufs[i];
+            if (buf->valid && buf->inflight) {
+                buf->stale = true;
+            } else if (buf->valid) {
+                virtio_blk_readahead_drop(blk_dev, buf);
+            }
+        }
+    }
+    ra->max_window = max_window;
+    ra->window = MIN(VIRTIO_BLK_READAHEAD_MIN_WINDOW, max_window);
+    ra->seq_reads = 0;
+}
+
+void virtio_blk_set_rate_limit(struct virtio_blk_device *blk_dev, const struct virtio_blk_rate_limit *limit,
+                               unsigned int timer_ch)
+{
+    if (limit == NULL) {
+        blk_dev->rate_enabled = false;
+        return;
+    }
+
+    uint64_t freq = arch_counter_freq();
+    virtio_blk_bucket_init(&blk_dev->iops_bucket, limit->iops, limit->iops_burst, freq);
+    virtio_blk_bucket_init(&blk_dev->bps_bucket, limit->bps, limit->bps_burst, freq);
+    blk_dev->rate_last_refill = arch_counter_read();
+    blk_dev->rate_timer_ch = timer_ch;
+    blk_dev->rate_enabled = limit->iops != 0 || limit->bps != 0;
+}
+
+void virtio_blk_set_prio_dispatch(struct virtio_blk_device *blk_dev, bool enable, uint32_t max_wait)
+{
+    blk_dev->prio_enabled = enable;
+    blk_dev->prio_max_wait = max_wait;
 }
 
 static void virtio_blk_config_init(struct virtio_blk_device *blk_dev)
@@ -502,6 +2323,30 @@ static void virtio_blk_config_init(struct virtio_blk_device *blk_dev)
     } else {
         blk_dev->config.blk_size = storage_info->sector_size;
     }
+    blk_dev->config.num_queues = blk_dev->virtio_device.num_vqs;
+
+    virtio_blk_set_discard_limits(blk_dev,
+                                  VIRTIO_BLK_DEFAULT_MAX_DISCARD_SECTORS,
+                                  BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE,
+                                  VIRTIO_BLK_DEFAULT_MAX_WRITE_ZEROES_SECTORS);
+    blk_dev->config.max_discard_seg = 1;
+    blk_dev->config.max_write_zeroes_seg = 1;
+    blk_dev->config.write_zeroes_may_unmap = 0;
+}
+
+void virtio_blk_set_discard_limits(struct virtio_blk_device *blk_dev,
+                                   uint32_t max_discard_sectors,
+                                   uint32_t discard_sector_alignment,
+                                   uint32_t max_write_zeroes_sectors)
+{
+    uint32_t sectors_per_block = BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE;
+
+    blk_dev->config.max_discard_sectors = max_discard_sectors;
+    if (discard_sector_alignment % sectors_per_block != 0) {
+        discard_sector_alignment += sectors_per_block - (discard_sector_alignment % sectors_per_block);
+    }
+    blk_dev->config.discard_sector_alignment = MAX(discard_sector_alignment, sectors_per_block);
+    blk_dev->config.max_write_zeroes_sectors = max_write_zeroes_sectors - (max_write_zeroes_sectors % sectors_per_block);
 }
 
 static virtio_device_funs_t functions = {
@@ -513,48 +2358,142 @@ static virtio_device_funs_t functions = {
     .queue_notify = virtio_blk_mmio_queue_notify,
 };
 
-bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
-                          uintptr_t region_base,
-                          uintptr_t region_size,
-                          size_t virq,
-                          uintptr_t data_region,
-                          size_t data_region_size,
-                          blk_storage_info_t *storage_info,
-                          blk_queue_handle_t *queue_h,
-                          int server_ch)
+bool virtio_mmio_blk_mq_init(struct virtio_blk_device *blk_dev,
+                             uintptr_t region_base,
+                             uintptr_t region_size,
+                             size_t virq,
+                             size_t num_virtqs,
+                             struct virtio_blk_sddf_info *sddf_info,
+                             size_t num_sddf_handles,
+                             blk_storage_info_t *storage_info,
+                             void *bookkeeping,
+                             size_t bookkeeping_size)
 {
     struct virtio_device *dev = &blk_dev->virtio_device;
 
+    if (num_virtqs == 0 || num_virtqs > VIRTIO_BLK_MAX_VIRTQ) {
+        LOG_BLOCK_ERR("invalid number of virtqueues %d, must be between 1 and %d\n",
+                      num_virtqs, VIRTIO_BLK_MAX_VIRTQ);
+        return false;
+    }
+    if (num_sddf_handles == 0 || num_sddf_handles > MIN(num_virtqs, SDDF_BLK_MAX_HANDLES)) {
+        LOG_BLOCK_ERR("invalid number of sDDF queues %d for %d virtqueues\n",
+                      num_sddf_handles, num_virtqs);
+        return false;
+    }
+
+    /* All bookkeeping is sized from the sDDF queues we are given */
+    size_t queue_capacity = 0;
+    size_t data_region_size = 0;
+    for (int i = 0; i < num_sddf_handles; i++) {
+        queue_capacity += sddf_info[i].queue_h.capacity;
+        data_region_size += sddf_info[i].data_region_size;
+    }
+    if (bookkeeping_size < VIRTIO_BLK_BOOKKEEPING_SIZE(queue_capacity, data_region_size, num_sddf_handles)) {
+        LOG_BLOCK_ERR("bookkeeping region of 0x%lx bytes is too small, need 0x%lx bytes\n", bookkeeping_size,
+                      VIRTIO_BLK_BOOKKEEPING_SIZE(queue_capacity, data_region_size, num_sddf_handles));
+        return false;
+    }
+    if ((uintptr_t)bookkeeping % sizeof(uintptr_t) != 0) {
+        LOG_BLOCK_ERR("bookkeeping region 0x%lx is not aligned to 0x%lx\n", bookkeeping, sizeof(uintptr_t));
+        return false;
+    }
+
     dev->data.DeviceID = DEVICE_ID_VIRTIO_BLOCK;
     dev->data.VendorID = VIRTIO_MMIO_DEV_VENDOR_ID;
     dev->funs = &functions;
     dev->vqs = blk_dev->vqs;
-    dev->num_vqs = VIRTIO_BLK_NUM_VIRTQ;
+    dev->num_vqs = num_virtqs;
     dev->virq = virq;
     dev->device_data = blk_dev;
 
     blk_dev->storage_info = storage_info;
-    blk_dev->queue_h = *queue_h;
-    blk_dev->data_region = data_region;
-    blk_dev->server_ch = server_ch;
-
-    size_t sddf_data_buffers = data_region_size / BLK_TRANSFER_SIZE;
-    /* This assert is necessary as the bookkeeping data structures need to have a
-     * defined size at compile time and that depends on the number of buffers
-     * passed to us during initialisation. */
-    assert(sddf_data_buffers <= SDDF_MAX_DATA_BUFFERS);
+    blk_dev->num_sddf_handles = num_sddf_handles;
+    memset(blk_dev->stalled, 0, sizeof(blk_dev->stalled));
+    blk_dev->max_merge_blocks = VIRTIO_BLK_DEFAULT_MAX_MERGE_BLOCKS;
+    blk_dev->cache = NULL;
+    blk_dev->cache_epoch = 0;
+    memset(&blk_dev->readahead, 0, sizeof(blk_dev->readahead));
+    blk_dev->xts = NULL;
+    blk_dev->stats_enabled = false;
+    blk_dev->wb_pending = 0;
+    blk_dev->wb_error = false;
+    blk_dev->wb_inflight = REQBK_NONE;
+    blk_dev->flush_waiting_head = REQBK_NONE;
+    blk_dev->flush_waiting_tail = REQBK_NONE;
+    blk_dev->flush_inflight = REQBK_NONE;
+    blk_dev->prio_enabled = false;
+    blk_dev->prio_max_wait = 0;
+    blk_dev->rate_enabled = false;
+    blk_dev->rate_timer_armed = false;
+    blk_dev->rate_throttled = 0;
+
+    /* The bookkeeping region is laid out as each handle's free data buffer
+     * bitmap, followed by the request bookkeeping and the free request ID list */
+    word_t *words = bookkeeping;
+    for (int i = 0; i < num_sddf_handles; i++) {
+        struct virtio_blk_sddf_handle *h = &blk_dev->sddf_handles[i];
+        h->queue_h = sddf_info[i].queue_h;
+        h->data_region = sddf_info[i].data_region;
+        h->server_ch = sddf_info[i].server_ch;
+        h->zero_copy_size = 0;
+        h->use_buddy = false;
+        h->inflight = 0;
+
+        size_t sddf_data_buffers = sddf_info[i].data_region_size / BLK_TRANSFER_SIZE;
+        fsmalloc_init(&h->fsmalloc,
+                      h->data_region,
+                      BLK_TRANSFER_SIZE,
+                      sddf_data_buffers,
+                      &h->fsmalloc_avail_bitarr,
+                      words,
+                      roundup_bits2words64(sddf_data_buffers));
+        words += roundup_bits2words64(sddf_data_buffers);
+
+        /* Reserve some of the data region as a source of zeroes for write
+         * zeroes requests, if the region is too small we just don't support it */
+        h->zero_count = 0;
+        if (sddf_data_buffers > SDDF_ZERO_DATA_BUFFERS && !fsmalloc_full(&h->fsmalloc, SDDF_ZERO_DATA_BUFFERS)) {
+            fsmalloc_alloc(&h->fsmalloc, &h->zero_data, SDDF_ZERO_DATA_BUFFERS);
+            memset((void *)h->zero_data, 0, SDDF_ZERO_DATA_BUFFERS * BLK_TRANSFER_SIZE);
+            h->zero_count = SDDF_ZERO_DATA_BUFFERS;
+        }
+        h->num_buffers = sddf_data_buffers - h->zero_count;
+        h->max_buffers = h->num_buffers;
+    }
+    virtio_blk_prio_reset(blk_dev);
 
     virtio_blk_config_init(blk_dev);
 
-    fsmalloc_init(&blk_dev->fsmalloc,
-                  data_region,
-                  BLK_TRANSFER_SIZE,
-                  sddf_data_buffers,
-                  &blk_dev->fsmalloc_avail_bitarr,
-                  blk_dev->fsmalloc_avail_bitarr_words,
-                  roundup_bits2words64(sddf_data_buffers));
-
-    ialloc_init(&blk_dev->ialloc, blk_dev->ialloc_idxlist, sddf_data_buffers);
+    /* Request IDs are shared between all sDDF handles, there is one for every
+     * request that can be in the sDDF queues */
+    blk_dev->reqbk = (reqbk_t *)words;
+    blk_dev->num_reqs = queue_capacity;
+    blk_dev->ialloc_idxlist = (uint32_t *)(blk_dev->reqbk + queue_capacity);
+    ialloc_init(&blk_dev->ialloc, blk_dev->ialloc_idxlist, queue_capacity);
 
     return virtio_mmio_register_device(dev, region_base, region_size, virq);
-}
\ No newline at end of file
+}
+
+bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
+                          uintptr_t region_base,
+                          uintptr_t region_size,
+                          size_t virq,
+                          uintptr_t data_region,
+                          size_t data_region_size,
+                          blk_storage_info_t *storage_info,
+                          blk_queue_handle_t *queue_h,
+                          int server_ch,
+                          void *bookkeeping,
+                          size_t bookkeeping_size)
+{
+    struct virtio_blk_sddf_info sddf_info = {
+        .queue_h = *queue_h,
+        .data_region = data_region,
+        .data_region_size = data_region_size,
+        .server_ch = server_ch,
+    };
+
+    return virtio_mmio_blk_mq_init(blk_dev, region_base, region_size, virq, 1, &sddf_info, 1, storage_info,
+                                   bookkeeping, bookkeeping_size);
+}
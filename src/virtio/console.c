@@ -176,6 +176,25 @@ static bool virtio_console_handle_tx(struct virtio_device *dev)
     return true;
 }
 
+/* Copy as much of the sDDF RX queue as fits in a buffer. The data may wrap
+ * around the end of the queue, so this takes at most two copies. */
+static uint32_t virtio_console_rx_copy(serial_queue_handle_t *rxq, char *buf, uint32_t len)
+{
+    uint32_t head = rxq->queue->head;
+    uint32_t copying = MIN(len, rxq->queue->tail - head);
+    /* The data must not be read before the tail that covers it */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    uint32_t offset = head % rxq->capacity;
+    uint32_t first = MIN(copying, rxq->capacity - offset);
+    memcpy(buf, rxq->data_region + offset, first);
+    memcpy(buf + first, rxq->data_region, copying - first);
+
+    serial_update_visible_head(rxq, head + copying);
+
+    return copying;
+}
+
 bool virtio_console_handle_rx(struct virtio_console_device *console)
 {
     LOG_CONSOLE("operation: handle rx\n");
@@ -194,12 +213,7 @@ bool virtio_console_handle_rx(struct virtio_console_device *console)
             uint16_t desc_head = vq->virtq.avail->ring[vq->last_idx % vq->virtq.num];
             struct virtq_desc desc = vq->virtq.desc[desc_head];
             LOG_CONSOLE("processing descriptor (0x%lx) with buffer [0x%lx..0x%lx)\n", desc_head, desc.addr, desc.addr + desc.len);
-            uint32_t bytes_written = 0;
-            char c;
-            while (bytes_written < desc.len && !serial_dequeue(&console->rxq, &console->rxq.queue->head, &c)) {
-                *(char *)(desc.addr + bytes_written) = c;
-                bytes_written++;
-            }
+            uint32_t bytes_written = virtio_console_rx_copy(&console->rxq, (char *)desc.addr, desc.len);
 
             struct virtq_used_elem used_elem = {desc_head, bytes_written};
             vq->virtq.used->ring[vq->virtq.used->idx % vq->virtq.num] = used_elem;
@@ -10,6 +10,7 @@
 #include <libvmm/virq.h>
 #include <libvmm/util/util.h>
 #include <sddf/network/queue.h>
+#include <sddf/timer/client.h>
 
 /* Uncomment this to enable debug logging */
 // #define DEBUG_NET
@@ -22,12 +23,54 @@
 
 #define LOG_NET_ERR(...) do{ printf("VIRTIO(NET)|ERROR: "); printf(__VA_ARGS__); }while(0)
 
+/* Number of avail ring or sDDF queue entries read at once */
+#define VIRTIO_NET_BATCH 32
+
 
 static inline struct virtio_net_device *device_state(struct virtio_device *dev)
 {
     return (struct virtio_net_device *)dev->device_data;
 }
 
+static void virtio_net_filter_reset(struct virtio_net_device *state)
+{
+    memset(&state->filter, 0, sizeof(state->filter));
+    /* Until the driver says otherwise, everything is received */
+    state->filter.promisc = true;
+}
+
+/* Give an sDDF RX buffer back, letting the virtualiser know if it is waiting for one */
+static void virtio_net_rx_free(struct virtio_net_queue_pair *pair, net_buff_desc_t buffer)
+{
+    buffer.len = 0;
+    int error = net_enqueue_free(&pair->rx, buffer);
+    assert(!error);
+
+    if (net_require_signal_free(&pair->rx)) {
+        net_cancel_signal_free(&pair->rx);
+        microkit_notify(pair->rx_ch);
+    }
+}
+
+/* Give backlogged packets, and segments held for coalescing, back to sDDF
+ * when the driver will not take them */
+static void virtio_net_rx_backlog_flush(struct virtio_net_device *state)
+{
+    for (int i = 0; i < VIRTIO_NET_MAX_QUEUE_PAIRS; i++) {
+        struct virtio_net_rx_backlog *backlog = &state->rx_backlog[i];
+        for (; backlog->count != 0; backlog->count--) {
+            struct virtio_net_rx_backlog_entry *entry = &backlog->entries[backlog->head];
+            virtio_net_rx_free(&state->pairs[entry->pair], entry->buffer);
+            backlog->head = (backlog->head + 1) % VIRTIO_NET_RX_BACKLOG;
+        }
+
+        struct virtio_net_gro *gro = &state->rx_gro[i];
+        for (; gro->num_segs != 0; gro->num_segs--) {
+            virtio_net_rx_free(&state->pairs[gro->pair], gro->segs[gro->num_segs - 1]);
+        }
+    }
+}
+
 static void virtio_net_reset(struct virtio_device *dev)
 {
     LOG_NET("operation: reset\n");
@@ -35,6 +78,19 @@ static void virtio_net_reset(struct virtio_device *dev)
         dev->vqs[i].ready = false;
         dev->vqs[i].last_idx = 0;
     }
+
+    struct virtio_net_device *state = device_state(dev);
+    state->driver_features = 0;
+    state->active_pairs = 1;
+    memset(&state->rss, 0, sizeof(state->rss));
+    virtio_net_filter_reset(state);
+    memset(&state->rx_coal, 0, sizeof(state->rx_coal));
+    memset(&state->tx_coal, 0, sizeof(state->tx_coal));
+    virtio_net_rx_backlog_flush(state);
+    /* Zero-copy frames still with sDDF are no longer returned to the guest */
+    for (int i = 0; i < state->num_pairs; i++) {
+        state->pairs[i].inflight_count = 0;
+    }
 }
 
 static bool driver_ok(struct virtio_device *dev)
@@ -43,6 +99,69 @@ static bool driver_ok(struct virtio_device *dev)
            (dev->data.Status & VIRTIO_CONFIG_S_FEATURES_OK);
 }
 
+static uint32_t virtio_net_device_features_low(struct virtio_device *dev)
+{
+    uint32_t features = BIT_LOW(VIRTIO_NET_F_MAC) | BIT_LOW(VIRTIO_NET_F_MTU);
+    /* Checksums and segmentation of TX frames are done by the VMM */
+    features |= BIT_LOW(VIRTIO_NET_F_CSUM) | BIT_LOW(VIRTIO_NET_F_HOST_TSO4) | BIT_LOW(VIRTIO_NET_F_HOST_TSO6);
+    features |= BIT_LOW(VIRTIO_NET_F_GUEST_CSUM) | BIT_LOW(VIRTIO_NET_F_GUEST_TSO4)
+                | BIT_LOW(VIRTIO_NET_F_GUEST_TSO6);
+    /* Packets can be received across several RX buffers */
+    features |= BIT_LOW(VIRTIO_NET_F_MRG_RXBUF);
+    features |= BIT_LOW(VIRTIO_NET_F_CTRL_VQ);
+    /* Packets the driver would drop are filtered out before being copied */
+    features |= BIT_LOW(VIRTIO_NET_F_CTRL_RX) | BIT_LOW(VIRTIO_NET_F_CTRL_VLAN) | BIT_LOW(VIRTIO_NET_F_CTRL_MAC_ADDR);
+    if (device_state(dev)->num_pairs > 1) {
+        features |= BIT_LOW(VIRTIO_NET_F_MQ);
+    }
+
+    return features;
+}
+
+static uint32_t virtio_net_device_features_high(struct virtio_device *dev)
+{
+    uint32_t features = BIT_HIGH(VIRTIO_F_VERSION_1) | BIT_HIGH(VIRTIO_NET_F_HOST_USO);
+    features |= BIT_HIGH(VIRTIO_NET_F_HASH_REPORT);
+    if (device_state(dev)->notf_coal) {
+        features |= BIT_HIGH(VIRTIO_NET_F_NOTF_COAL);
+    }
+    if (device_state(dev)->num_pairs > 1) {
+        features |= BIT_HIGH(VIRTIO_NET_F_RSS);
+    }
+
+    return features;
+}
+
+static inline bool virtio_net_has_feature(struct virtio_net_device *state, int feature)
+{
+    return (state->driver_features >> feature) & 1;
+}
+
+/* Number of queue pairs the driver knows about */
+static uint16_t virtio_net_max_pairs(struct virtio_net_device *state)
+{
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_MQ) || virtio_net_has_feature(state, VIRTIO_NET_F_RSS)) {
+        return state->num_pairs;
+    }
+    return 1;
+}
+
+/* Size of the header in front of each packet on the RX and TX virtqueues */
+static uint32_t virtio_net_hdr_len(struct virtio_net_device *state)
+{
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_HASH_REPORT)) {
+        return sizeof(struct virtio_net_hdr_v1_hash);
+    }
+    return sizeof(struct virtio_net_hdr_mrg_rxbuf);
+}
+
+/* Largest frame that can be sent, frames up to an sDDF buffer are always
+ * allowed as drivers may ignore the MTU */
+static uint32_t virtio_net_max_frame_len(struct virtio_net_device *state)
+{
+    return MAX(NET_BUFFER_SIZE, state->config.mtu + VIRTIO_NET_ETH_HLEN);
+}
+
 static bool virtio_net_get_device_features(struct virtio_device *dev, uint32_t *features)
 {
     LOG_NET("operation: get device features\n");
@@ -54,11 +173,11 @@ static bool virtio_net_get_device_features(struct virtio_device *dev, uint32_t *
     switch (dev->data.DeviceFeaturesSel) {
     /* Feature bits 0 to 31 */
     case 0:
-        *features = BIT_LOW(VIRTIO_NET_F_MAC);
+        *features = virtio_net_device_features_low(dev);
         break;
     /* Features bits 32 to 63 */
     case 1:
-        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        *features = virtio_net_device_features_high(dev);
         break;
     default:
         LOG_NET_ERR("Bad DeviceFeaturesSel 0x%x\n", dev->data.DeviceFeaturesSel);
@@ -70,18 +189,27 @@ static bool virtio_net_get_device_features(struct virtio_device *dev, uint32_t *
 
 static bool virtio_net_set_driver_features(struct virtio_device *dev, uint32_t features)
 {
+    struct virtio_net_device *state = device_state(dev);
     bool success = true;
 
     switch (dev->data.DriverFeaturesSel) {
     /* Feature bits 0 to 31 */
     case 0:
-        /** F_MAC is required */
-        success = (features == BIT_LOW(VIRTIO_NET_F_MAC));
+        /** F_MAC is required, the rest of what we offer is optional */
+        success = (features & BIT_LOW(VIRTIO_NET_F_MAC))
+                  && (features & ~virtio_net_device_features_low(dev)) == 0;
+        if (success) {
+            state->driver_features = (state->driver_features & ~0xffffffffULL) | features;
+        }
         break;
 
     /* Features bits 32 to 63 */
     case 1:
-        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        success = (features & BIT_HIGH(VIRTIO_F_VERSION_1))
+                  && (features & ~virtio_net_device_features_high(dev)) == 0;
+        if (success) {
+            state->driver_features = (state->driver_features & 0xffffffffULL) | ((uint64_t)features << 32);
+        }
         break;
 
     default:
@@ -100,24 +228,14 @@ static bool virtio_net_get_device_config(struct virtio_device *dev,
 {
     struct virtio_net_config *config = &device_state(dev)->config;
 
-    uint32_t word_offset = (offset - REG_VIRTIO_MMIO_CONFIG) / sizeof(uint32_t);
-    switch (word_offset) {
-    case 0:
-        *ret_val = config->mac[0];
-        *ret_val |= config->mac[1] << 8;
-        *ret_val |= config->mac[2] << 16;
-        *ret_val |= config->mac[3] << 24;
-        break;
-
-    case 1:
-        *ret_val = config->mac[4];
-        *ret_val |= config->mac[5] << 8;
-        break;
-
-    default:
+    uint32_t config_offset = (offset - REG_VIRTIO_MMIO_CONFIG) & ~0x3;
+    if (config_offset + sizeof(uint32_t) > sizeof(struct virtio_net_config)) {
         LOG_NET_ERR("Unknown device config register: 0x%x\n", offset);
         return false;
     }
+    /* The config is packed, so the word may not be aligned */
+    memcpy(ret_val, (void *)config + config_offset, sizeof(uint32_t));
+
     return true;
 }
 
@@ -144,232 +262,1848 @@ static bool virtio_net_respond(struct virtio_device *dev)
     return success;
 }
 
-static void handle_tx_msg(struct virtio_device *dev,
-                          struct virtq *virtq,
-                          uint16_t desc_head,
-                          bool *notify_tx_server,
-                          bool *respond_to_guest)
+/* Total length of the data in a descriptor chain */
+static uint32_t chain_len(struct virtq *virtq, uint16_t desc_head)
 {
-    struct virtio_net_device *state = device_state(dev);
-
-    if (net_queue_full_active(&state->tx)) {
-        goto fail;
+    uint32_t len = 0;
+    struct virtq_desc *desc = &virtq->desc[desc_head];
+    while (true) {
+        len += desc->len;
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            return len;
+        }
+        desc = &virtq->desc[desc->next];
     }
+}
 
-    net_buff_desc_t sddf_buffer;
-    int error = net_dequeue_free(&state->tx, &sddf_buffer);
-    if (error) {
-        goto fail;
+/* Copy up to len bytes starting at offset in a descriptor chain, returns the
+ * number of bytes copied */
+static uint32_t chain_read(struct virtq *virtq, uint16_t desc_head, uint32_t offset, void *dest, uint32_t len)
+{
+    uint32_t copied = 0;
+    struct virtq_desc *desc = &virtq->desc[desc_head];
+    while (copied < len) {
+        if (offset < desc->len) {
+            uint32_t copying = MIN(len - copied, desc->len - offset);
+            memcpy(dest + copied, (void *)desc->addr + offset, copying);
+            copied += copying;
+            offset = 0;
+        } else {
+            offset -= desc->len;
+        }
+
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+        desc = &virtq->desc[desc->next];
     }
 
-    void *dest_buf = state->tx_data + sddf_buffer.io_or_offset;
+    return copied;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
 
-    uint32_t written = 0;
-    uint32_t dest_remaining = NET_BUFFER_SIZE;
+static inline uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
 
-    /* Strip virtio header before copying to sDDF */
-    uint32_t skip_remaining = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+static inline void put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val & 0xff;
+}
 
-    struct virtq_desc *desc = &virtq->desc[desc_head];
+static inline void put32(uint8_t *p, uint32_t val)
+{
+    put16(p, val >> 16);
+    put16(p + 2, val & 0xffff);
+}
 
-    while (dest_remaining > 0) {
-        uint32_t skipping = 0;
-        /* Work out how much of this descriptor must be skipped */
-        skipping = MIN(skip_remaining, desc->len);
-        /* Truncate packets that are large than BUF_SIZE */
-        uint32_t writing = MIN(dest_remaining, desc->len - skipping);
+/* Ones' complement sum of 16-bit big-endian words, as used by the internet
+ * checksum */
+static uint64_t csum_add(uint64_t sum, const uint8_t *data, uint32_t len)
+{
+    for (; len > 1; len -= 2, data += 2) {
+        sum += get16(data);
+    }
+    if (len) {
+        sum += data[0] << 8;
+    }
+    return sum;
+}
 
-        memcpy(dest_buf + written, (void *)desc->addr + skipping, writing);
+static uint16_t csum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum & 0xffff;
+}
 
-        skip_remaining -= skipping;
-        written += writing;
-        dest_remaining -= writing;
+#define ETH_TYPE_OFFSET 12
+#define ETH_TYPE_VLAN 0x8100
+#define ETH_TYPE_IPV4 0x0800
+#define ETH_TYPE_IPV6 0x86dd
+#define IPV6_HDR_LEN 40
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+#define UDP_HDR_LEN 8
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+#define TCP_FLAG_CWR 0x80
+
+/* Where the headers of an IP frame are */
+struct frame_layout {
+    uint32_t l3;
+    uint32_t l4;
+    uint32_t hdr_len;
+    bool ipv6;
+    /* Whether this is a fragment of an IPv4 packet */
+    bool fragment;
+    uint8_t proto;
+};
 
-        if (desc->flags & VIRTQ_DESC_F_NEXT) {
-            desc = &virtq->desc[desc->next];
-        } else {
-            break;
+/* Find the IP header of a frame and where the header that follows it starts */
+static bool parse_ip(const uint8_t *frame, uint32_t len, struct frame_layout *layout)
+{
+    uint32_t l3 = ETH_TYPE_OFFSET + 2;
+    if (len < l3) {
+        return false;
+    }
+    uint16_t type = get16(frame + ETH_TYPE_OFFSET);
+    if (type == ETH_TYPE_VLAN) {
+        l3 += 4;
+        if (len < l3) {
+            return false;
         }
+        type = get16(frame + ETH_TYPE_OFFSET + 4);
     }
 
-    sddf_buffer.len = written;
-    error = net_enqueue_active(&state->tx, sddf_buffer);
-    /* This cannot fail as we check above */
-    assert(!error);
-
-    virtq_enqueue_used(virtq, desc_head, written);
-    *respond_to_guest = true;
-    *notify_tx_server = true;
-    return;
+    uint32_t l4;
+    if (type == ETH_TYPE_IPV4) {
+        if (len < l3 + 20) {
+            return false;
+        }
+        l4 = l3 + (frame[l3] & 0xf) * 4;
+        layout->proto = frame[l3 + 9];
+        layout->ipv6 = false;
+        /* More fragments flag or fragment offset */
+        layout->fragment = (get16(frame + l3 + 6) & 0x3fff) != 0;
+    } else if (type == ETH_TYPE_IPV6) {
+        /* Extension headers are not supported */
+        l4 = l3 + IPV6_HDR_LEN;
+        if (len < l4) {
+            return false;
+        }
+        layout->proto = frame[l3 + 6];
+        layout->ipv6 = true;
+        layout->fragment = false;
+    } else {
+        return false;
+    }
 
-fail:
-    virtq_enqueue_used(virtq, desc_head, 0);
-    *respond_to_guest = true;
+    layout->l3 = l3;
+    layout->l4 = l4;
+    return true;
 }
 
-static bool virtio_net_queue_notify(struct virtio_device *dev)
+/* Find the headers of a TCP or UDP frame */
+static bool parse_frame(const uint8_t *frame, uint32_t len, struct frame_layout *layout)
 {
-    struct virtio_net_device *state = device_state(dev);
-
-    if (!driver_ok(dev)) {
-        LOG_NET_ERR("Driver not ready\n");
+    if (!parse_ip(frame, len, layout)) {
         return false;
     }
-    if (dev->data.QueueSel != VIRTIO_NET_TX_VIRTQ) {
-        LOG_NET_ERR("Invalid queue\n");
+
+    uint32_t l4 = layout->l4;
+    uint32_t hdr_len;
+    if (layout->proto == IP_PROTO_TCP) {
+        if (len < l4 + 20) {
+            return false;
+        }
+        hdr_len = l4 + (frame[l4 + 12] >> 4) * 4;
+    } else if (layout->proto == IP_PROTO_UDP) {
+        hdr_len = l4 + UDP_HDR_LEN;
+    } else {
         return false;
     }
-    if (!dev->vqs[VIRTIO_NET_TX_VIRTQ].ready) {
-        LOG_NET_ERR("TX virtq not ready\n");
+    if (len < hdr_len) {
         return false;
     }
 
-    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_TX_VIRTQ];
-    struct virtq *virtq = &vq->virtq;
+    layout->hdr_len = hdr_len;
+    return true;
+}
 
-    uint16_t guest_idx = virtq->avail->idx;
-    uint16_t idx = vq->last_idx;
+/* Sum of the pseudo-header for the TCP/UDP checksum */
+static uint64_t csum_pseudo(const uint8_t *frame, struct frame_layout *layout, uint32_t l4_len)
+{
+    uint64_t sum;
+    if (layout->ipv6) {
+        /* Source and destination addresses */
+        sum = csum_add(0, frame + layout->l3 + 8, 32);
+    } else {
+        sum = csum_add(0, frame + layout->l3 + 12, 8);
+    }
+    return sum + layout->proto + l4_len;
+}
 
-    bool notify_tx_server = false;
-    bool respond_to_guest = false;
+/*
+ * Fix up the headers of segment number seg of a GSO frame, which holds the
+ * payload from payload_offset and is len bytes long including the headers.
+ */
+static void gso_fixup_segment(uint8_t *frame, struct frame_layout *layout, uint32_t len, uint32_t seg,
+                              uint32_t payload_offset, bool last)
+{
+    uint8_t *l3 = frame + layout->l3;
+    uint8_t *l4 = frame + layout->l4;
+    uint32_t l4_len = len - layout->l4;
+
+    if (layout->ipv6) {
+        put16(l3 + 4, len - layout->l3 - IPV6_HDR_LEN);
+    } else {
+        uint32_t ihl = layout->l4 - layout->l3;
+        put16(l3 + 2, len - layout->l3);
+        put16(l3 + 4, get16(l3 + 4) + seg);
+        put16(l3 + 10, 0);
+        put16(l3 + 10, csum_fold(csum_add(0, l3, ihl)));
+    }
 
-    for (; idx != guest_idx; idx++) {
-        uint16_t desc_head = virtq->avail->ring[idx % virtq->num];
-        handle_tx_msg(dev, virtq, desc_head, &notify_tx_server, &respond_to_guest);
+    uint8_t *csum;
+    if (layout->proto == IP_PROTO_TCP) {
+        put32(l4 + 4, get32(l4 + 4) + payload_offset);
+        if (!last) {
+            l4[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (seg != 0) {
+            l4[13] &= ~TCP_FLAG_CWR;
+        }
+        csum = l4 + 16;
+    } else {
+        put16(l4 + 4, l4_len);
+        csum = l4 + 6;
     }
 
-    vq->last_idx = idx;
+    put16(csum, 0);
+    uint16_t sum = csum_fold(csum_add(csum_pseudo(frame, layout, l4_len), l4, l4_len));
+    /* A UDP checksum of zero means there is no checksum */
+    if (sum == 0 && layout->proto == IP_PROTO_UDP) {
+        sum = 0xffff;
+    }
+    put16(csum, sum);
+}
 
-    if (notify_tx_server && net_require_signal_active(&state->tx)) {
-        net_cancel_signal_active(&state->tx);
-        microkit_notify(state->tx_ch);
+/*
+ * Run a filter program on a frame, if there is one. Returns false if the frame
+ * is to be dropped. If queue is given, a received frame can be steered to
+ * another RX virtqueue.
+ */
+static bool virtio_net_bpf_filter(struct virtio_net_device *state, struct virtio_net_bpf *bpf, const uint8_t *frame,
+                                  uint32_t len, uint16_t *queue)
+{
+    if (bpf->prog == NULL) {
+        return true;
     }
 
-    bool success = true;
-    if (respond_to_guest) {
-        success = virtio_net_respond(dev);
+    uint32_t verdict = bpf_run(bpf->prog, frame, len);
+    if (verdict == 0) {
+        bpf->stats.dropped++;
+        return false;
+    }
+    if (queue != NULL && (verdict & VIRTIO_NET_BPF_STEER_MASK) == VIRTIO_NET_BPF_STEER
+        && (verdict & ~VIRTIO_NET_BPF_STEER_MASK) < state->active_pairs) {
+        *queue = verdict & ~VIRTIO_NET_BPF_STEER_MASK;
+        bpf->stats.steered++;
+        return true;
     }
 
-    return success;
+    bpf->stats.passed++;
+    return true;
 }
 
-static uint32_t copy_rx(struct virtq *virtq,
-                        uint16_t *curr_desc_head,
-                        uint32_t *desc_copied,
-                        const void *buf, uint32_t size)
+/* Where a frame is in guest memory if it is all in one descriptor, or 0 */
+static uintptr_t tx_frame_addr(struct virtq *virtq, uint16_t desc_head, uint32_t hdr_len, uint32_t frame_len)
 {
-    uint32_t copied = 0;
-    do {
-        uint32_t copying = MIN(size - copied, virtq->desc[*curr_desc_head].len - *desc_copied);
+    struct virtq_desc *desc = &virtq->desc[desc_head];
+    uint32_t offset = hdr_len;
+    while (offset >= desc->len) {
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            return 0;
+        }
+        offset -= desc->len;
+        desc = &virtq->desc[desc->next];
+    }
+    if (desc->len - offset != frame_len) {
+        return 0;
+    }
 
-        memcpy((void *)virtq->desc[*curr_desc_head].addr + *desc_copied, buf + copied, copying);
+    return desc->addr + offset;
+}
 
-        copied += copying;
-        *desc_copied += copying;
+static inline bool tx_is_zero_copy(struct virtio_net_queue_pair *pair, net_buff_desc_t *buffer)
+{
+    return pair->zero_copy_size != 0 && buffer->io_or_offset >= pair->zero_copy_offset
+           && buffer->io_or_offset - pair->zero_copy_offset < pair->zero_copy_size;
+}
 
-        if (*desc_copied == virtq->desc[*curr_desc_head].len) {
-            if (!(virtq->desc[*curr_desc_head].flags & VIRTQ_DESC_F_NEXT)) {
-                break;
-            }
-            *curr_desc_head = virtq->desc[*curr_desc_head].next;
-            *desc_copied = 0;
+/*
+ * Check whether a buffer sDDF put on the TX free queue is a zero-copy frame,
+ * and if so, return its descriptor chain to the guest. Returns false if the
+ * buffer is from the data region.
+ */
+static bool tx_reclaim(struct virtio_net_queue_pair *pair, struct virtq *virtq, net_buff_desc_t *buffer,
+                       uint32_t *completed)
+{
+    if (!tx_is_zero_copy(pair, buffer)) {
+        return false;
+    }
+
+    /* Frames are normally returned in the order they were sent */
+    for (uint16_t i = 0; i < pair->inflight_count; i++) {
+        struct virtio_net_tx_inflight *frame = &pair->inflight[(pair->inflight_head + i) % VIRTIO_NET_MAX_TX_INFLIGHT];
+        if (!frame->done && frame->io_or_offset == buffer->io_or_offset) {
+            virtq_enqueue_used(virtq, frame->desc_head, frame->len);
+            frame->done = true;
+            (*completed)++;
+            break;
         }
-    } while (copied < size);
+    }
 
-    return copied;
+    while (pair->inflight_count != 0 && pair->inflight[pair->inflight_head].done) {
+        pair->inflight_head = (pair->inflight_head + 1) % VIRTIO_NET_MAX_TX_INFLIGHT;
+        pair->inflight_count--;
+    }
+
+    /* Anything else is a frame sent before the device was reset */
+    return true;
 }
 
-static void handle_rx_buffer(struct virtio_device *dev,
-                             uint64_t buf_offset, uint32_t size,
-                             bool *respond_to_guest)
+/* Keep a buffer of the data region returned by sDDF, which if it held a jumbo
+ * frame gives back all the buffers the frame was in */
+static void tx_spare_put(struct virtio_net_queue_pair *pair, net_buff_desc_t *buffer)
 {
-    struct virtio_net_device *state = device_state(dev);
+    uint64_t first = buffer->io_or_offset / NET_BUFFER_SIZE;
+    uint16_t buffers = 1;
+    for (uint16_t i = 0; i < pair->num_jumbo; i++) {
+        if (pair->jumbo[i].io_or_offset == buffer->io_or_offset) {
+            buffers = pair->jumbo[i].buffers;
+            pair->jumbo[i] = pair->jumbo[--pair->num_jumbo];
+            break;
+        }
+    }
 
-    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_RX_VIRTQ];
-    struct virtq *virtq = &vq->virtq;
+    /* The data region was checked to fit in the bitmap */
+    assert(first + buffers <= pair->tx_buffers);
 
-    uint16_t guest_idx = virtq->avail->idx;
-    uint16_t idx = vq->last_idx;
+    for (uint64_t i = first; i < first + buffers; i++) {
+        pair->spare[i / 64] |= 1ULL << (i % 64);
+    }
+    pair->num_spare += buffers;
+}
 
-    if (idx == guest_idx) {
-        /* vq is full or not initialised, drop the packet */
-        return;
+/* Take a run of adjacent spare buffers */
+static bool tx_spare_take(struct virtio_net_queue_pair *pair, uint16_t buffers, net_buff_desc_t *buffer)
+{
+    if (pair->num_spare < buffers) {
+        return false;
+    }
+
+    uint16_t run = 0;
+    for (uint32_t i = 0; i < pair->tx_buffers; i++) {
+        if (i % 64 == 0 && pair->spare[i / 64] == 0) {
+            run = 0;
+            i += 63;
+            continue;
+        }
+        if (!(pair->spare[i / 64] & (1ULL << (i % 64)))) {
+            run = 0;
+            continue;
+        }
+        if (++run < buffers) {
+            continue;
+        }
+
+        uint32_t first = i + 1 - buffers;
+        for (uint32_t j = first; j <= i; j++) {
+            pair->spare[j / 64] &= ~(1ULL << (j % 64));
+        }
+        pair->num_spare -= buffers;
+        buffer->io_or_offset = (uint64_t)first * NET_BUFFER_SIZE;
+        buffer->len = 0;
+
+        return true;
     }
 
-    /* Read the head of the descriptor chain */
-    uint16_t desc_head = virtq->avail->ring[idx % virtq->num];
-    uint16_t curr_desc_head = desc_head;
+    return false;
+}
 
-    uint32_t copied = 0;
-    /* Amount of the current descriptor copied */
-    uint32_t desc_copied = 0;
+/*
+ * Get space in the data region to copy a frame into, which for a jumbo frame
+ * is several adjacent buffers. Buffers are taken off the free queue until
+ * enough of them are adjacent, the others are kept for later frames.
+ */
+static bool tx_buffer_alloc(struct virtio_net_queue_pair *pair, struct virtq *virtq, uint16_t buffers,
+                            net_buff_desc_t *buffer)
+{
+    /* The guest is notified for the frame being sent anyway */
+    uint32_t completed = 0;
 
-    struct virtio_net_hdr_mrg_rxbuf virtio_hdr = {0};
-    virtio_hdr.num_buffers = 1;
+    if (buffers > 1 && pair->num_jumbo == VIRTIO_NET_MAX_TX_JUMBO) {
+        return false;
+    }
+    if (tx_spare_take(pair, buffers, buffer)) {
+        goto found;
+    }
 
-    copied += copy_rx(virtq, &curr_desc_head, &desc_copied, &virtio_hdr, sizeof(struct virtio_net_hdr_mrg_rxbuf));
-    copied += copy_rx(virtq, &curr_desc_head, &desc_copied, state->rx_data + buf_offset, size);
+    while (net_dequeue_free(&pair->tx, buffer) == 0) {
+        if (tx_reclaim(pair, virtq, buffer, &completed)) {
+            continue;
+        }
+        /* Nothing to look for, unless the buffer held a jumbo frame */
+        if (buffers == 1 && pair->num_jumbo == 0) {
+            return true;
+        }
+        tx_spare_put(pair, buffer);
+        if (tx_spare_take(pair, buffers, buffer)) {
+            goto found;
+        }
+    }
 
-    /* Put it in the used ring */
-    virtq_enqueue_used(virtq, desc_head, copied);
+    return false;
 
-    /* Record that we've used this descriptor chain now */
-    vq->last_idx++;
+found:
+    if (buffers > 1) {
+        pair->jumbo[pair->num_jumbo++] = (struct virtio_net_tx_jumbo) {
+            .io_or_offset = buffer->io_or_offset,
+            .buffers = buffers,
+        };
+    }
 
-    *respond_to_guest = true;
+    return true;
 }
 
-bool virtio_net_handle_rx(struct virtio_net_device *state)
+/*
+ * Give a frame to sDDF without copying it, if it is all in one descriptor in
+ * guest RAM that sDDF can reach. Frames that need a checksum are copied, as
+ * the device must not write to buffers the driver gave it to read. Frames are
+ * also copied while there is a TX filter, as the guest could change a frame in
+ * its own memory after the filter has passed it.
+ */
+static bool tx_zero_copy(struct virtio_net_device *state, struct virtio_net_queue_pair *pair, struct virtq *virtq,
+                         uint16_t desc_head, uint32_t hdr_len, struct virtio_net_hdr *hdr, uint32_t frame_len)
 {
-    struct virtio_device *dev = &state->virtio_device;
-
-    if (!driver_ok(dev)) {
+    if (pair->zero_copy_size == 0 || state->tx_bpf.prog != NULL || hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE
+        || (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) || frame_len == 0 || frame_len > UINT16_MAX) {
         return false;
     }
-    if (!dev->vqs[VIRTIO_NET_RX_VIRTQ].ready) {
-        /* vq is not initialised, drop the packet */
+    if (pair->inflight_count == VIRTIO_NET_MAX_TX_INFLIGHT || net_queue_full_active(&pair->tx)) {
         return false;
     }
 
-    net_buff_desc_t sddf_buffer;
-    bool reprocess = true;
-    bool respond_to_guest = false;
+    uintptr_t addr = tx_frame_addr(virtq, desc_head, hdr_len, frame_len);
+    if (addr == 0 || addr < pair->zero_copy_base || addr - pair->zero_copy_base > pair->zero_copy_size
+        || frame_len > pair->zero_copy_size - (addr - pair->zero_copy_base)) {
+        return false;
+    }
 
-    while (reprocess) {
-        while (net_dequeue_active(&state->rx, &sddf_buffer) != -1) {
-            /* On failure, drop packet since we don't know how long until next interrupt */
-            handle_rx_buffer(dev, sddf_buffer.io_or_offset, sddf_buffer.len, &respond_to_guest);
+    net_buff_desc_t sddf_buffer = {
+        .io_or_offset = pair->zero_copy_offset + (addr - pair->zero_copy_base),
+        .len = frame_len,
+    };
+    int error = net_enqueue_active(&pair->tx, sddf_buffer);
+    assert(!error);
 
-            sddf_buffer.len = 0;
-            net_enqueue_free(&state->rx, sddf_buffer);
-        }
+    uint16_t tail = (pair->inflight_head + pair->inflight_count) % VIRTIO_NET_MAX_TX_INFLIGHT;
+    pair->inflight[tail] = (struct virtio_net_tx_inflight) {
+        .io_or_offset = sddf_buffer.io_or_offset,
+        .len = frame_len,
+        .desc_head = desc_head,
+        .done = false,
+    };
+    pair->inflight_count++;
 
-        net_request_signal_active(&state->rx);
-        reprocess = false;
+    /* Have sDDF tell us when the frame is back */
+    net_request_signal_free(&pair->tx);
 
-        if (!net_queue_empty_active(&state->rx)) {
-            net_cancel_signal_active(&state->rx);
-            reprocess = true;
-        }
+    return true;
+}
+
+/* Send a frame to sDDF as is, apart from finishing its checksum if the driver
+ * left that to us. The copy is filtered before it is sent. */
+static bool tx_frame(struct virtio_net_device *state, struct virtio_net_queue_pair *pair, struct virtq *virtq,
+                     uint16_t desc_head, uint32_t hdr_len, struct virtio_net_hdr *hdr, uint32_t frame_len)
+{
+    uint32_t max_len = virtio_net_max_frame_len(state);
+    /* Truncate packets that are larger than the MTU allows */
+    if (frame_len > max_len) {
+        LOG_NET_ERR("TX frame of %d bytes truncated to %d bytes\n", frame_len, max_len);
+        frame_len = max_len;
     }
 
-    if (respond_to_guest) {
-        return virtio_net_respond(dev);
+    net_buff_desc_t sddf_buffer;
+    uint16_t buffers = MAX(1, (frame_len + NET_BUFFER_SIZE - 1) / NET_BUFFER_SIZE);
+    if (net_queue_full_active(&pair->tx) || !tx_buffer_alloc(pair, virtq, buffers, &sddf_buffer)) {
+        return false;
+    }
+
+    uint8_t *frame = pair->tx_data + sddf_buffer.io_or_offset;
+    uint32_t len = chain_read(virtq, desc_head, hdr_len, frame, frame_len);
+
+    /* The checksum field holds the sum of the pseudo-header, the rest of the
+     * sum is from csum_start to the end of the frame */
+    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && hdr->csum_start + hdr->csum_offset + 2 <= len) {
+        uint16_t sum = csum_fold(csum_add(0, frame + hdr->csum_start, len - hdr->csum_start));
+        put16(frame + hdr->csum_start + hdr->csum_offset, sum);
     }
 
+    if (!virtio_net_bpf_filter(state, &state->tx_bpf, frame, len, NULL)) {
+        tx_spare_put(pair, &sddf_buffer);
+        return false;
+    }
+
+    sddf_buffer.len = len;
+    int error = net_enqueue_active(&pair->tx, sddf_buffer);
+    /* This cannot fail as we check above */
+    assert(!error);
+
     return true;
 }
 
-static virtio_device_funs_t functions = {
-    .device_reset = virtio_net_reset,
-    .get_device_features = virtio_net_get_device_features,
-    .set_driver_features = virtio_net_set_driver_features,
-    .get_device_config = virtio_net_get_device_config,
-    .set_device_config = virtio_net_set_device_config,
-    .queue_notify = virtio_net_queue_notify,
-};
+/* Split a GSO frame into segments of at most gso_size bytes of payload, each
+ * sent in its own sDDF buffer with its headers and checksums fixed up. TCP
+ * segments are made smaller if they would not fit in a buffer, as is the case
+ * for a jumbo MTU, but UDP datagrams cannot be. */
+static bool tx_gso_frame(struct virtio_net_device *state, struct virtio_net_queue_pair *pair, struct virtq *virtq,
+                         uint16_t desc_head, uint32_t hdr_len, struct virtio_net_hdr *hdr, uint32_t frame_len)
+{
+    uint8_t headers[VIRTIO_NET_MAX_GSO_HDR_LEN];
+    uint32_t headers_len = chain_read(virtq, desc_head, hdr_len, headers,
+                                      MIN(frame_len, sizeof(headers)));
 
-bool virtio_mmio_net_init(struct virtio_net_device *net_dev,
+    struct frame_layout layout;
+    if (!parse_frame(headers, headers_len, &layout)) {
+        LOG_NET_ERR("Could not parse headers of GSO frame\n");
+        return false;
+    }
+
+    uint8_t gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    bool valid = (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 && !layout.ipv6 && layout.proto == IP_PROTO_TCP)
+                 || (gso_type == VIRTIO_NET_HDR_GSO_TCPV6 && layout.ipv6 && layout.proto == IP_PROTO_TCP)
+                 || (gso_type == VIRTIO_NET_HDR_GSO_UDP_L4 && layout.proto == IP_PROTO_UDP);
+    uint32_t seg_size = hdr->gso_size;
+    if (layout.proto == IP_PROTO_TCP) {
+        seg_size = MIN(seg_size, NET_BUFFER_SIZE - layout.hdr_len);
+    }
+    if (!valid || seg_size == 0 || layout.hdr_len + seg_size > NET_BUFFER_SIZE) {
+        LOG_NET_ERR("Invalid GSO frame of type 0x%x with segment size %d\n", hdr->gso_type, hdr->gso_size);
+        return false;
+    }
+
+    uint32_t payload_len = frame_len - layout.hdr_len;
+    uint32_t seg = 0;
+    for (uint32_t offset = 0; offset < payload_len; offset += seg_size, seg++) {
+        net_buff_desc_t sddf_buffer;
+        if (net_queue_full_active(&pair->tx) || !tx_buffer_alloc(pair, virtq, 1, &sddf_buffer)) {
+            /* The rest of the frame is dropped, it is up to the protocol to
+             * recover from that */
+            LOG_NET("Out of sDDF buffers after %d segments of GSO frame\n", seg);
+            return seg != 0;
+        }
+
+        uint8_t *frame = pair->tx_data + sddf_buffer.io_or_offset;
+        uint32_t seg_len = MIN(seg_size, payload_len - offset);
+        memcpy(frame, headers, layout.hdr_len);
+        chain_read(virtq, desc_head, hdr_len + layout.hdr_len + offset,
+                   frame + layout.hdr_len, seg_len);
+        gso_fixup_segment(frame, &layout, layout.hdr_len + seg_len, seg, offset, offset + seg_len == payload_len);
+
+        sddf_buffer.len = layout.hdr_len + seg_len;
+        if (!virtio_net_bpf_filter(state, &state->tx_bpf, frame, sddf_buffer.len, NULL)) {
+            tx_spare_put(pair, &sddf_buffer);
+            continue;
+        }
+
+        int error = net_enqueue_active(&pair->tx, sddf_buffer);
+        assert(!error);
+    }
+
+    return true;
+}
+
+/* Most packets to process from a queue in one go */
+static uint32_t virtio_net_budget(struct virtio_net_device *state)
+{
+    return state->budget != 0 ? state->budget : UINT32_MAX;
+}
+
+/*
+ * Have virtio_net_handle_timeout called in delay nanoseconds, unless it will
+ * be sooner already. The sDDF timer only keeps one timeout per client, so
+ * the earliest one wins and the handler sets the next.
+ */
+static void virtio_net_timeout_in(struct virtio_net_device *state, uint64_t delay)
+{
+    uint64_t now = sddf_timer_time_now(state->timer_ch);
+    if (state->timer_armed && state->timer_deadline <= now + delay) {
+        return;
+    }
+
+    /* A delay of 0 fires once the VMM has handled what else is pending */
+    sddf_timer_set_timeout(state->timer_ch, delay);
+    state->timer_armed = true;
+    state->timer_deadline = now + delay;
+}
+
+/*
+ * Interrupt the guest for packets added to the used rings, or hold off until
+ * enough have been or enough time has passed if the driver asked for
+ * notification coalescing.
+ */
+static bool virtio_net_notify(struct virtio_device *dev, struct virtio_net_coal *coal, uint32_t packets)
+{
+    struct virtio_net_device *state = device_state(dev);
+
+    if (packets == 0) {
+        return true;
+    }
+    if (coal->usecs == 0) {
+        return virtio_net_respond(dev);
+    }
+
+    if (coal->pending == 0) {
+        coal->deadline = sddf_timer_time_now(state->timer_ch) + coal->usecs * NS_IN_US;
+        virtio_net_timeout_in(state, coal->usecs * NS_IN_US);
+    }
+    coal->pending += packets;
+    if (coal->max_packets != 0 && coal->pending >= coal->max_packets) {
+        coal->pending = 0;
+        return virtio_net_respond(dev);
+    }
+
+    return true;
+}
+
+static void handle_tx_msg(struct virtio_device *dev,
+                          struct virtio_net_queue_pair *pair,
+                          struct virtq *virtq,
+                          uint16_t desc_head,
+                          bool *notify_tx_server,
+                          uint32_t *completed)
+{
+    struct virtio_net_device *state = device_state(dev);
+    uint32_t hdr_len = virtio_net_hdr_len(state);
+
+    struct virtio_net_hdr virtio_hdr;
+    uint32_t len = chain_len(virtq, desc_head);
+    if (len < hdr_len) {
+        LOG_NET_ERR("TX buffer of %d bytes is too small for the virtIO header\n", len);
+        virtq_enqueue_used(virtq, desc_head, 0);
+        (*completed)++;
+        return;
+    }
+    chain_read(virtq, desc_head, 0, &virtio_hdr, sizeof(virtio_hdr));
+    uint32_t frame_len = len - hdr_len;
+
+    if (tx_zero_copy(state, pair, virtq, desc_head, hdr_len, &virtio_hdr, frame_len)) {
+        /* The chain is returned to the guest when sDDF is done with it */
+        *notify_tx_server = true;
+        return;
+    }
+
+    /* Copied frames are filtered once they are in the data region, so the
+     * guest cannot change them after the filter has run */
+    bool sent;
+    if (virtio_hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        sent = tx_gso_frame(state, pair, virtq, desc_head, hdr_len, &virtio_hdr, frame_len);
+    } else {
+        sent = tx_frame(state, pair, virtq, desc_head, hdr_len, &virtio_hdr, frame_len);
+    }
+
+    virtq_enqueue_used(virtq, desc_head, sent ? frame_len : 0);
+    (*completed)++;
+    *notify_tx_server |= sent;
+}
+
+static bool virtio_net_handle_tx(struct virtio_device *dev, uint16_t pair_idx)
+{
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_queue_pair *pair = &state->pairs[pair_idx];
+
+    virtio_queue_handler_t *vq = &dev->vqs[pair_idx * 2 + VIRTIO_NET_TX_VIRTQ];
+    if (!vq->ready) {
+        LOG_NET_ERR("TX virtq %d not ready\n", pair_idx);
+        return false;
+    }
+    struct virtq *virtq = &vq->virtq;
+
+    bool notify_tx_server = false;
+    uint32_t completed = 0;
+    uint32_t budget = virtio_net_budget(state);
+
+    /* No need for the driver to kick us while we are going through the ring */
+    virtq->used->flags |= VIRTQ_USED_F_NO_NOTIFY;
+
+    pair->tx_pending = false;
+    while (true) {
+        uint16_t desc_heads[VIRTIO_NET_BATCH];
+        uint16_t guest_idx = virtq->avail->idx;
+        uint16_t n = 0;
+        for (; n < VIRTIO_NET_BATCH && n < budget && (uint16_t)(vq->last_idx + n) != guest_idx; n++) {
+            desc_heads[n] = virtq->avail->ring[(uint16_t)(vq->last_idx + n) % virtq->num];
+        }
+
+        for (uint16_t i = 0; i < n; i++) {
+            handle_tx_msg(dev, pair, virtq, desc_heads[i], &notify_tx_server, &completed);
+        }
+        vq->last_idx += n;
+        budget -= n;
+
+        if (vq->last_idx == guest_idx) {
+            /* Drained, let the driver kick us again then check it did not add
+             * anything in the meantime */
+            virtq->used->flags &= ~VIRTQ_USED_F_NO_NOTIFY;
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (vq->last_idx == virtq->avail->idx) {
+                break;
+            }
+            virtq->used->flags |= VIRTQ_USED_F_NO_NOTIFY;
+        }
+        if (budget == 0) {
+            /* Leave the rest for later, without notifications from the driver */
+            pair->tx_pending = true;
+            virtio_net_timeout_in(state, 0);
+            break;
+        }
+    }
+
+    if (notify_tx_server && net_require_signal_active(&pair->tx)) {
+        net_cancel_signal_active(&pair->tx);
+        microkit_notify(pair->tx_ch);
+    }
+
+    return virtio_net_notify(dev, &state->tx_coal, completed);
+}
+
+/* Fields of control commands are little-endian and may not be aligned */
+static inline uint16_t ctrl_get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t ctrl_get32(const uint8_t *p)
+{
+    return ctrl_get16(p) | ((uint32_t)ctrl_get16(p + 2) << 16);
+}
+
+/* Set the hash types and key shared by RSS_CONFIG and HASH_CONFIG */
+static bool virtio_net_ctrl_hash_key(struct virtio_net_device *state, uint32_t hash_types, const uint8_t *key_data,
+                                     uint32_t len)
+{
+    if (len < 1 || key_data[0] > VIRTIO_NET_RSS_MAX_KEY_SIZE || len < 1 + key_data[0]) {
+        return false;
+    }
+    if (hash_types & ~state->config.supported_hash_types) {
+        return false;
+    }
+
+    state->rss.hash_types = hash_types;
+    state->rss.key_len = key_data[0];
+    memcpy(state->rss.key, key_data + 1, key_data[0]);
+
+    return true;
+}
+
+static virtio_net_ctrl_ack virtio_net_ctrl_mq(struct virtio_net_device *state, uint8_t cmd, const uint8_t *data,
+                                              uint32_t len)
+{
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET: {
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_MQ) || len < sizeof(struct virtio_net_ctrl_mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        uint16_t pairs = ctrl_get16(data);
+        if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > state->num_pairs) {
+            LOG_NET_ERR("Driver asked for %d queue pairs, only %d available\n", pairs, state->num_pairs);
+            return VIRTIO_NET_ERR;
+        }
+        state->active_pairs = pairs;
+        state->rss.enabled = false;
+        return VIRTIO_NET_OK;
+    }
+    case VIRTIO_NET_CTRL_MQ_RSS_CONFIG: {
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_RSS) || len < 8) {
+            return VIRTIO_NET_ERR;
+        }
+        uint32_t hash_types = ctrl_get32(data);
+        uint16_t mask = ctrl_get16(data + 4);
+        uint16_t unclassified = ctrl_get16(data + 6);
+        uint32_t table_len = (uint32_t)mask + 1;
+        /* The table length must be a power of two */
+        if (table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN || (table_len & mask) != 0 || unclassified >= state->num_pairs) {
+            return VIRTIO_NET_ERR;
+        }
+        uint32_t tx_offset = 8 + table_len * sizeof(uint16_t);
+        if (len < tx_offset + sizeof(uint16_t)) {
+            return VIRTIO_NET_ERR;
+        }
+        for (uint32_t i = 0; i < table_len; i++) {
+            if (ctrl_get16(data + 8 + i * sizeof(uint16_t)) >= state->num_pairs) {
+                return VIRTIO_NET_ERR;
+            }
+        }
+        uint16_t max_tx_vq = ctrl_get16(data + tx_offset);
+        if (max_tx_vq < 1 || max_tx_vq > state->num_pairs) {
+            return VIRTIO_NET_ERR;
+        }
+        if (!virtio_net_ctrl_hash_key(state, hash_types, data + tx_offset + sizeof(uint16_t),
+                                      len - tx_offset - sizeof(uint16_t))) {
+            return VIRTIO_NET_ERR;
+        }
+
+        for (uint32_t i = 0; i < table_len; i++) {
+            state->rss.table[i] = ctrl_get16(data + 8 + i * sizeof(uint16_t));
+        }
+        state->rss.table_mask = mask;
+        state->rss.unclassified_queue = unclassified;
+        state->rss.enabled = true;
+        state->active_pairs = max_tx_vq;
+        return VIRTIO_NET_OK;
+    }
+    case VIRTIO_NET_CTRL_MQ_HASH_CONFIG:
+        /* Hash types, then four reserved 16-bit fields, then the key */
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_HASH_REPORT) || len < 12) {
+            return VIRTIO_NET_ERR;
+        }
+        if (!virtio_net_ctrl_hash_key(state, ctrl_get32(data), data + 12, len - 12)) {
+            return VIRTIO_NET_ERR;
+        }
+        return VIRTIO_NET_OK;
+    default:
+        LOG_NET_ERR("Unknown multiqueue command %d\n", cmd);
+        return VIRTIO_NET_ERR;
+    }
+}
+
+/* Read one of the two MAC address tables of VIRTIO_NET_CTRL_MAC_TABLE_SET,
+ * returns its length or 0 if it is invalid */
+static uint32_t virtio_net_ctrl_mac_table(const uint8_t *data, uint32_t len, uint8_t table[][VIRTIO_NET_CONFIG_MAC_SZ],
+                                          uint32_t *num)
+{
+    if (len < sizeof(uint32_t)) {
+        return 0;
+    }
+    uint32_t entries = ctrl_get32(data);
+    if (entries > (len - sizeof(uint32_t)) / VIRTIO_NET_CONFIG_MAC_SZ) {
+        return 0;
+    }
+
+    /* Too many to hold means all packets of that kind are received */
+    if (entries <= VIRTIO_NET_MAX_MAC_FILTER) {
+        memcpy(table, data + sizeof(uint32_t), entries * VIRTIO_NET_CONFIG_MAC_SZ);
+    }
+    *num = entries;
+
+    return sizeof(uint32_t) + entries * VIRTIO_NET_CONFIG_MAC_SZ;
+}
+
+static virtio_net_ctrl_ack virtio_net_ctrl_rx(struct virtio_net_device *state, uint8_t cmd, const uint8_t *data,
+                                              uint32_t len)
+{
+    if (!virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_RX) || len < 1) {
+        return VIRTIO_NET_ERR;
+    }
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_RX_PROMISC:
+        state->filter.promisc = data[0] != 0;
+        return VIRTIO_NET_OK;
+    case VIRTIO_NET_CTRL_RX_ALLMULTI:
+        state->filter.allmulti = data[0] != 0;
+        return VIRTIO_NET_OK;
+    default:
+        LOG_NET_ERR("Unknown RX mode command %d\n", cmd);
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static virtio_net_ctrl_ack virtio_net_ctrl_mac(struct virtio_net_device *state, uint8_t cmd, const uint8_t *data,
+                                               uint32_t len)
+{
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_MAC_TABLE_SET: {
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_RX)) {
+            return VIRTIO_NET_ERR;
+        }
+        /* Unicast addresses then multicast addresses */
+        struct virtio_net_filter *filter = &state->filter;
+        uint32_t uni_len = virtio_net_ctrl_mac_table(data, len, filter->uni, &filter->num_uni);
+        if (uni_len == 0
+            || virtio_net_ctrl_mac_table(data + uni_len, len - uni_len, filter->multi, &filter->num_multi) == 0) {
+            filter->num_uni = 0;
+            filter->num_multi = 0;
+            return VIRTIO_NET_ERR;
+        }
+        return VIRTIO_NET_OK;
+    }
+    case VIRTIO_NET_CTRL_MAC_ADDR_SET:
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_MAC_ADDR) || len < VIRTIO_NET_CONFIG_MAC_SZ) {
+            return VIRTIO_NET_ERR;
+        }
+        memcpy(state->config.mac, data, VIRTIO_NET_CONFIG_MAC_SZ);
+        return VIRTIO_NET_OK;
+    default:
+        LOG_NET_ERR("Unknown MAC command %d\n", cmd);
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static virtio_net_ctrl_ack virtio_net_ctrl_vlan(struct virtio_net_device *state, uint8_t cmd, const uint8_t *data,
+                                                uint32_t len)
+{
+    if (!virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_VLAN) || len < sizeof(uint16_t)) {
+        return VIRTIO_NET_ERR;
+    }
+    uint16_t vid = ctrl_get16(data);
+    if (vid >= VIRTIO_NET_MAX_VLAN) {
+        return VIRTIO_NET_ERR;
+    }
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_VLAN_ADD:
+        state->filter.vlans[vid / 32] |= BIT_LOW(vid % 32);
+        return VIRTIO_NET_OK;
+    case VIRTIO_NET_CTRL_VLAN_DEL:
+        state->filter.vlans[vid / 32] &= ~BIT_LOW(vid % 32);
+        return VIRTIO_NET_OK;
+    default:
+        LOG_NET_ERR("Unknown VLAN command %d\n", cmd);
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static virtio_net_ctrl_ack virtio_net_ctrl_notf_coal(struct virtio_net_device *state, uint8_t cmd,
+                                                     const uint8_t *data, uint32_t len)
+{
+    /* TX and RX parameters have the same layout */
+    if (!virtio_net_has_feature(state, VIRTIO_NET_F_NOTF_COAL) || len < sizeof(struct virtio_net_ctrl_coal_rx)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    struct virtio_net_coal *coal;
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_NOTF_COAL_TX_SET:
+        coal = &state->tx_coal;
+        break;
+    case VIRTIO_NET_CTRL_NOTF_COAL_RX_SET:
+        coal = &state->rx_coal;
+        break;
+    default:
+        LOG_NET_ERR("Unknown notification coalescing command %d\n", cmd);
+        return VIRTIO_NET_ERR;
+    }
+
+    coal->max_packets = ctrl_get32(data);
+    coal->usecs = ctrl_get32(data + sizeof(uint32_t));
+
+    return VIRTIO_NET_OK;
+}
+
+static virtio_net_ctrl_ack virtio_net_ctrl(struct virtio_net_device *state, uint8_t class, uint8_t cmd,
+                                           const uint8_t *data, uint32_t len)
+{
+    switch (class) {
+    case VIRTIO_NET_CTRL_RX:
+        return virtio_net_ctrl_rx(state, cmd, data, len);
+    case VIRTIO_NET_CTRL_MAC:
+        return virtio_net_ctrl_mac(state, cmd, data, len);
+    case VIRTIO_NET_CTRL_VLAN:
+        return virtio_net_ctrl_vlan(state, cmd, data, len);
+    case VIRTIO_NET_CTRL_NOTF_COAL:
+        return virtio_net_ctrl_notf_coal(state, cmd, data, len);
+    case VIRTIO_NET_CTRL_MQ:
+        return virtio_net_ctrl_mq(state, cmd, data, len);
+    default:
+        LOG_NET_ERR("Unknown control class %d\n", class);
+        return VIRTIO_NET_ERR;
+    }
+}
+
+/*
+ * A control command is a header and the command's data in device-readable
+ * descriptors, followed by a device-writable descriptor for the ack.
+ */
+static void handle_ctrl_msg(struct virtio_net_device *state, struct virtq *virtq, uint16_t desc_head)
+{
+    uint8_t cmd[VIRTIO_NET_CTRL_MAX_LEN];
+    uint32_t len = 0;
+    bool too_long = false;
+    virtio_net_ctrl_ack *ack = NULL;
+
+    struct virtq_desc *desc = &virtq->desc[desc_head];
+    while (true) {
+        if (desc->flags & VIRTQ_DESC_F_WRITE) {
+            if (ack == NULL && desc->len >= sizeof(virtio_net_ctrl_ack)) {
+                ack = (virtio_net_ctrl_ack *)desc->addr;
+            }
+        } else if (len + desc->len <= sizeof(cmd)) {
+            memcpy(cmd + len, (void *)desc->addr, desc->len);
+            len += desc->len;
+        } else {
+            too_long = true;
+        }
+
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+        desc = &virtq->desc[desc->next];
+    }
+
+    if (ack == NULL) {
+        LOG_NET_ERR("Control command has no buffer for the ack\n");
+        virtq_enqueue_used(virtq, desc_head, 0);
+        return;
+    }
+
+    if (too_long || len < sizeof(struct virtio_net_ctrl_hdr)) {
+        LOG_NET_ERR("Control command of invalid length\n");
+        *ack = VIRTIO_NET_ERR;
+    } else {
+        struct virtio_net_ctrl_hdr *hdr = (struct virtio_net_ctrl_hdr *)cmd;
+        *ack = virtio_net_ctrl(state, hdr->class, hdr->cmd, cmd + sizeof(*hdr), len - sizeof(*hdr));
+    }
+    virtq_enqueue_used(virtq, desc_head, sizeof(virtio_net_ctrl_ack));
+}
+
+static bool virtio_net_handle_ctrl(struct virtio_device *dev, uint16_t vq_idx)
+{
+    struct virtio_net_device *state = device_state(dev);
+
+    virtio_queue_handler_t *vq = &dev->vqs[vq_idx];
+    if (!vq->ready) {
+        LOG_NET_ERR("Control virtq not ready\n");
+        return false;
+    }
+    struct virtq *virtq = &vq->virtq;
+
+    bool respond_to_guest = false;
+    for (; vq->last_idx != virtq->avail->idx; vq->last_idx++) {
+        handle_ctrl_msg(state, virtq, virtq->avail->ring[vq->last_idx % virtq->num]);
+        respond_to_guest = true;
+    }
+
+    if (respond_to_guest) {
+        return virtio_net_respond(dev);
+    }
+
+    return true;
+}
+
+static uint32_t copy_rx(struct virtq *virtq,
+                        uint16_t *curr_desc_head,
+                        uint32_t *desc_copied,
+                        const void *buf, uint32_t size)
+{
+    uint32_t copied = 0;
+    do {
+        uint32_t copying = MIN(size - copied, virtq->desc[*curr_desc_head].len - *desc_copied);
+
+        memcpy((void *)virtq->desc[*curr_desc_head].addr + *desc_copied, buf + copied, copying);
+
+        copied += copying;
+        *desc_copied += copying;
+
+        if (*desc_copied == virtq->desc[*curr_desc_head].len) {
+            if (!(virtq->desc[*curr_desc_head].flags & VIRTQ_DESC_F_NEXT)) {
+                break;
+            }
+            *curr_desc_head = virtq->desc[*curr_desc_head].next;
+            *desc_copied = 0;
+        }
+    } while (copied < size);
+
+    return copied;
+}
+
+/*
+ * Toeplitz hash of the input with the key, as described in the Microsoft RSS
+ * specification. The key must be at least 4 bytes longer than the input.
+ */
+static uint32_t toeplitz_hash(const uint8_t *key, const uint8_t *input, uint32_t len)
+{
+    uint32_t hash = 0;
+    /* The 32 bits of the key lined up with the current input bit */
+    uint32_t window = get32(key);
+
+    for (uint32_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((key[i + 4] >> bit) & 1);
+        }
+    }
+
+    return hash;
+}
+
+/* Hash a received frame with the types and key set by the driver. Returns the
+ * type of hash, or VIRTIO_NET_HASH_REPORT_NONE if none of the types apply. */
+static uint16_t virtio_net_rx_hash(struct virtio_net_rss *rss, const uint8_t *frame, uint32_t len, uint32_t *hash)
+{
+    struct frame_layout layout;
+    if (rss->hash_types == 0 || !parse_ip(frame, len, &layout)) {
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+
+    /* Source and destination addresses, then ports */
+    uint8_t input[36];
+    uint32_t addr_len = layout.ipv6 ? 32 : 8;
+    memcpy(input, frame + layout.l3 + (layout.ipv6 ? 8 : 12), addr_len);
+
+    bool has_ports = !layout.fragment && len >= layout.l4 + 4;
+    bool tcp = has_ports && layout.proto == IP_PROTO_TCP;
+    bool udp = has_ports && layout.proto == IP_PROTO_UDP;
+
+    uint16_t report;
+    if (tcp && (rss->hash_types & (layout.ipv6 ? VIRTIO_NET_RSS_HASH_TYPE_TCPv6 : VIRTIO_NET_RSS_HASH_TYPE_TCPv4))) {
+        report = layout.ipv6 ? VIRTIO_NET_HASH_REPORT_TCPv6 : VIRTIO_NET_HASH_REPORT_TCPv4;
+    } else if (udp
+               && (rss->hash_types & (layout.ipv6 ? VIRTIO_NET_RSS_HASH_TYPE_UDPv6 : VIRTIO_NET_RSS_HASH_TYPE_UDPv4))) {
+        report = layout.ipv6 ? VIRTIO_NET_HASH_REPORT_UDPv6 : VIRTIO_NET_HASH_REPORT_UDPv4;
+    } else if (rss->hash_types & (layout.ipv6 ? VIRTIO_NET_RSS_HASH_TYPE_IPv6 : VIRTIO_NET_RSS_HASH_TYPE_IPv4)) {
+        report = layout.ipv6 ? VIRTIO_NET_HASH_REPORT_IPv6 : VIRTIO_NET_HASH_REPORT_IPv4;
+    } else {
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+
+    uint32_t input_len = addr_len;
+    if (report != VIRTIO_NET_HASH_REPORT_IPv4 && report != VIRTIO_NET_HASH_REPORT_IPv6) {
+        memcpy(input + addr_len, frame + layout.l4, 4);
+        input_len += 4;
+    }
+    if (rss->key_len < input_len + 4) {
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+
+    *hash = toeplitz_hash(rss->key, input, input_len);
+    return report;
+}
+
+/* Part of a packet to be copied to the guest */
+struct rx_span {
+    const void *data;
+    uint32_t len;
+};
+
+/* Copy a packet, made up of one or more spans, into the buffers of an RX
+ * virtqueue, which must be ready. Returns false if the driver has not made
+ * enough buffers available. */
+static bool handle_rx_spans(struct virtio_device *dev,
+                            uint16_t rx_queue,
+                            struct virtio_net_hdr_v1_hash *virtio_hdr,
+                            const struct rx_span *spans, uint32_t num_spans,
+                            uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+    uint32_t hdr_len = virtio_net_hdr_len(state);
+
+    virtio_queue_handler_t *vq = &dev->vqs[rx_queue * 2 + VIRTIO_NET_RX_VIRTQ];
+    struct virtq *virtq = &vq->virtq;
+
+    uint16_t guest_idx = virtq->avail->idx;
+    uint16_t idx = vq->last_idx;
+
+    if (idx == guest_idx) {
+        /* vq is full */
+        return false;
+    }
+
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < num_spans; i++) {
+        size += spans[i].len;
+    }
+
+    virtio_hdr->hdr.num_buffers = 1;
+
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_MRG_RXBUF)) {
+        /* Find how many descriptor chains the packet needs before using any of
+         * them, so that the packet is either received whole or dropped */
+        uint32_t space = chain_len(virtq, virtq->avail->ring[idx % virtq->num]);
+        while (space < hdr_len + size) {
+            if ((uint16_t)(idx + virtio_hdr->hdr.num_buffers) == guest_idx) {
+                /* Not enough buffers */
+                return false;
+            }
+            space += chain_len(virtq, virtq->avail->ring[(idx + virtio_hdr->hdr.num_buffers) % virtq->num]);
+            virtio_hdr->hdr.num_buffers++;
+        }
+    }
+
+    /* Span being copied and how much of it has been */
+    uint32_t span = 0;
+    uint32_t span_copied = 0;
+    for (uint16_t i = 0; i < virtio_hdr->hdr.num_buffers; i++) {
+        /* Read the head of the descriptor chain */
+        uint16_t desc_head = virtq->avail->ring[(idx + i) % virtq->num];
+        uint16_t curr_desc_head = desc_head;
+
+        /* Amount copied into this chain and into the current descriptor */
+        uint32_t chain_copied = 0;
+        uint32_t desc_copied = 0;
+
+        if (i == 0) {
+            chain_copied += copy_rx(virtq, &curr_desc_head, &desc_copied, virtio_hdr, hdr_len);
+        }
+        while (span < num_spans) {
+            uint32_t remaining = spans[span].len - span_copied;
+            uint32_t copying = copy_rx(virtq, &curr_desc_head, &desc_copied, spans[span].data + span_copied,
+                                       remaining);
+            chain_copied += copying;
+            span_copied += copying;
+            if (span_copied == spans[span].len) {
+                span++;
+                span_copied = 0;
+            }
+            if (copying < remaining) {
+                /* The chain is full */
+                break;
+            }
+        }
+
+        /* Put it in the used ring */
+        virtq_enqueue_used(virtq, desc_head, chain_copied);
+    }
+
+    /* Record that we've used these descriptor chains now */
+    vq->last_idx += virtio_hdr->hdr.num_buffers;
+
+    (*received)++;
+    return true;
+}
+
+static bool handle_rx_buffer(struct virtio_device *dev,
+                             uint16_t rx_queue,
+                             struct virtio_net_hdr_v1_hash *virtio_hdr,
+                             const void *buf, uint32_t size,
+                             uint32_t *received)
+{
+    struct rx_span span = { .data = buf, .len = size };
+    return handle_rx_spans(dev, rx_queue, virtio_hdr, &span, 1, received);
+}
+
+/* Pick the RX virtqueue for a packet that came from the sDDF queue of the given
+ * pair, and fill in its hash if the driver asked for it */
+static uint16_t virtio_net_rx_queue(struct virtio_net_device *state, uint16_t pair, const uint8_t *frame,
+                                    uint32_t len, struct virtio_net_hdr_v1_hash *virtio_hdr)
+{
+    uint32_t hash = 0;
+    uint16_t report = virtio_net_rx_hash(&state->rss, frame, len, &hash);
+
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_HASH_REPORT) && report != VIRTIO_NET_HASH_REPORT_NONE) {
+        virtio_hdr->hash_value = hash;
+        virtio_hdr->hash_report = report;
+    }
+
+    if (state->rss.enabled) {
+        if (report == VIRTIO_NET_HASH_REPORT_NONE) {
+            return state->rss.unclassified_queue;
+        }
+        return state->rss.table[hash & state->rss.table_mask];
+    }
+
+    /* Without RSS, packets stay on the pair they arrived on */
+    return pair % state->active_pairs;
+}
+
+static bool bytes_equal(const uint8_t *a, const uint8_t *b, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool mac_equal(const uint8_t *a, const uint8_t *b)
+{
+    return bytes_equal(a, b, VIRTIO_NET_CONFIG_MAC_SZ);
+}
+
+static bool mac_in_table(const uint8_t table[][VIRTIO_NET_CONFIG_MAC_SZ], uint32_t num, const uint8_t *mac)
+{
+    for (uint32_t i = 0; i < num; i++) {
+        if (mac_equal(table[i], mac)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether the driver wants a packet, so that unwanted ones are not copied */
+static bool virtio_net_rx_accept(struct virtio_net_device *state, const uint8_t *frame, uint32_t len)
+{
+    struct virtio_net_filter *filter = &state->filter;
+    if (filter->promisc) {
+        return true;
+    }
+    if (len < ETH_TYPE_OFFSET + 2) {
+        return false;
+    }
+
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_VLAN) && get16(frame + ETH_TYPE_OFFSET) == ETH_TYPE_VLAN) {
+        if (len < ETH_TYPE_OFFSET + 4) {
+            return false;
+        }
+        uint16_t vid = get16(frame + ETH_TYPE_OFFSET + 2) & (VIRTIO_NET_MAX_VLAN - 1);
+        if (!(filter->vlans[vid / 32] & BIT_LOW(vid % 32))) {
+            return false;
+        }
+    }
+
+    /* The destination address comes first */
+    static const uint8_t broadcast[VIRTIO_NET_CONFIG_MAC_SZ] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    if (mac_equal(frame, broadcast)) {
+        return true;
+    }
+    if (frame[0] & 1) {
+        return filter->allmulti || filter->num_multi > VIRTIO_NET_MAX_MAC_FILTER
+               || mac_in_table(filter->multi, filter->num_multi, frame);
+    }
+    return mac_equal(frame, state->config.mac) || filter->num_uni > VIRTIO_NET_MAX_MAC_FILTER
+           || mac_in_table(filter->uni, filter->num_uni, frame);
+}
+
+/* Copy packets waiting in the backlog of an RX virtqueue for as long as the
+ * driver has buffers for them */
+static void virtio_net_rx_drain(struct virtio_device *dev, uint16_t rx_queue, uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_rx_backlog *backlog = &state->rx_backlog[rx_queue];
+
+    while (backlog->count != 0) {
+        struct virtio_net_rx_backlog_entry *entry = &backlog->entries[backlog->head];
+        struct virtio_net_queue_pair *pair = &state->pairs[entry->pair];
+        if (!handle_rx_buffer(dev, rx_queue, &entry->hdr, pair->rx_data + entry->buffer.io_or_offset,
+                              entry->buffer.len, received)) {
+            break;
+        }
+
+        virtio_net_rx_free(pair, entry->buffer);
+        backlog->head = (backlog->head + 1) % VIRTIO_NET_RX_BACKLOG;
+        backlog->count--;
+    }
+}
+
+/*
+ * Receive a packet on an RX virtqueue, or hold on to its sDDF buffer in the
+ * virtqueue's backlog if the driver has no buffers for it yet. Returns true
+ * if the sDDF buffer can be freed.
+ */
+static bool virtio_net_rx_deliver(struct virtio_device *dev, uint16_t pair_idx, uint16_t rx_queue,
+                                  struct virtio_net_hdr_v1_hash *virtio_hdr, net_buff_desc_t buffer,
+                                  uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_rx_backlog *backlog = &state->rx_backlog[rx_queue];
+
+    if (!dev->vqs[rx_queue * 2 + VIRTIO_NET_RX_VIRTQ].ready) {
+        /* vq is not initialised, drop the packet */
+        backlog->stats.dropped++;
+        return true;
+    }
+
+    /* Packets already waiting go first */
+    virtio_net_rx_drain(dev, rx_queue, received);
+    if (backlog->count == 0
+        && handle_rx_buffer(dev, rx_queue, virtio_hdr, state->pairs[pair_idx].rx_data + buffer.io_or_offset,
+                            buffer.len, received)) {
+        return true;
+    }
+
+    if (backlog->count == VIRTIO_NET_RX_BACKLOG) {
+        backlog->stats.dropped++;
+        backlog->stats.overflows++;
+        return true;
+    }
+
+    uint16_t tail = (backlog->head + backlog->count) % VIRTIO_NET_RX_BACKLOG;
+    backlog->entries[tail] = (struct virtio_net_rx_backlog_entry) {
+        .buffer = buffer,
+        .pair = pair_idx,
+        .hdr = *virtio_hdr,
+    };
+    backlog->count++;
+    backlog->stats.backlogged++;
+    backlog->stats.max_occupancy = MAX(backlog->stats.max_occupancy, backlog->count);
+
+    return false;
+}
+
+/*
+ * Whether a frame is a TCP segment that can be merged with others for the
+ * driver: it has only the ACK and maybe PSH flags, carries data, has no IP
+ * options or padding, and its checksums are right, as the driver will not
+ * check them again.
+ */
+static bool virtio_net_gro_segment(struct virtio_net_device *state, const uint8_t *frame, uint32_t len,
+                                   struct frame_layout *layout)
+{
+    if (!parse_frame(frame, len, layout) || layout->proto != IP_PROTO_TCP || layout->fragment
+        || len == layout->hdr_len || !virtio_net_has_feature(state, VIRTIO_NET_F_GUEST_CSUM)) {
+        return false;
+    }
+
+    const uint8_t *l3 = frame + layout->l3;
+    if (layout->ipv6) {
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_GUEST_TSO6) || get16(l3 + 4) != len - layout->l4) {
+            return false;
+        }
+    } else {
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_GUEST_TSO4) || layout->l4 - layout->l3 != 20
+            || get16(l3 + 2) != len - layout->l3 || csum_fold(csum_add(0, l3, 20)) != 0) {
+            return false;
+        }
+    }
+
+    uint8_t flags = frame[layout->l4 + 13];
+    if ((flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK) {
+        return false;
+    }
+
+    uint32_t l4_len = len - layout->l4;
+    return csum_fold(csum_add(csum_pseudo(frame, layout, l4_len), frame + layout->l4, l4_len)) == 0;
+}
+
+/* Whether a segment follows on from the frame being built, with the same
+ * headers apart from the lengths, IPv4 ID and checksums */
+static bool virtio_net_gro_match(struct virtio_net_gro *gro, uint16_t pair, const uint8_t *frame,
+                                 uint32_t len, struct frame_layout *layout)
+{
+    const uint8_t *headers = gro->headers;
+    if (pair != gro->pair || layout->hdr_len != gro->hdr_len || layout->l4 != gro->l4 || layout->ipv6 != gro->ipv6
+        || !bytes_equal(frame, headers, gro->l3)) {
+        return false;
+    }
+
+    const uint8_t *l3 = frame + gro->l3;
+    const uint8_t *gro_l3 = headers + gro->l3;
+    if (gro->ipv6) {
+        if (!bytes_equal(l3, gro_l3, 4) || !bytes_equal(l3 + 6, gro_l3 + 6, IPV6_HDR_LEN - 6)) {
+            return false;
+        }
+    } else if (!bytes_equal(l3, gro_l3, 2) || !bytes_equal(l3 + 6, gro_l3 + 6, 4)
+               || !bytes_equal(l3 + 12, gro_l3 + 12, 8)) {
+        return false;
+    }
+
+    /* Ports, acknowledgement number and options must be the same */
+    const uint8_t *l4 = frame + gro->l4;
+    const uint8_t *gro_l4 = headers + gro->l4;
+    return bytes_equal(l4, gro_l4, 4) && get32(l4 + 4) == gro->next_seq && bytes_equal(l4 + 8, gro_l4 + 8, 4)
+           && bytes_equal(l4 + 20, gro_l4 + 20, gro->hdr_len - gro->l4 - 20)
+           && len - gro->hdr_len <= gro->mss;
+}
+
+/* Give the guest a frame made from several segments, as a GSO frame it could
+ * have sent itself. Returns false if the driver cannot take it yet. */
+static bool virtio_net_gro_deliver(struct virtio_device *dev, uint16_t rx_queue, uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_gro *gro = &state->rx_gro[rx_queue];
+    virtio_queue_handler_t *vq = &dev->vqs[rx_queue * 2 + VIRTIO_NET_RX_VIRTQ];
+    uint32_t len = gro->hdr_len + gro->payload_len;
+
+    if (!vq->ready) {
+        return false;
+    }
+    virtio_net_rx_drain(dev, rx_queue, received);
+    if (state->rx_backlog[rx_queue].count != 0) {
+        return false;
+    }
+    /* Without VIRTIO_NET_F_MRG_RXBUF, the frame must fit in one chain */
+    if (!virtio_net_has_feature(state, VIRTIO_NET_F_MRG_RXBUF) && vq->last_idx != vq->virtq.avail->idx
+        && chain_len(&vq->virtq, vq->virtq.avail->ring[vq->last_idx % vq->virtq.num])
+               < virtio_net_hdr_len(state) + len) {
+        return false;
+    }
+
+    uint8_t *l3 = gro->headers + gro->l3;
+    if (gro->ipv6) {
+        put16(l3 + 4, len - gro->l4);
+    } else {
+        put16(l3 + 2, len - gro->l3);
+        put16(l3 + 10, 0);
+        put16(l3 + 10, csum_fold(csum_add(0, l3, gro->l4 - gro->l3)));
+    }
+
+    /* The checksum is left partial, which the segments' checksums were
+     * checked for, with the sum of the pseudo-header in its place */
+    struct frame_layout layout = {
+        .l3 = gro->l3,
+        .l4 = gro->l4,
+        .hdr_len = gro->hdr_len,
+        .ipv6 = gro->ipv6,
+        .proto = IP_PROTO_TCP,
+    };
+    put16(gro->headers + gro->l4 + 16, (uint16_t)~csum_fold(csum_pseudo(gro->headers, &layout, len - gro->l4)));
+
+    struct virtio_net_hdr_v1_hash virtio_hdr = gro->hdr;
+    virtio_hdr.hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    virtio_hdr.hdr.hdr.gso_type = gro->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+    virtio_hdr.hdr.hdr.hdr_len = gro->hdr_len;
+    virtio_hdr.hdr.hdr.gso_size = gro->mss;
+    virtio_hdr.hdr.hdr.csum_start = gro->l4;
+    virtio_hdr.hdr.hdr.csum_offset = 16;
+
+    /* The headers, then the payload of each segment straight from sDDF */
+    struct rx_span spans[VIRTIO_NET_GRO_MAX_SEGS + 1];
+    spans[0] = (struct rx_span) { .data = gro->headers, .len = gro->hdr_len };
+    const uint8_t *rx_data = state->pairs[gro->pair].rx_data;
+    for (uint16_t i = 0; i < gro->num_segs; i++) {
+        spans[i + 1] = (struct rx_span) {
+            .data = rx_data + gro->segs[i].io_or_offset + gro->hdr_len,
+            .len = gro->segs[i].len - gro->hdr_len,
+        };
+    }
+
+    return handle_rx_spans(dev, rx_queue, &virtio_hdr, spans, gro->num_segs + 1, received);
+}
+
+/* Give the guest the frame being built for an RX virtqueue, or its segments
+ * one by one if it is not ready for the whole frame */
+static void virtio_net_gro_flush(struct virtio_device *dev, uint16_t rx_queue, uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_gro *gro = &state->rx_gro[rx_queue];
+    struct virtio_net_queue_pair *pair = &state->pairs[gro->pair];
+
+    if (gro->num_segs > 1) {
+        if (virtio_net_gro_deliver(dev, rx_queue, received)) {
+            gro->stats.frames++;
+            gro->stats.segments += gro->num_segs;
+            for (uint16_t i = 0; i < gro->num_segs; i++) {
+                virtio_net_rx_free(pair, gro->segs[i]);
+            }
+            gro->num_segs = 0;
+            return;
+        }
+        gro->stats.unmerged++;
+    }
+
+    for (uint16_t i = 0; i < gro->num_segs; i++) {
+        if (virtio_net_rx_deliver(dev, gro->pair, rx_queue, &gro->hdr, gro->segs[i], received)) {
+            virtio_net_rx_free(pair, gro->segs[i]);
+        }
+    }
+    gro->num_segs = 0;
+}
+
+/*
+ * Add a packet to the frame being built for its RX virtqueue, or start a new
+ * frame with it. Returns false if the packet is not a segment that can be
+ * merged, in which case it must be received as is.
+ */
+static bool virtio_net_gro_receive(struct virtio_device *dev, uint16_t pair_idx, uint16_t rx_queue,
+                                   struct virtio_net_hdr_v1_hash *virtio_hdr, net_buff_desc_t buffer,
+                                   uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_gro *gro = &state->rx_gro[rx_queue];
+
+    if (!state->gro) {
+        return false;
+    }
+
+    const uint8_t *frame = state->pairs[pair_idx].rx_data + buffer.io_or_offset;
+    struct frame_layout layout;
+    bool segment = virtio_net_gro_segment(state, frame, buffer.len, &layout);
+    if (gro->num_segs != 0 && !(segment && virtio_net_gro_match(gro, pair_idx, frame, buffer.len, &layout))) {
+        gro->stats.flow_flushes++;
+        virtio_net_gro_flush(dev, rx_queue, received);
+    }
+    if (!segment) {
+        return false;
+    }
+
+    const uint8_t *l4 = frame + layout.l4;
+    uint32_t payload_len = buffer.len - layout.hdr_len;
+    if (gro->num_segs == 0) {
+        /* Nothing follows a segment with PSH */
+        if (l4[13] & TCP_FLAG_PSH) {
+            return false;
+        }
+        memcpy(gro->headers, frame, layout.hdr_len);
+        gro->pair = pair_idx;
+        gro->hdr = *virtio_hdr;
+        gro->l3 = layout.l3;
+        gro->l4 = layout.l4;
+        gro->hdr_len = layout.hdr_len;
+        gro->ipv6 = layout.ipv6;
+        gro->mss = payload_len;
+        gro->payload_len = 0;
+        gro->next_seq = get32(l4 + 4);
+        gro->deadline = 0;
+        if (state->gro_usecs != 0) {
+            gro->deadline = sddf_timer_time_now(state->timer_ch) + (uint64_t)state->gro_usecs * NS_IN_US;
+        }
+    }
+
+    gro->segs[gro->num_segs++] = buffer;
+    gro->payload_len += payload_len;
+    gro->next_seq += payload_len;
+    /* The frame has the latest window and ends with the last segment's PSH */
+    gro->headers[gro->l4 + 13] |= l4[13];
+    memcpy(gro->headers + gro->l4 + 14, l4 + 14, 2);
+
+    /* A segment shorter than the others ends the frame, as does one more
+     * than the IP length allows */
+    bool full = gro->num_segs == VIRTIO_NET_GRO_MAX_SEGS
+                || gro->hdr_len - gro->l3 + gro->payload_len + gro->mss > UINT16_MAX;
+    if ((l4[13] & TCP_FLAG_PSH) || payload_len < gro->mss || full) {
+        virtio_net_gro_flush(dev, rx_queue, received);
+    }
+
+    return true;
+}
+
+/* Give the guest frames that have waited long enough for more segments,
+ * which without a timeout is all of them */
+static void virtio_net_gro_expire(struct virtio_device *dev, uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+
+    if (!state->gro) {
+        return;
+    }
+
+    uint64_t now = 0;
+    for (uint16_t i = 0; i < VIRTIO_NET_MAX_QUEUE_PAIRS; i++) {
+        struct virtio_net_gro *gro = &state->rx_gro[i];
+        if (gro->num_segs == 0) {
+            continue;
+        }
+        if (state->gro_usecs != 0 && now == 0) {
+            now = sddf_timer_time_now(state->timer_ch);
+        }
+        if (now < gro->deadline) {
+            virtio_net_timeout_in(state, gro->deadline - now);
+            continue;
+        }
+        gro->stats.timeout_flushes++;
+        virtio_net_gro_flush(dev, i, received);
+    }
+}
+
+static void virtio_net_handle_rx_pair(struct virtio_device *dev, uint16_t pair_idx, uint32_t *received)
+{
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_queue_pair *pair = &state->pairs[pair_idx];
+    uint32_t budget = virtio_net_budget(state);
+
+    pair->rx_pending = false;
+    while (true) {
+        net_buff_desc_t batch[VIRTIO_NET_BATCH];
+        uint32_t n = 0;
+        while (n < VIRTIO_NET_BATCH && n < budget && net_dequeue_active(&pair->rx, &batch[n]) != -1) {
+            n++;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            const uint8_t *frame = pair->rx_data + batch[i].io_or_offset;
+            if (!virtio_net_rx_accept(state, frame, batch[i].len)) {
+                state->filter.dropped++;
+                virtio_net_rx_free(pair, batch[i]);
+                continue;
+            }
+
+            uint16_t steer_queue = UINT16_MAX;
+            if (!virtio_net_bpf_filter(state, &state->rx_bpf, frame, batch[i].len, &steer_queue)) {
+                virtio_net_rx_free(pair, batch[i]);
+                continue;
+            }
+
+            struct virtio_net_hdr_v1_hash virtio_hdr = {0};
+            uint16_t rx_queue = virtio_net_rx_queue(state, pair_idx, frame, batch[i].len, &virtio_hdr);
+            if (steer_queue != UINT16_MAX) {
+                rx_queue = steer_queue;
+            }
+            if (virtio_net_gro_receive(dev, pair_idx, rx_queue, &virtio_hdr, batch[i], received)) {
+                continue;
+            }
+            if (virtio_net_rx_deliver(dev, pair_idx, rx_queue, &virtio_hdr, batch[i], received)) {
+                virtio_net_rx_free(pair, batch[i]);
+            }
+        }
+        budget -= n;
+
+        /* Only ask to be notified again once the queue is drained */
+        if (net_queue_empty_active(&pair->rx)) {
+            net_request_signal_active(&pair->rx);
+            if (net_queue_empty_active(&pair->rx)) {
+                break;
+            }
+            net_cancel_signal_active(&pair->rx);
+        }
+        if (budget == 0) {
+            pair->rx_pending = true;
+            virtio_net_timeout_in(state, 0);
+            /* Frames being built are not held up until the rest is processed */
+            for (uint16_t q = 0; q < VIRTIO_NET_MAX_QUEUE_PAIRS; q++) {
+                if (state->rx_gro[q].num_segs != 0) {
+                    state->rx_gro[q].stats.budget_flushes++;
+                    virtio_net_gro_flush(dev, q, received);
+                }
+            }
+            break;
+        }
+    }
+}
+
+static bool virtio_net_queue_notify(struct virtio_device *dev)
+{
+    struct virtio_net_device *state = device_state(dev);
+
+    if (!driver_ok(dev)) {
+        LOG_NET_ERR("Driver not ready\n");
+        return false;
+    }
+
+    uint32_t vq_idx = dev->data.QueueNotify;
+    uint16_t max_pairs = virtio_net_max_pairs(state);
+    if (vq_idx == max_pairs * 2 && virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_VQ)) {
+        return virtio_net_handle_ctrl(dev, vq_idx);
+    }
+    if (vq_idx >= max_pairs * 2) {
+        LOG_NET_ERR("Invalid queue\n");
+        return false;
+    }
+    if (vq_idx % 2 == VIRTIO_NET_RX_VIRTQ) {
+        /* New RX buffers, which packets waiting in the backlog can go in.
+         * Others are used as packets arrive from sDDF. */
+        uint32_t received = 0;
+        if (dev->vqs[vq_idx].ready) {
+            virtio_net_rx_drain(dev, vq_idx / 2, &received);
+        }
+        return virtio_net_notify(dev, &state->rx_coal, received);
+    }
+
+    return virtio_net_handle_tx(dev, vq_idx / 2);
+}
+
+bool virtio_net_handle_rx(struct virtio_net_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+
+    if (!driver_ok(dev)) {
+        return false;
+    }
+
+    uint32_t received = 0;
+    for (uint16_t i = 0; i < state->num_pairs; i++) {
+        virtio_net_handle_rx_pair(dev, i, &received);
+    }
+    virtio_net_gro_expire(dev, &received);
+
+    return virtio_net_notify(dev, &state->rx_coal, received);
+}
+
+/* Send the guest the interrupt held back by coalescing once its time is up */
+static bool virtio_net_coal_expire(struct virtio_device *dev, struct virtio_net_coal *coal, uint64_t now)
+{
+    struct virtio_net_device *state = device_state(dev);
+
+    if (coal->pending == 0) {
+        return true;
+    }
+    if (now < coal->deadline) {
+        virtio_net_timeout_in(state, coal->deadline - now);
+        return true;
+    }
+
+    coal->pending = 0;
+    return virtio_net_respond(dev);
+}
+
+bool virtio_net_handle_timeout(struct virtio_net_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+
+    state->timer_armed = false;
+    if (!driver_ok(dev)) {
+        return true;
+    }
+
+    bool success = true;
+    uint32_t received = 0;
+    for (uint16_t i = 0; i < state->num_pairs; i++) {
+        if (state->pairs[i].rx_pending) {
+            virtio_net_handle_rx_pair(dev, i, &received);
+        }
+        if (state->pairs[i].tx_pending) {
+            success &= virtio_net_handle_tx(dev, i);
+        }
+    }
+    virtio_net_gro_expire(dev, &received);
+    success &= virtio_net_notify(dev, &state->rx_coal, received);
+
+    uint64_t now = sddf_timer_time_now(state->timer_ch);
+    success &= virtio_net_coal_expire(dev, &state->rx_coal, now);
+    success &= virtio_net_coal_expire(dev, &state->tx_coal, now);
+
+    return success;
+}
+
+bool virtio_net_handle_tx_free(struct virtio_net_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+    uint32_t completed = 0;
+
+    for (uint16_t i = 0; i < state->num_pairs; i++) {
+        struct virtio_net_queue_pair *pair = &state->pairs[i];
+        struct virtq *virtq = &dev->vqs[i * 2 + VIRTIO_NET_TX_VIRTQ].virtq;
+        if (pair->zero_copy_size == 0) {
+            continue;
+        }
+
+        bool reprocess = true;
+        while (reprocess) {
+            /* Buffers from the data region are kept for copying later frames */
+            net_buff_desc_t sddf_buffer;
+            while (net_dequeue_free(&pair->tx, &sddf_buffer) == 0) {
+                if (!tx_reclaim(pair, virtq, &sddf_buffer, &completed)) {
+                    tx_spare_put(pair, &sddf_buffer);
+                }
+            }
+
+            reprocess = false;
+            if (pair->inflight_count != 0) {
+                net_request_signal_free(&pair->tx);
+                if (!net_queue_empty_free(&pair->tx)) {
+                    net_cancel_signal_free(&pair->tx);
+                    reprocess = true;
+                }
+            }
+        }
+    }
+
+    return virtio_net_notify(dev, &state->tx_coal, completed);
+}
+
+static virtio_device_funs_t functions = {
+    .device_reset = virtio_net_reset,
+    .get_device_features = virtio_net_get_device_features,
+    .set_driver_features = virtio_net_set_driver_features,
+    .get_device_config = virtio_net_get_device_config,
+    .set_device_config = virtio_net_set_device_config,
+    .queue_notify = virtio_net_queue_notify,
+};
+
+bool virtio_mmio_net_init(struct virtio_net_device *net_dev,
                           uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ],
                           uintptr_t region_base,
                           uintptr_t region_size,
@@ -378,6 +2112,7 @@ bool virtio_mmio_net_init(struct virtio_net_device *net_dev,
                           net_queue_handle_t *tx,
                           uintptr_t rx_data,
                           uintptr_t tx_data,
+                          size_t tx_data_size,
                           microkit_channel rx_ch,
                           microkit_channel tx_ch)
 {
@@ -387,18 +2122,168 @@ bool virtio_mmio_net_init(struct virtio_net_device *net_dev,
     dev->data.VendorID = VIRTIO_MMIO_DEV_VENDOR_ID;
     dev->funs = &functions;
     dev->vqs = net_dev->vqs;
-    dev->num_vqs = VIRTIO_NET_NUM_VIRTQ;
+    /* One queue pair and the control virtqueue */
+    dev->num_vqs = 3;
     dev->virq = virq;
     dev->device_data = net_dev;
 
     memcpy(net_dev->config.mac, mac, VIRTIO_NET_CONFIG_MAC_SZ);
-
-    net_dev->rx = *rx;
-    net_dev->tx = *tx;
-    net_dev->rx_data = (void *)rx_data;
-    net_dev->tx_data = (void *)tx_data;
-    net_dev->rx_ch = rx_ch;
-    net_dev->tx_ch = tx_ch;
+    net_dev->config.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    net_dev->config.rss_max_indirection_table_length = VIRTIO_NET_RSS_MAX_TABLE_LEN;
+    net_dev->config.mtu = MIN(VIRTIO_NET_DEFAULT_MTU, NET_BUFFER_SIZE - VIRTIO_NET_ETH_HLEN);
+    net_dev->config.supported_hash_types = VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4
+                                           | VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | VIRTIO_NET_RSS_HASH_TYPE_IPv6
+                                           | VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+    net_dev->driver_features = 0;
+    net_dev->budget = 0;
+    net_dev->notf_coal = false;
+    net_dev->timer_armed = false;
+    net_dev->active_pairs = 1;
+    memset(&net_dev->rss, 0, sizeof(net_dev->rss));
+    virtio_net_filter_reset(net_dev);
+    memset(&net_dev->rx_coal, 0, sizeof(net_dev->rx_coal));
+    memset(&net_dev->tx_coal, 0, sizeof(net_dev->tx_coal));
+    net_dev->gro = false;
+    memset(net_dev->rx_gro, 0, sizeof(net_dev->rx_gro));
+    memset(&net_dev->rx_bpf, 0, sizeof(net_dev->rx_bpf));
+    memset(&net_dev->tx_bpf, 0, sizeof(net_dev->tx_bpf));
+
+    net_dev->num_pairs = 0;
+    if (!virtio_net_add_queue_pair(net_dev, rx, tx, rx_data, tx_data, tx_data_size, rx_ch, tx_ch)) {
+        return false;
+    }
 
     return virtio_mmio_register_device(dev, region_base, region_size, virq);
 }
+
+bool virtio_net_add_queue_pair(struct virtio_net_device *net_dev,
+                               net_queue_handle_t *rx,
+                               net_queue_handle_t *tx,
+                               uintptr_t rx_data,
+                               uintptr_t tx_data,
+                               size_t tx_data_size,
+                               microkit_channel rx_ch,
+                               microkit_channel tx_ch)
+{
+    if (net_dev->num_pairs == VIRTIO_NET_MAX_QUEUE_PAIRS) {
+        LOG_NET_ERR("Cannot have more than %d queue pairs\n", VIRTIO_NET_MAX_QUEUE_PAIRS);
+        return false;
+    }
+    /* Every buffer sDDF gives back must have a place in the spare bitmap, and
+     * a frame of the MTU must fit in the region */
+    size_t tx_buffers = tx_data_size / NET_BUFFER_SIZE;
+    if (tx_buffers > VIRTIO_NET_MAX_TX_SPARE) {
+        LOG_NET_ERR("TX data region of 0x%lx bytes has more than VIRTIO_NET_MAX_TX_SPARE (%d) buffers\n",
+                    tx_data_size, VIRTIO_NET_MAX_TX_SPARE);
+        return false;
+    }
+    if (tx_buffers * NET_BUFFER_SIZE < net_dev->config.mtu + VIRTIO_NET_ETH_HLEN) {
+        LOG_NET_ERR("TX data region of 0x%lx bytes cannot hold a frame of MTU %d\n", tx_data_size,
+                    net_dev->config.mtu);
+        return false;
+    }
+
+    struct virtio_net_queue_pair *pair = &net_dev->pairs[net_dev->num_pairs];
+    pair->rx = *rx;
+    pair->tx = *tx;
+    pair->rx_data = (void *)rx_data;
+    pair->tx_data = (void *)tx_data;
+    pair->rx_ch = rx_ch;
+    pair->tx_ch = tx_ch;
+    pair->zero_copy_size = 0;
+    pair->inflight_head = 0;
+    pair->inflight_count = 0;
+    memset(pair->spare, 0, sizeof(pair->spare));
+    pair->num_spare = 0;
+    pair->tx_buffers = tx_buffers;
+    pair->num_jumbo = 0;
+    pair->rx_pending = false;
+    pair->tx_pending = false;
+
+    net_dev->num_pairs++;
+    net_dev->config.max_virtqueue_pairs = net_dev->num_pairs;
+    /* The control virtqueue comes after the queue pairs */
+    net_dev->virtio_device.num_vqs = net_dev->num_pairs * 2 + 1;
+
+    return true;
+}
+
+bool virtio_net_set_zero_copy(struct virtio_net_device *net_dev, uint16_t pair, uintptr_t guest_ram_vaddr,
+                              size_t guest_ram_size, uintptr_t sddf_offset)
+{
+    if (pair >= net_dev->num_pairs) {
+        LOG_NET_ERR("invalid queue pair %d for zero-copy\n", pair);
+        return false;
+    }
+
+    struct virtio_net_queue_pair *p = &net_dev->pairs[pair];
+    p->zero_copy_base = guest_ram_vaddr;
+    p->zero_copy_size = guest_ram_size;
+    p->zero_copy_offset = sddf_offset;
+
+    return true;
+}
+
+void virtio_net_set_budget(struct virtio_net_device *net_dev, uint32_t budget, unsigned int timer_ch)
+{
+    net_dev->budget = budget;
+    net_dev->timer_ch = timer_ch;
+}
+
+void virtio_net_set_notf_coal(struct virtio_net_device *net_dev, unsigned int timer_ch)
+{
+    net_dev->notf_coal = true;
+    net_dev->timer_ch = timer_ch;
+}
+
+bool virtio_net_set_mtu(struct virtio_net_device *net_dev, uint16_t mtu)
+{
+    if (mtu < VIRTIO_NET_MIN_MTU || mtu > UINT16_MAX - VIRTIO_NET_ETH_HLEN) {
+        LOG_NET_ERR("Invalid MTU %d\n", mtu);
+        return false;
+    }
+    /* A jumbo frame has to fit in adjacent buffers of every TX data region */
+    uint32_t buffers = (mtu + VIRTIO_NET_ETH_HLEN + NET_BUFFER_SIZE - 1) / NET_BUFFER_SIZE;
+    for (uint16_t i = 0; i < net_dev->num_pairs; i++) {
+        if (buffers > net_dev->pairs[i].tx_buffers) {
+            LOG_NET_ERR("MTU %d does not fit in the TX data region of queue pair %d\n", mtu, i);
+            return false;
+        }
+    }
+
+    net_dev->config.mtu = mtu;
+
+    return true;
+}
+
+void virtio_net_set_gro(struct virtio_net_device *net_dev, uint32_t usecs, unsigned int timer_ch)
+{
+    net_dev->gro = true;
+    net_dev->gro_usecs = usecs;
+    if (usecs != 0) {
+        net_dev->timer_ch = timer_ch;
+    }
+}
+
+static bool virtio_net_set_bpf(struct virtio_net_bpf *bpf, const bpf_insn_t *prog, uint32_t len)
+{
+    if (prog != NULL && !bpf_verify(prog, len)) {
+        LOG_NET_ERR("Filter program rejected by the verifier\n");
+        return false;
+    }
+
+    bpf->prog = prog;
+    bpf->len = len;
+
+    return true;
+}
+
+bool virtio_net_set_rx_filter(struct virtio_net_device *net_dev, const bpf_insn_t *prog, uint32_t len)
+{
+    return virtio_net_set_bpf(&net_dev->rx_bpf, prog, len);
+}
+
+bool virtio_net_set_tx_filter(struct virtio_net_device *net_dev, const bpf_insn_t *prog, uint32_t len)
+{
+    return virtio_net_set_bpf(&net_dev->tx_bpf, prog, len);
+}
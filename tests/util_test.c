@@ -0,0 +1,37 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Runs the self-tests of the utilities that only depend on the C library, so
+ * that they can be checked on the development host rather than in a guest.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <libvmm/util/aes_xts.h>
+#include <libvmm/util/bpf.h>
+
+struct self_test {
+    const char *name;
+    bool (*run)(void);
+};
+
+static const struct self_test tests[] = {
+    { "aes_xts", aes_xts_self_test },
+    { "bpf", bpf_self_test },
+};
+
+int main(void)
+{
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool passed = tests[i].run();
+        printf("%s: %s\n", tests[i].name, passed ? "PASS" : "FAIL");
+        failed += !passed;
+    }
+
+    return failed != 0;
+}
@@ -44,6 +44,10 @@ endif
 
 ARCH_INDEP_FILES := src/util/printf.c \
 		    src/util/util.c \
+		    src/util/block_cache.c \
+		    src/util/buddy.c \
+		    src/util/aes_xts.c \
+		    src/util/bpf.c \
 		    src/virtio/block.c \
 		    src/virtio/console.c \
 		    src/virtio/mmio.c \
@@ -54,6 +58,12 @@ ARCH_INDEP_FILES := src/util/printf.c \
 CFILES := ${AARCH64_FILES} ${ARCH_INDEP_FILES}
 OBJECTS := $(subst src,libvmm,${CFILES:.c=.o})
 
+# Set LIBVMM_AES_CE=1 to encrypt disks with the ARMv8 AES instructions, only
+# for CPUs that implement the Cryptography Extension
+ifeq (${LIBVMM_AES_CE},1)
+libvmm/util/aes_xts.o: CFLAGS += -march=armv8-a+crypto -DLIBVMM_AES_CE
+endif
+
 
 # Generate dependencies automatically
 CFLAGS += -MD
@@ -61,7 +71,7 @@ CFLAGS += -MD
 # Force rebuid if CFLAGS changes.
 # This will pick up (among other things} changes
 # to Microkit BOARD and CONFIG.
-CHECK_LIBVMM_CFLAGS:=.libvmm_cflags.$(shell echo ${CFLAGS} | shasum | sed 's/ *-$$//')
+CHECK_LIBVMM_CFLAGS:=.libvmm_cflags.$(shell echo ${CFLAGS} ${LIBVMM_AES_CE} | shasum | sed 's/ *-$$//')
 .libvmm_cflags.%:
 	rm -f .libvmm_cflags.*
 	echo ${CFLAGS} > $@